@@ -0,0 +1,603 @@
+#ifndef SEALM_ALIGNMENT_HPP
+#define SEALM_ALIGNMENT_HPP
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cctype>
+#include <cmath>
+#include <charconv>
+#include <optional>
+
+namespace SeAlM {
+
+/*
+ *
+ *  ALIGNMENT RECORDS
+ *
+ *  Binary form of one SAM alignment that leaves out the fields already held by the read:
+ *  QNAME, SEQ and QUAL. Cached this way an alignment costs a few dozen bytes instead of a full
+ *  line, and rendering it for another read with the same sequence puts that read's name and
+ *  qualities in the line. Encoded records start with RECORD_TAG, which never starts a SAM line,
+ *  so a cache can hold records and raw lines side by side.
+ *
+ *  Encoding:   tag | flag | mapq | pos | pnext | tlen | rname | rnext | n_cigar | cigar | tags
+ *
+ *  Reference names are kept in the record rather than as ids into a table, so records stay
+ *  valid in snapshots taken by another run. CIGAR operations use the BAM packing (len << 4 | op)
+ *  and optional fields are kept as their SAM text.
+ *
+ *  A read and its reverse complement align to the same place on opposite strands, so with
+ *  canonical keys one cached alignment serves both. SAM keeps positions, CIGAR and the usual
+ *  tags (MD, NM, AS, XS) in reference orientation, so switching to the other read only flips
+ *  flag 0x10 and rebuilds SEQ and QUAL from that read. Tags holding per-base data of the read
+ *  that was aligned (OQ, E2, U2) cannot be rebuilt for the other read and are dropped.
+ *
+ */
+
+    static constexpr char RECORD_TAG = '\x01';
+    static constexpr char CIGAR_OPS[] = "MIDNSHP=X";
+
+    // CIGAR operations as packed in records, indices into CIGAR_OPS
+    enum CigarOp : uint8_t {
+        CIGAR_MATCH = 0,
+        CIGAR_INS = 1,
+        CIGAR_DEL = 2,
+        CIGAR_REF_SKIP = 3,
+        CIGAR_SOFT_CLIP = 4,
+        CIGAR_HARD_CLIP = 5,
+        CIGAR_PAD = 6,
+        CIGAR_EQUAL = 7,
+        CIGAR_DIFF = 8
+    };
+
+    // SAM read name of a FASTQ/FASTA header line: without the marker and anything after a space
+    inline std::string_view read_name(std::string_view header) {
+        if (!header.empty() && (header[0] == '@' || header[0] == '>'))
+            header.remove_prefix(1);
+        return header.substr(0, header.find_first_of(" \t"));
+    }
+
+    inline char complement(char base) {
+        switch (base) {
+            case 'A':
+                return 'T';
+            case 'C':
+                return 'G';
+            case 'G':
+                return 'C';
+            case 'T':
+                return 'A';
+            case 'a':
+                return 't';
+            case 'c':
+                return 'g';
+            case 'g':
+                return 'c';
+            case 't':
+                return 'a';
+            default:
+                return 'N';
+        }
+    }
+
+    // true if seq is not greater than its reverse complement, which is then the cache key
+    inline bool is_canonical(std::string_view seq) {
+        size_t n = seq.size();
+        for (size_t i = 0; i < n; i++) {
+            char rc = complement(seq[n - 1 - i]);
+            if (seq[i] != rc)
+                return seq[i] < rc;
+        }
+        return true;
+    }
+
+    inline std::string reverse_complement(std::string_view seq) {
+        std::string rc(seq.size(), 'N');
+        for (size_t i = 0; i < seq.size(); i++)
+            rc[i] = complement(seq[seq.size() - 1 - i]);
+        return rc;
+    }
+
+    struct AlignmentRecord {
+        static constexpr uint16_t PAIRED = 0x1;
+        static constexpr uint16_t UNMAPPED = 0x4;
+        static constexpr uint16_t REVERSE = 0x10;
+
+        uint16_t flag;
+        uint8_t mapq;
+        int32_t pos;
+        int32_t next_pos;
+        int32_t tlen;
+        std::string_view rname;
+        std::string_view rnext;
+        std::vector<uint32_t> cigar;
+        std::string_view tags; // tab separated, empty if none
+        bool flipped = false; // describes the reverse complement of the read tags came from
+
+        // read fields of a parsed line, not encoded
+        std::string_view qname;
+        std::string_view sam_seq;
+        std::string_view sam_qual;
+
+        bool reverse() const { return flag & REVERSE; }
+
+        // the same alignment for the reverse complement of the read
+        void flip_strand() {
+            if (!(flag & UNMAPPED))
+                flag ^= REVERSE;
+            flipped = !flipped;
+        }
+
+        /*
+         * SAM Conversion
+         */
+
+        // parses a SAM alignment line, views into line, which must outlive the record
+        bool parse(std::string_view line);
+
+        // parses an aligner's SAM line for the read it aligned, false if the line cannot be rebuilt
+        // from the record and the read, in which case the raw line should be kept
+        bool parse(std::string_view line, std::string_view name, std::string_view seq, std::string_view qual);
+
+        // SAM line for a read, appended to out
+        void render(std::string &out, std::string_view name, std::string_view seq, std::string_view qual) const;
+
+        /*
+         * Binary Encoding
+         */
+
+        static bool is_record(std::string_view bytes) { return !bytes.empty() && bytes[0] == RECORD_TAG; }
+
+        void encode(std::string &out) const;
+
+        // views into bytes, which must outlive the record
+        bool decode(std::string_view bytes);
+    };
+
+    // rewrites a SAM line aligned for the reverse complement of a read as the line for the read,
+    // false if the line is already for the read or is not for either orientation
+    bool reorient_line(std::string_view line, std::string_view seq, std::string_view qual, std::string &out);
+
+    namespace detail {
+        inline bool next_field(std::string_view &line, std::string_view &field) {
+            if (line.data() == nullptr)
+                return false;
+            size_t tab = line.find('\t');
+            field = line.substr(0, tab);
+            line = tab == std::string_view::npos ? std::string_view() : line.substr(tab + 1);
+            return true;
+        }
+
+        template<typename I>
+        bool parse_int(std::string_view field, I &value) {
+            auto res = std::from_chars(field.data(), field.data() + field.size(), value);
+            return res.ec == std::errc() && res.ptr == field.data() + field.size();
+        }
+
+        template<typename I>
+        void append_int(std::string &out, I value) {
+            char buf[16];
+            auto res = std::to_chars(buf, buf + sizeof(buf), value);
+            out.append(buf, res.ptr - buf);
+        }
+
+        template<typename I>
+        void put(std::string &out, I value) { out.append(reinterpret_cast<const char *>(&value), sizeof(value)); }
+
+        template<typename I>
+        bool get(std::string_view &bytes, I &value) {
+            if (bytes.size() < sizeof(value))
+                return false;
+            std::memcpy(&value, bytes.data(), sizeof(value));
+            bytes.remove_prefix(sizeof(value));
+            return true;
+        }
+
+        inline bool get_str(std::string_view &bytes, std::string_view &value) {
+            uint8_t len;
+            if (!get(bytes, len) || bytes.size() < len)
+                return false;
+            value = bytes.substr(0, len);
+            bytes.remove_prefix(len);
+            return true;
+        }
+
+        inline bool equals_reverse_complement(std::string_view a, std::string_view b) {
+            if (a.size() != b.size())
+                return false;
+            for (size_t i = 0; i < a.size(); i++) {
+                if (a[i] != complement(b[b.size() - 1 - i]))
+                    return false;
+            }
+            return true;
+        }
+
+        // SEQ and QUAL of a read on the given strand
+        inline void append_read(std::string &out, std::string_view seq, std::string_view qual, bool reverse) {
+            if (reverse) {
+                for (size_t i = seq.size(); i > 0; i--)
+                    out.push_back(complement(seq[i - 1]));
+                out.push_back('\t');
+                out.append(qual.rbegin(), qual.rend());
+            } else {
+                out.append(seq);
+                out.push_back('\t');
+                out.append(qual);
+            }
+        }
+
+        // optional fields each with a leading tab, without per-base data of the aligned read if flipped
+        inline void append_tags(std::string &out, std::string_view tags, bool flipped) {
+            std::string_view tag;
+            while (!tags.empty() && next_field(tags, tag)) {
+                if (flipped && (tag.substr(0, 3) == "OQ:" || tag.substr(0, 3) == "E2:" || tag.substr(0, 3) == "U2:"))
+                    continue;
+                out.push_back('\t');
+                out.append(tag);
+            }
+        }
+
+        // SEQ and QUAL as the aligner writes them for a read on the given strand
+        inline bool matches_read(std::string_view sam_seq, std::string_view sam_qual, std::string_view seq,
+                                 std::string_view qual, bool reverse) {
+            if (sam_seq.size() != seq.size() || sam_qual.size() != qual.size())
+                return false;
+            if (!reverse)
+                return sam_seq == seq && sam_qual == qual;
+            if (!equals_reverse_complement(sam_seq, seq))
+                return false;
+            for (size_t i = 0; i < qual.size(); i++) {
+                if (sam_qual[i] != qual[qual.size() - 1 - i])
+                    return false;
+            }
+            return true;
+        }
+    }
+
+    inline bool AlignmentRecord::parse(std::string_view line) {
+        std::string_view f[11];
+        for (auto &field : f) {
+            if (!detail::next_field(line, field))
+                return false;
+        }
+        tags = line.data() == nullptr ? std::string_view() : line;
+        flipped = false;
+        if (tags.find('\n') != std::string_view::npos)
+            return false;
+
+        unsigned mq;
+        if (!detail::parse_int(f[1], flag) || !detail::parse_int(f[3], pos) ||
+            !detail::parse_int(f[4], mq) || mq > 255 || !detail::parse_int(f[7], next_pos) ||
+            !detail::parse_int(f[8], tlen) || f[2].size() > 255 || f[6].size() > 255)
+            return false;
+        mapq = mq;
+        qname = f[0];
+        rname = f[2];
+        rnext = f[6];
+        sam_seq = f[9];
+        sam_qual = f[10];
+
+        cigar.clear();
+        if (f[5] != "*") {
+            std::string_view c = f[5];
+            while (!c.empty()) {
+                uint32_t len = 0;
+                auto res = std::from_chars(c.data(), c.data() + c.size(), len);
+                if (res.ec != std::errc() || res.ptr == c.data() || res.ptr == c.data() + c.size())
+                    return false;
+                const char *op = std::strchr(CIGAR_OPS, *res.ptr);
+                // hard clips drop bases from SEQ, they cannot be rebuilt from the read
+                if (op == nullptr || *op == 'H' || *op == '\0')
+                    return false;
+                cigar.push_back(len << 4 | (op - CIGAR_OPS));
+                c.remove_prefix(res.ptr - c.data() + 1);
+            }
+        }
+        return true;
+    }
+
+    inline bool AlignmentRecord::parse(std::string_view line, std::string_view name, std::string_view seq,
+                                       std::string_view qual) {
+        return parse(line) && qname == name && detail::matches_read(sam_seq, sam_qual, seq, qual, reverse());
+    }
+
+    inline void AlignmentRecord::render(std::string &out, std::string_view name, std::string_view seq,
+                                        std::string_view qual) const {
+        out.append(name);
+        out.push_back('\t');
+        detail::append_int(out, flag);
+        out.push_back('\t');
+        out.append(rname);
+        out.push_back('\t');
+        detail::append_int(out, pos);
+        out.push_back('\t');
+        detail::append_int(out, mapq);
+        out.push_back('\t');
+        if (cigar.empty())
+            out.push_back('*');
+        for (uint32_t op : cigar) {
+            detail::append_int(out, op >> 4);
+            out.push_back(CIGAR_OPS[op & 0xf]);
+        }
+        out.push_back('\t');
+        out.append(rnext);
+        out.push_back('\t');
+        detail::append_int(out, next_pos);
+        out.push_back('\t');
+        detail::append_int(out, tlen);
+        out.push_back('\t');
+        detail::append_read(out, seq, qual, reverse());
+        detail::append_tags(out, tags, flipped);
+    }
+
+    inline void AlignmentRecord::encode(std::string &out) const {
+        out.push_back(RECORD_TAG);
+        detail::put(out, flag);
+        detail::put(out, mapq);
+        detail::put(out, pos);
+        detail::put(out, next_pos);
+        detail::put(out, tlen);
+        detail::put(out, static_cast<uint8_t>(rname.size()));
+        out.append(rname);
+        detail::put(out, static_cast<uint8_t>(rnext.size()));
+        out.append(rnext);
+        detail::put(out, static_cast<uint16_t>(cigar.size()));
+        for (uint32_t op : cigar)
+            detail::put(out, op);
+        if (flipped) {
+            std::string kept;
+            detail::append_tags(kept, tags, true);
+            out.append(kept.empty() ? kept : kept.substr(1));
+        } else {
+            out.append(tags);
+        }
+    }
+
+    inline bool AlignmentRecord::decode(std::string_view bytes) {
+        if (!is_record(bytes))
+            return false;
+        bytes.remove_prefix(1);
+        uint16_t n_cigar;
+        if (!detail::get(bytes, flag) || !detail::get(bytes, mapq) || !detail::get(bytes, pos) ||
+            !detail::get(bytes, next_pos) || !detail::get(bytes, tlen) || !detail::get_str(bytes, rname) ||
+            !detail::get_str(bytes, rnext) || !detail::get(bytes, n_cigar) ||
+            bytes.size() < n_cigar * sizeof(uint32_t))
+            return false;
+        cigar.resize(n_cigar);
+        for (auto &op : cigar)
+            detail::get(bytes, op);
+        tags = bytes;
+        flipped = false;
+        return true;
+    }
+
+    inline bool reorient_line(std::string_view line, std::string_view seq, std::string_view qual, std::string &out) {
+        std::string_view rest = line;
+        std::string_view f[11];
+        for (auto &field : f) {
+            if (!detail::next_field(rest, field))
+                return false;
+        }
+        uint16_t flag;
+        if (!detail::parse_int(f[1], flag))
+            return false;
+        // SEQ is the aligned read, reverse complemented if it aligned to the reverse strand
+        bool reverse = flag & AlignmentRecord::REVERSE;
+        bool for_read = reverse ? detail::equals_reverse_complement(f[9], seq) : f[9] == seq;
+        bool for_other = reverse ? f[9] == seq : detail::equals_reverse_complement(f[9], seq);
+        if (for_read || !for_other)
+            return false;
+
+        if (!(flag & AlignmentRecord::UNMAPPED))
+            flag ^= AlignmentRecord::REVERSE;
+        out.append(f[0]);
+        out.push_back('\t');
+        detail::append_int(out, flag);
+        for (int i = 2; i < 9; i++) {
+            out.push_back('\t');
+            out.append(f[i]);
+        }
+        out.push_back('\t');
+        detail::append_read(out, seq, qual, flag & AlignmentRecord::REVERSE);
+        detail::append_tags(out, rest.data() == nullptr ? std::string_view() : rest, true);
+        return true;
+    }
+
+/*
+ *
+ *  ALIGNMENT SCORING
+ *
+ *  Scores follow bowtie2's default scoring, end to end or --local, for alignments adapted from
+ *  a cached one. Tags that depend on the read's bases (AS, XM, NM, MD) are rewritten for the
+ *  read the alignment was adapted to.
+ *
+ */
+
+    struct ScoringScheme {
+        bool local;
+        int match_bonus;
+        int mismatch_max; // at high quality, scaled down to mismatch_min as quality drops
+        int mismatch_min;
+        int n_penalty; // either base an N
+        int gap_open; // same for read and reference gaps
+        int gap_extend;
+
+        // --ma, --mp, --np, --rdg, --rfg and --score-min as bowtie2 sets them by default
+        static ScoringScheme bowtie2(bool local) { return {local, local ? 2 : 0, 6, 2, 1, 5, 3}; }
+
+        int mismatch_penalty(char qual) const {
+            int q = std::min(std::max(qual - 33, 0), 40);
+            return mismatch_min + (mismatch_max - mismatch_min) * q / 40;
+        }
+
+        int gap_penalty(uint32_t length) const { return gap_open + gap_extend * static_cast<int>(length); }
+
+        // lowest score of a valid alignment of a read of length bases
+        double min_score(size_t length) const {
+            return local ? 20 + 8 * std::log(static_cast<double>(length)) : -0.6 - 0.6 * length;
+        }
+    };
+
+    namespace detail {
+        inline void append_cigar_op(std::vector<uint32_t> &cigar, uint32_t len, uint8_t op) {
+            if (!cigar.empty() && (cigar.back() & 0xf) == op)
+                cigar.back() += len << 4;
+            else
+                cigar.push_back(len << 4 | op);
+        }
+
+        // tag value if tags hold it, as in "XS:i:"
+        inline std::optional<std::string_view> find_tag(std::string_view tags, std::string_view prefix) {
+            std::string_view tag;
+            while (!tags.empty() && next_field(tags, tag)) {
+                if (tag.substr(0, prefix.size()) == prefix)
+                    return tag.substr(prefix.size());
+            }
+            return std::nullopt;
+        }
+
+        // tags with the read dependent ones replaced, NM and MD added if missing, and per-base
+        // data of the read the alignment was made for dropped
+        inline void rewrite_score_tags(std::string &out, std::string_view tags, int64_t score, uint32_t mismatches,
+                                       uint32_t edit_distance, std::string_view md) {
+            bool has_nm = false, has_md = false;
+            std::string_view tag;
+            while (!tags.empty() && next_field(tags, tag)) {
+                std::string_view type = tag.substr(0, 3);
+                if (type == "OQ:" || type == "E2:" || type == "U2:")
+                    continue;
+                if (!out.empty())
+                    out.push_back('\t');
+                if (type == "AS:") {
+                    out.append("AS:i:");
+                    append_int(out, score);
+                } else if (type == "XM:") {
+                    out.append("XM:i:");
+                    append_int(out, mismatches);
+                } else if (type == "NM:") {
+                    out.append("NM:i:");
+                    append_int(out, edit_distance);
+                    has_nm = true;
+                } else if (type == "MD:") {
+                    out.append("MD:Z:");
+                    out.append(md);
+                    has_md = true;
+                } else {
+                    out.append(tag);
+                }
+            }
+            if (!has_nm) {
+                out.append(out.empty() ? "NM:i:" : "\tNM:i:");
+                append_int(out, edit_distance);
+            }
+            if (!has_md) {
+                out.append(out.empty() ? "MD:Z:" : "\tMD:Z:");
+                out.append(md);
+            }
+        }
+    }
+
+/*
+ *
+ *  CONTAINED ALIGNMENTS
+ *
+ *  A read made of a stretch of a longer aligned read, as adapter or quality trimming leaves
+ *  them, aligns where that stretch of the longer read did. For an ungapped, unclipped alignment
+ *  this is an offset to POS, the matching part of the CIGAR and of the MD tag, from which the
+ *  scores are recomputed. Only unique, unpaired alignments are cut: a shorter read is more
+ *  likely to align equally well elsewhere, and mates and TLEN describe the longer read.
+ *
+ */
+
+    // alignment for seq, which is the read the record was made for (read_length long) from offset
+    // on, in that read's orientation; false if the alignment cannot be cut or scores too low
+    inline bool slice_alignment(const AlignmentRecord &record, uint32_t read_length, uint32_t offset,
+                                std::string_view seq, std::string_view qual, const ScoringScheme &scoring,
+                                AlignmentRecord &out, std::string &tags) {
+        uint32_t length = seq.size();
+        if ((record.flag & (AlignmentRecord::PAIRED | AlignmentRecord::UNMAPPED)) || length == 0 ||
+            offset + length > read_length)
+            return false;
+        uint32_t aligned = 0;
+        bool runs = false; // =/X rather than M
+        for (uint32_t op : record.cigar) {
+            if ((op & 0xf) == CIGAR_EQUAL || (op & 0xf) == CIGAR_DIFF)
+                runs = true;
+            else if ((op & 0xf) != CIGAR_MATCH)
+                return false;
+            aligned += op >> 4;
+        }
+        auto md = detail::find_tag(record.tags, "MD:Z:");
+        if (aligned != read_length || !md || detail::find_tag(record.tags, "XS:i:"))
+            return false;
+
+        // SEQ runs along the reference, so a slice of a reverse strand read starts from the end
+        bool reverse = record.reverse();
+        uint32_t start = reverse ? read_length - offset - length : offset;
+        uint32_t end = start + length;
+
+        std::string sliced_md;
+        std::vector<uint32_t> cigar;
+        int64_t score = 0;
+        uint32_t mismatches = 0, run = 0;
+        uint32_t at = 0; // reference oriented position in the longer read
+        std::string_view rest = *md;
+        while (!rest.empty()) {
+            if (std::isdigit(static_cast<unsigned char>(rest[0]))) {
+                uint32_t n = 0;
+                auto res = std::from_chars(rest.data(), rest.data() + rest.size(), n);
+                if (res.ec != std::errc() || res.ptr == rest.data())
+                    return false;
+                rest.remove_prefix(res.ptr - rest.data());
+                uint32_t lo = std::max(at, start), hi = std::min(at + n, end);
+                if (hi > lo) {
+                    run += hi - lo;
+                    score += static_cast<int64_t>(hi - lo) * scoring.match_bonus;
+                    if (runs)
+                        detail::append_cigar_op(cigar, hi - lo, CIGAR_EQUAL);
+                }
+                at += n;
+            } else if (std::isalpha(static_cast<unsigned char>(rest[0]))) {
+                // deletions (^) cannot appear in an ungapped alignment's MD
+                if (at >= start && at < end) {
+                    uint32_t i = at - start;
+                    uint32_t j = reverse ? length - 1 - i : i; // in seq and qual
+                    char ref = std::toupper(static_cast<unsigned char>(rest[0]));
+                    char base = std::toupper(static_cast<unsigned char>(seq[j]));
+                    score -= base == 'N' || ref == 'N' ? scoring.n_penalty
+                                                       : scoring.mismatch_penalty(j < qual.size() ? qual[j] : 'I');
+                    mismatches++;
+                    detail::append_int(sliced_md, run);
+                    sliced_md.push_back(ref);
+                    run = 0;
+                    if (runs)
+                        detail::append_cigar_op(cigar, 1, CIGAR_DIFF);
+                }
+                rest.remove_prefix(1);
+                at++;
+            } else {
+                return false;
+            }
+        }
+        if (at != read_length || score < scoring.min_score(length))
+            return false;
+        detail::append_int(sliced_md, run);
+        if (!runs)
+            cigar.assign(1, length << 4 | CIGAR_MATCH);
+
+        tags.clear();
+        detail::rewrite_score_tags(tags, record.tags, score, mismatches, mismatches, sliced_md);
+        out = record;
+        out.pos = record.pos + start;
+        out.cigar = std::move(cigar);
+        out.tags = tags;
+        out.flipped = false;
+        return true;
+    }
+}
+
+#endif //SEALM_ALIGNMENT_HPP
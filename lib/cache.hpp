@@ -6,19 +6,144 @@
 #define SEALM_CACHE_HPP
 
 #include <list>
+#include <map>
+#include <deque>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <shared_mutex>
+#include <optional>
+#include <functional>
 #include <string>
 #include <vector>
 #include <random>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
 #include <iostream>
 #include <unordered_map>
 
 #include "types.hpp"
 #include "signaling.hpp"
 #include "logging.hpp"
+#include "snapshot.hpp"
 
 namespace SeAlM {
 
+    // approximate footprint of a cached value, used by size-aware policies
+    template<typename V>
+    uint64_t byte_size(const V &value) { return sizeof(V); }
+
+    inline uint64_t byte_size(const std::string &value) { return sizeof(value) + value.size(); }
+
+    inline uint64_t byte_size(const PreHashedString &value) { return sizeof(value) + value.size(); }
+
+    // hint that the line holding p is read soon, batched probes issue these before resolving
+    inline void prefetch(const void *p) {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(p);
+#endif
+    }
+
+    // mutex that adds up the time callers waited for it, an uncontended lock costs the same
+    // single atomic as std::mutex
+    class CacheMutex {
+    private:
+        std::mutex _mutex;
+        std::atomic<uint64_t> _wait_ns{0};
+        std::atomic<uint64_t> _contended{0};
+
+    public:
+        void lock() {
+            if (_mutex.try_lock())
+                return;
+            auto start = std::chrono::steady_clock::now();
+            _mutex.lock();
+            _wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            _contended++;
+        }
+
+        bool try_lock() { return _mutex.try_lock(); }
+
+        void unlock() { _mutex.unlock(); }
+
+        uint64_t wait_ns() const { return _wait_ns; }
+
+        uint64_t contended() const { return _contended; }
+    };
+
+    // reader-writer counterpart of CacheMutex, timing both shared and exclusive acquisitions that had to wait
+    class SharedCacheMutex {
+    private:
+        std::shared_mutex _mutex;
+        std::atomic<uint64_t> _wait_ns{0};
+        std::atomic<uint64_t> _contended{0};
+
+        void waited(std::chrono::steady_clock::time_point start) {
+            _wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            _contended++;
+        }
+
+    public:
+        void lock() {
+            if (_mutex.try_lock())
+                return;
+            auto start = std::chrono::steady_clock::now();
+            _mutex.lock();
+            waited(start);
+        }
+
+        bool try_lock() { return _mutex.try_lock(); }
+
+        void unlock() { _mutex.unlock(); }
+
+        void lock_shared() {
+            if (_mutex.try_lock_shared())
+                return;
+            auto start = std::chrono::steady_clock::now();
+            _mutex.lock_shared();
+            waited(start);
+        }
+
+        bool try_lock_shared() { return _mutex.try_lock_shared(); }
+
+        void unlock_shared() { _mutex.unlock_shared(); }
+
+        uint64_t wait_ns() const { return _wait_ns; }
+
+        uint64_t contended() const { return _contended; }
+    };
+
+    // result of a lookup, shares the cached value so it stays valid once the cache's lock is released
+    // and after the entry is evicted. Reads like an optional reference: test it, then handle->get()
+    template<typename V>
+    class CacheHandle {
+    private:
+        std::shared_ptr<V> _value;
+
+    public:
+        CacheHandle() = default;
+
+        CacheHandle(std::nullopt_t) {}
+
+        explicit CacheHandle(std::shared_ptr<V> value) : _value{std::move(value)} {}
+
+        explicit operator bool() const { return static_cast<bool>(_value); }
+
+        bool has_value() const { return static_cast<bool>(_value); }
+
+        V &get() const { return *_value; }
+
+        V &operator*() const { return *_value; }
+
+        const CacheHandle *operator->() const { return this; }
+
+        const std::shared_ptr<V> &shared() const { return _value; }
+    };
+
 /*
  *
  *  CACHE INTERFACE
@@ -31,6 +156,9 @@ namespace SeAlM {
 
         virtual void set_max_size(uint64_t max_size) = 0;
 
+        // budget for key, value and bookkeeping bytes on top of the entry limit, 0 disables it
+        virtual void set_max_bytes(uint64_t max_bytes) = 0;
+
         virtual double hit_rate() = 0;
 
         virtual uint64_t hits() = 0;
@@ -41,7 +169,10 @@ namespace SeAlM {
 
         virtual uint32_t size() = 0;
 
-        virtual typename std::unordered_map<K, std::unique_ptr<V>>::iterator end() = 0;
+        virtual uint64_t bytes() = 0;
+
+        // nanoseconds callers spent waiting for the cache's locks, summed over its layers and shards
+        virtual uint64_t lock_wait_ns() = 0;
 
         virtual void update(int event) = 0;
 
@@ -49,18 +180,95 @@ namespace SeAlM {
 
         virtual void insert_no_evict(const K &key, const V &value) = 0;
 
+        // cost is the work needed to recompute value (e.g. aligner seconds), cost-blind policies ignore it
+        virtual void insert_no_evict(const K &key, const V &value, double) { insert_no_evict(key, value); }
+
         virtual void trim() = 0;
 
-        virtual typename std::unordered_map<K, std::unique_ptr<V>>::iterator find(const K &key) = 0;
+        // evicts down to size entries and the byte budget, at most max_entries per call so probes
+        // get the lock in between, returns the entries evicted. Policies without incremental
+        // eviction trim to their capacity in one call
+        virtual uint64_t trim_to(uint64_t, uint64_t) {
+            uint64_t before = this->size();
+            trim();
+            uint64_t after = this->size();
+            return before > after ? before - after : 0;
+        }
+
+        // counts the hit/miss like lookup but leaves the entry's recency alone, empty if key is not cached
+        virtual CacheHandle<V> find(const K &key) = 0;
 
         virtual V &at(const K &key) = 0;
 
+        // single probe that counts the hit/miss and updates recency, empty if key is not cached
+        virtual CacheHandle<V> lookup(const K &key) = 0;
+
+        // true if key is cached, without counting a hit or miss or touching the entry's recency
+        virtual bool contains(const K &key) = 0;
+
+        // single probe like lookup, handing out the cached value itself, which the handle keeps alive
+        // after the entry is evicted, null if key is not cached. Caches that build their values on
+        // a probe (compressed, on disk, shared memory) hand out a copy
+        virtual std::shared_ptr<const V> acquire(const K &key) { return lookup(key).shared(); }
+
+        // acquire for each key of a batch, handles[i] is null if keys[i] is not cached. Policies
+        // resolve the batch under one lock acquisition, prefetching where their layout allows
+        virtual void find_many(const std::vector<K> &keys, std::vector<std::shared_ptr<const V> > &handles) {
+            handles.resize(keys.size());
+            for (size_t i = 0; i < keys.size(); i++)
+                handles[i] = acquire(keys[i]);
+        }
+
+        // insert_no_evict for each entry of a batch, values may be moved from
+        virtual void insert_many(const std::vector<K> &keys, std::vector<V> &values, const std::vector<double> &costs) {
+            for (size_t i = 0; i < keys.size(); i++)
+                insert_no_evict(keys[i], values[i], costs[i]);
+        }
+
+        // value of a cached key similar to key but not equal to it, which is written to match,
+        // empty if the cache has no such index
+        virtual CacheHandle<V> lookup_near(const K &, K &) { return std::nullopt; }
+
         virtual V &operator[](K &key) = 0;
 
         virtual void clear() = 0;
 
         virtual void fetch_into(const K &key, V *buff) = 0;
 
+        // called with each entry as it is evicted (under the cache's lock, must not re-enter this cache)
+        virtual void set_eviction_callback(std::function<void(const K &, const V &)> callback) = 0;
+
+        // key the cache would evict to make room for candidate, false if there is none
+        virtual bool peek_victim(const K &candidate, K &victim) = 0;
+
+        // write entries from least to most recently used, false if the policy has no snapshot support
+        virtual bool save_snapshot(const std::string &, uint64_t) { return false; }
+
+        // warm the cache from a snapshot written with the same fingerprint, returns entries loaded
+        virtual uint64_t load_snapshot(const std::string &path, uint64_t fingerprint) {
+            if constexpr (!snapshot_storable<K> || !snapshot_storable<V>) {
+                return 0;
+            } else {
+                SnapshotReader reader;
+                if (!reader.open(path, fingerprint))
+                    return 0;
+                // keep the most recent entries if the snapshot is larger than this cache
+                uint64_t first = reader.size() > capacity() ? reader.size() - capacity() : 0;
+                uint64_t loaded = 0;
+                std::string_view key, value;
+                for (uint64_t i = first; i < reader.size(); i++) {
+                    if (!reader.entry(i, key, value)) {
+                        log_warn("Stopped loading corrupt cache snapshot " + path);
+                        break;
+                    }
+                    insert_no_evict(K(std::string(key)), V(std::string(value)));
+                    loaded++;
+                }
+                trim();
+                return loaded;
+            }
+        }
+
         virtual void serialize(std::ostream &output) const = 0;
 
         friend std::ostream &operator<<(std::ostream &output, const CacheIndex &C) {
@@ -81,32 +289,64 @@ namespace SeAlM {
     class BasicEvictionCache : public CacheIndex<K, V> {
     protected:
 
-        // Storage structure
-        // TODO: check if shared or unique pointers work best
-        std::unordered_map<K, std::unique_ptr<V>> _cache_index;
+        // Storage structure, values are shared so hits are handed out without a copy
+        std::unordered_map<K, std::shared_ptr<V>> _cache_index;
 
         // Size limits
         uint64_t _max_cache_size; // num of elements
+        uint64_t _max_cache_bytes; // approximate bytes, 0 if unbounded
         float _max_load_factor; // max ratio of num hash buckets / num elements
+        uint8_t _key_copies; // copies of each key held by the index and policy structures
+
+        // per copy of the key: hash node link, cached hash, value pointer and allocator header
+        static constexpr uint64_t NODE_OVERHEAD = 4 * sizeof(void *);
 
-        // Metrics
-        uint64_t _hits;
-        uint64_t _misses;
-        uint64_t _keys;
+        // Metrics (atomic so policies with shared-lock hit paths can count concurrently)
+        std::atomic<uint64_t> _hits;
+        std::atomic<uint64_t> _misses;
+        std::atomic<uint64_t> _keys;
+        std::atomic<uint64_t> _bytes;
 
         // Locks for thread safety
-        std::mutex _cache_mutex;
+        CacheMutex _cache_mutex;
+
+        // Eviction listener
+        std::function<void(const K &, const V &)> _eviction_callback;
 
         // Protected methods
         virtual void evict() = 0;
 
+        void on_insert(const K &key, const V &value) {
+            _bytes += entry_bytes(key, value);
+        }
+
+        void on_evict(const K &key, const V &value) {
+            _bytes -= entry_bytes(key, value);
+            if (_eviction_callback)
+                _eviction_callback(key, value);
+        }
+
+        uint64_t entry_bytes(const K &key, const V &value) const {
+            return _key_copies * (byte_size(key) + NODE_OVERHEAD) + byte_size(value);
+        }
+
+        // true if adding incoming bytes would exceed the byte budget
+        bool over_budget(uint64_t incoming = 0) const {
+            return _max_cache_bytes > 0 && _bytes + incoming > _max_cache_bytes;
+        }
+
     public:
 
         /*
          * Implemented Base Methods 1048576 * 4
          */
 
-        BasicEvictionCache() : _max_cache_size{1048576 * 4}, _max_load_factor{0.8}, _hits{0}, _misses{0}, _keys{0} {};
+        BasicEvictionCache() : _max_cache_size{1048576 * 4}, _max_cache_bytes{0}, _max_load_factor{0.8},
+                               _key_copies{1}, _hits{0}, _misses{0}, _keys{0}, _bytes{0} {};
+
+        explicit BasicEvictionCache(uint64_t max_size) : _max_cache_size{max_size}, _max_cache_bytes{0},
+                                                         _max_load_factor{0.8}, _key_copies{1}, _hits{0},
+                                                         _misses{0}, _keys{0}, _bytes{0} {};
 
         virtual ~BasicEvictionCache() {};
 
@@ -116,6 +356,8 @@ namespace SeAlM {
             _cache_index.reserve(_max_cache_size);
         }
 
+        void set_max_bytes(uint64_t max_bytes) override { _max_cache_bytes = max_bytes; }
+
         void set_max_load_factor(float load_factor) {
             log_warn("Decreasing cache load factor forces rehash, may impact performance.");
             _max_load_factor = load_factor;
@@ -127,7 +369,8 @@ namespace SeAlM {
          */
 
         double hit_rate() {
-            return _misses > 0 ? _hits / (_misses + _hits) : 0;
+            uint64_t h = _hits, m = _misses;
+            return m > 0 ? static_cast<double>(h) / (h + m) : 0;
         }
 
         uint64_t hits() { return _hits; }
@@ -138,9 +381,11 @@ namespace SeAlM {
 
         uint32_t size() { return _cache_index.size(); }
 
-        uint32_t load_factor() { return _cache_index.load_factor(); }
+        uint64_t bytes() override { return _bytes; }
 
-        typename std::unordered_map<K, std::unique_ptr<V>>::iterator end() { return _cache_index.end(); }
+        uint64_t lock_wait_ns() override { return _cache_mutex.wait_ns(); }
+
+        uint32_t load_factor() { return _cache_index.load_factor(); }
 
         virtual void update(int event) {};
 
@@ -156,10 +401,22 @@ namespace SeAlM {
 
         // virtual void trim() = 0;
 
-        virtual typename std::unordered_map<K, std::unique_ptr<V>>::iterator find(const K &key) = 0;
+        virtual CacheHandle<V> find(const K &key) = 0;
 
         virtual V &at(const K &key) = 0;
 
+        // counts the hit or miss and updates recency, the stored value or null if key is not cached
+        virtual std::shared_ptr<V> probe(const K &key) = 0;
+
+        CacheHandle<V> lookup(const K &key) override { return CacheHandle<V>(probe(key)); }
+
+        std::shared_ptr<const V> acquire(const K &key) override { return probe(key); }
+
+        bool contains(const K &key) override {
+            std::lock_guard<CacheMutex> lock(_cache_mutex);
+            return _cache_index.find(key) != _cache_index.end();
+        }
+
         virtual V &operator[](K &key) = 0;
 
         // virtual void clear() = 0;
@@ -167,6 +424,12 @@ namespace SeAlM {
         // TODO: find more consistent way to do this?
         virtual void fetch_into(const K &key, V *buff) = 0;
 
+        void set_eviction_callback(std::function<void(const K &, const V &)> callback) override {
+            _eviction_callback = std::move(callback);
+        }
+
+        bool peek_victim(const K &, K &) override { return false; }
+
         void serialize(std::ostream &output) const {
             output << "Hits: " << _hits << " Misses: " << _misses << " Size: " << _keys << std::endl;
         }
@@ -193,10 +456,12 @@ namespace SeAlM {
 
         void trim() override;
 
-        typename std::unordered_map<K, std::unique_ptr<V>>::iterator find(const K &key) override;
+        CacheHandle<V> find(const K &key) override;
 
         V &at(const K &key) override;
 
+        std::shared_ptr<V> probe(const K &key) override;
+
         V &operator[](K &key) override;
 
         void clear() override {};
@@ -217,9 +482,9 @@ namespace SeAlM {
     void DummyCache<K, V>::trim() {}
 
     template<typename K, typename V>
-    typename std::unordered_map<K, std::unique_ptr<V>>::iterator DummyCache<K, V>::find(const K &key) {
+    CacheHandle<V> DummyCache<K, V>::find(const K &) {
         // always true
-        return this->_cache_index.end(); //this->_cache_index.find(key);
+        return std::nullopt; //this->_cache_index.find(key);
     }
 
     template<typename K, typename V>
@@ -227,15 +492,19 @@ namespace SeAlM {
         return *this->_cache_index.at(key);
     }
 
+    template<typename K, typename V>
+    std::shared_ptr<V> DummyCache<K, V>::probe(const K &) {
+        // never stores anything
+        return nullptr;
+    }
+
     template<typename K, typename V>
     V &DummyCache<K, V>::operator[](K &key) {
         return key;
     }
 
     template<typename K, typename V>
-    void DummyCache<K, V>::fetch_into(const K &key, V *buff) {
-        buff = nullptr;
-    }
+    void DummyCache<K, V>::fetch_into(const K &, V *) {}
 
 
 /*
@@ -246,144 +515,296 @@ namespace SeAlM {
     template<typename K, typename V>
     class LRUCache : public BasicEvictionCache<K, V> {
     protected:
+        // the value and its place in the recency list, so a hit costs a single hash probe
+        struct Entry {
+            std::shared_ptr<V> value;
+            typename std::list<K>::iterator order;
+        };
+
         std::list<K> _order;
-        std::unordered_map<K, typename std::list<K>::iterator> _order_lookup;
+        std::unordered_map<K, Entry> _entries;
 
         void evict() override;
 
+        void touch(Entry &entry);
+
+        // caller holds lock, adds key as the most recent entry if it is not cached yet
+        bool emplace(const K &key, std::shared_ptr<V> value);
+
     public:
 
         LRUCache();
 
+        explicit LRUCache(uint64_t max_size);
+
+        void set_max_size(uint64_t max_size) override;
+
+        uint32_t size() override;
+
+        bool save_snapshot(const std::string &path, uint64_t fingerprint) override;
+
         void insert(const K &key, const V &value) override;
 
         void insert_no_evict(const K &key, const V &value) override;
 
         void trim() override;
 
-        typename std::unordered_map<K, std::unique_ptr<V>>::iterator find(const K &key) override;
+        uint64_t trim_to(uint64_t size, uint64_t max_entries) override;
+
+        CacheHandle<V> find(const K &key) override;
 
         V &at(const K &key) override;
 
+        std::shared_ptr<V> probe(const K &key) override;
+
+        bool contains(const K &key) override;
+
+        void find_many(const std::vector<K> &keys, std::vector<std::shared_ptr<const V> > &handles) override;
+
+        void insert_many(const std::vector<K> &keys, std::vector<V> &values, const std::vector<double> &costs) override;
+
         V &operator[](K &key) override;
 
         void clear() override;
 
         void fetch_into(const K &key, V *buff) override;
+
+        bool peek_victim(const K &candidate, K &victim) override;
     };
 
     template<typename K, typename V>
     LRUCache<K, V>::LRUCache() : BasicEvictionCache<K, V>() {
+        this->_key_copies = 2;
         // Preallocate space for cache
         //_order.resize(this->_max_cache_size);
-        _order_lookup.reserve(this->_max_cache_size + 50000);
-        this->_cache_index.reserve(this->_max_cache_size + 50000);
+        _entries.reserve(this->_max_cache_size + 50000);
+    }
+
+    template<typename K, typename V>
+    LRUCache<K, V>::LRUCache(uint64_t max_size) : BasicEvictionCache<K, V>(max_size) {
+        this->_key_copies = 2;
+        // Preallocate space for a cache of the requested size only (e.g. a single shard)
+        _entries.reserve(this->_max_cache_size);
+    }
+
+    template<typename K, typename V>
+    void LRUCache<K, V>::set_max_size(uint64_t max_size) {
+        log_warn("Increasing cache bucket count forces rehash, may impact performance.");
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        this->_max_cache_size = max_size;
+        _entries.reserve(this->_max_cache_size);
+    }
+
+    template<typename K, typename V>
+    uint32_t LRUCache<K, V>::size() {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        return _entries.size();
     }
 
     template<typename K, typename V>
     void LRUCache<K, V>::evict() {
         // not publically facing, doesn't require lock (may change in future)
-        K key = _order.back();
+        auto find_ptr = _entries.find(_order.back());
         _order.pop_back();
-        _order_lookup.erase(key);
-        this->_cache_index.erase(key);
+        this->on_evict(find_ptr->first, *find_ptr->second.value);
+        _entries.erase(find_ptr);
         this->_keys--;
     }
 
     template<typename K, typename V>
-    void LRUCache<K, V>::insert(const K &key, const V &value) {
-        std::lock_guard<std::mutex> lock(this->_cache_mutex);
+    void LRUCache<K, V>::touch(Entry &entry) {
+        // caller holds lock, splicing keeps the list iterator valid so the entry needs no update
+        _order.splice(_order.begin(), _order, entry.order);
+    }
+
+    template<typename K, typename V>
+    bool LRUCache<K, V>::emplace(const K &key, std::shared_ptr<V> value) {
         // unordered map's try_emplace returns a pair of iterator to element and bool
         // indicating whether element already existed (false) or not (true)
-        if (this->_cache_index.try_emplace(key, std::make_unique<V>(value)).second) {
-            if (this->_cache_index.size() >= this->_max_cache_size) {
-                evict();
-            }
+        auto inserted = _entries.try_emplace(key, Entry{std::move(value), _order.end()});
+        if (!inserted.second)
+            return false;
+        _order.emplace_front(key);
+        inserted.first->second.order = _order.begin();
 
-            _order.emplace_front(key);
-            _order_lookup.emplace(key, _order.begin());
+        // only change recency of read on access, not on addition
+        this->_keys++;
+        this->on_insert(key, *inserted.first->second.value);
+        return true;
+    }
 
-            // only change recency of read on access, not on addition
-            this->_keys++;
+    template<typename K, typename V>
+    void LRUCache<K, V>::insert(const K &key, const V &value) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (_entries.find(key) != _entries.end())
+            return;
+        // a single-entry cache has nothing older to evict yet
+        if (_entries.size() + 1 >= this->_max_cache_size && !_order.empty()) {
+            evict();
+        }
+        while (!_order.empty() && this->over_budget(this->entry_bytes(key, value))) {
+            evict();
         }
+        emplace(key, std::make_shared<V>(value));
     }
 
     template<typename K, typename V>
     void LRUCache<K, V>::insert_no_evict(const K &key, const V &value) {
-        // No lock required, adds data only
+        // adding data may rehash the index, so lock against concurrent probes
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (_entries.find(key) == _entries.end())
+            emplace(key, std::make_shared<V>(value));
+    }
 
-        // unordered map's try_emplace returns a pair of iterator to element and bool
-        // indicating whether element already existed (false) or not (true)
-        if (this->_cache_index.try_emplace(key, std::make_unique<V>(value)).second) {
-            _order.emplace_front(key);
-            _order_lookup.emplace(key, _order.begin());
+    template<typename K, typename V>
+    void LRUCache<K, V>::trim() {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        for (uint64_t i = _entries.size(); i >= this->_max_cache_size && !_order.empty(); i--) {
+            evict();
+        }
+        while (!_order.empty() && this->over_budget()) {
+            evict();
+        }
+    }
 
-            // only change recency of read on access, not on addition
-            this->_keys++;
+    template<typename K, typename V>
+    uint64_t LRUCache<K, V>::trim_to(uint64_t size, uint64_t max_entries) {
+        // evict() is virtual, so MRU evicts from its own end
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        uint64_t evicted = 0;
+        while (evicted < max_entries && !_order.empty() &&
+               (_entries.size() > size || this->over_budget())) {
+            evict();
+            evicted++;
         }
+        return evicted;
     }
 
     template<typename K, typename V>
-    void LRUCache<K, V>::trim() {
-        std::lock_guard<std::mutex> lock(this->_cache_mutex);
-        K key;
-        for (uint64_t i = this->_cache_index.size(); i >= this->_max_cache_size; i--) {
-            key = _order.back();
-            _order.pop_back();
-            _order_lookup.erase(key);
-            this->_cache_index.erase(key);
-            this->_keys--;
+    CacheHandle<V> LRUCache<K, V>::find(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto find_ptr = _entries.find(key);
+        if (find_ptr == _entries.end()) {
+            this->_misses++;
+            return std::nullopt;
         }
+        this->_hits++;
+        return CacheHandle<V>(find_ptr->second.value);
+    }
 
-//    for (uint64_t i = this->_cache_index.size(); i >= this->_max_cache_size; i--) {
-//        evict();
-//    }
+    template<typename K, typename V>
+    V &LRUCache<K, V>::at(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto &entry = _entries.at(key);
+        touch(entry);
+        return *entry.value;
     }
 
     template<typename K, typename V>
-    typename std::unordered_map<K, std::unique_ptr<V>>::iterator LRUCache<K, V>::find(const K &key) {
-        std::lock_guard<std::mutex> lock(this->_cache_mutex);
-        auto find_ptr = this->_cache_index.find(key);
-        find_ptr != this->_cache_index.end() ? this->_hits++ : this->_misses++;
-        return find_ptr;
+    std::shared_ptr<V> LRUCache<K, V>::probe(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto find_ptr = _entries.find(key);
+        if (find_ptr == _entries.end()) {
+            this->_misses++;
+            return nullptr;
+        }
+        this->_hits++;
+        touch(find_ptr->second);
+        return find_ptr->second.value;
     }
 
     template<typename K, typename V>
-    V &LRUCache<K, V>::at(const K &key) {
-        std::lock_guard<std::mutex> lock(this->_cache_mutex);
-        _order.erase(_order_lookup[key]);
-        _order.emplace_front(key);
-        _order_lookup.insert_or_assign(key, _order.begin());
-        return *this->_cache_index.at(key);
+    bool LRUCache<K, V>::contains(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        return _entries.find(key) != _entries.end();
+    }
+
+    template<typename K, typename V>
+    void LRUCache<K, V>::find_many(const std::vector<K> &keys, std::vector<std::shared_ptr<const V> > &handles) {
+        // node based index, there is no slot to prefetch ahead of the lookup, so the batch
+        // only saves the lock round trips
+        handles.resize(keys.size());
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        for (size_t i = 0; i < keys.size(); i++) {
+            auto find_ptr = _entries.find(keys[i]);
+            if (find_ptr == _entries.end()) {
+                this->_misses++;
+                handles[i] = nullptr;
+                continue;
+            }
+            this->_hits++;
+            touch(find_ptr->second);
+            handles[i] = find_ptr->second.value;
+        }
+    }
+
+    template<typename K, typename V>
+    void LRUCache<K, V>::insert_many(const std::vector<K> &keys, std::vector<V> &values,
+                                     const std::vector<double> &) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (_entries.find(keys[i]) == _entries.end())
+                emplace(keys[i], std::make_shared<V>(std::move(values[i])));
+        }
     }
 
     template<typename K, typename V>
     V &LRUCache<K, V>::operator[](K &key) {
-        std::lock_guard<std::mutex> lock(this->_cache_mutex);
-        return *this->_cache_index[key];
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto find_ptr = _entries.find(key);
+        if (find_ptr == _entries.end()) {
+            emplace(key, std::make_shared<V>());
+            find_ptr = _entries.find(key);
+        }
+        return *find_ptr->second.value;
+    }
+
+    template<typename K, typename V>
+    bool LRUCache<K, V>::peek_victim(const K &, K &victim) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (_order.empty())
+            return false;
+        victim = _order.back();
+        return true;
+    }
+
+    template<typename K, typename V>
+    bool LRUCache<K, V>::save_snapshot(const std::string &path, uint64_t fingerprint) {
+        if constexpr (!snapshot_storable<K> || !snapshot_storable<V>) {
+            return false;
+        } else {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            SnapshotWriter writer(path, fingerprint, _order.size());
+            // front of _order is most recent for both LRU and MRU, write back to front
+            for (auto it = _order.rbegin(); it != _order.rend(); it++) {
+                writer.add_entry(snapshot_view(*it), snapshot_view(*_entries.at(*it).value));
+            }
+            for (auto it = _order.rbegin(); it != _order.rend(); it++) {
+                writer.add_data(snapshot_view(*it), snapshot_view(*_entries.at(*it).value));
+            }
+            return writer.commit();
+        }
     }
 
     template<typename K, typename V>
     void LRUCache<K, V>::clear() {
         _order.clear();
-        _order_lookup.clear();
-        this->_cache_index.clear();
+        _entries.clear();
+        this->_bytes = 0;
     }
 
     template<typename K, typename V>
     void LRUCache<K, V>::fetch_into(const K &key, V *buff) {
-        std::lock_guard<std::mutex> lock(this->_cache_mutex);
-        auto find_ptr = this->_cache_index.find(key);
-        find_ptr != this->_cache_index.end() ? this->_hits++ : this->_misses++;
-        if (find_ptr != this->end()) {
-            _order.erase(_order_lookup[key]);
-            _order.emplace_front(key);
-            _order_lookup.insert_or_assign(key, _order.begin());
-            buff = new V(*(this->_cache_index.at(key))); //*this->_cache_index.at(key);
-        } else {
-            // TODO: find a safer return value
-            buff = nullptr;
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto find_ptr = _entries.find(key);
+        if (find_ptr == _entries.end()) {
+            this->_misses++;
+            return;
         }
+        this->_hits++;
+        touch(find_ptr->second);
+        if (buff != nullptr)
+            *buff = *find_ptr->second.value;
     }
 
 
@@ -400,130 +821,145 @@ namespace SeAlM {
     public:
         MRUCache() : LRUCache<K, V>() {};
 
+        explicit MRUCache(uint64_t max_size) : LRUCache<K, V>(max_size) {};
+
         void insert_no_evict(const K &key, const V &value) override;
 
         void trim() override;
+
+        bool peek_victim(const K &candidate, K &victim) override;
     };
 
     template<typename K, typename V>
     void MRUCache<K, V>::evict() {
-        K key = this->_order.front();
+        auto find_ptr = this->_entries.find(this->_order.front());
         this->_order.pop_front();
-        this->_order_lookup.erase(key);
-        this->_cache_index.erase(key);
+        this->on_evict(find_ptr->first, *find_ptr->second.value);
+        this->_entries.erase(find_ptr);
+        this->_keys--;
     }
 
     template<typename K, typename V>
     void MRUCache<K, V>::insert_no_evict(const K &key, const V &value) {
-        std::lock_guard<std::mutex> lock(this->_cache_mutex);
-        if (this->_cache_index.find(key) == this->_cache_index.end()) {
-            this->_order.emplace_front(key);
-            this->_order_lookup.emplace(key, this->_order.begin());
-            this->_cache_index.emplace(key, std::make_unique<V>(value));
-
-            // only change recency of read on access, not on addition
-            this->_keys++;
-        }
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (this->_entries.find(key) == this->_entries.end())
+            this->emplace(key, std::make_shared<V>(value));
+    }
 
+    template<typename K, typename V>
+    bool MRUCache<K, V>::peek_victim(const K &, K &victim) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (this->_order.empty())
+            return false;
+        victim = this->_order.front();
+        return true;
     }
 
     template<typename K, typename V>
     void MRUCache<K, V>::trim() {
-        std::lock_guard<std::mutex> lock(this->_cache_mutex);
-        for (uint64_t i = this->_cache_index.size(); i >= this->_max_cache_size; i--) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        for (uint64_t i = this->_entries.size(); i >= this->_max_cache_size && !this->_order.empty(); i--) {
+            this->evict();
+        }
+        while (!this->_order.empty() && this->over_budget()) {
             this->evict();
         }
     }
 
 
 /*
+ * SLAB LRU CACHE
  *
+ * LRU cache whose entries live in one slab with embedded prev/next indices,
+ * located through a single open-addressed (linear probing) index. Each key is
+ * stored once and a hit costs one probe plus an in-slab relink.
  *
- * CACHE DECORATORS
- *
- *
+ * The slab grows a fixed-size chunk at a time and entries never move, so values are
+ * stored inline and references to them stay valid as it grows. An entry's handle is
+ * made on its first hit and shared by every later one. An evicted entry whose handles
+ * are still held is retired instead of reused, until the last of them is dropped.
  */
 
 
-/*
- * BASE CACHE DECORATOR
- */
-
     template<typename K, typename V>
-    class CacheDecorator : public CacheIndex<K, V> {
+    class SlabLRUCache : public BasicEvictionCache<K, V> {
     protected:
-        std::shared_ptr<CacheIndex<K, V> > _decorated_cache;
-        // Locks for thread safety
-        std::mutex _cache_mutex;
+        static constexpr uint32_t NIL = UINT32_MAX;
+
+        struct Entry {
+            K key;
+            V value;
+            uint64_t hash;
+            uint32_t prev;
+            uint32_t next; // doubles as free list link for unused entries
+            std::shared_ptr<V> handle; // aliases value, shared with handles handed out on hits
+        };
+
+        static constexpr uint8_t CHUNK_BITS = 10;
+        static constexpr uint32_t CHUNK_MASK = (1U << CHUNK_BITS) - 1;
+
+        // handles keep the chunks alive, so a handle can outlive the cache
+        struct Chunks {
+            std::vector<std::unique_ptr<Entry[]> > chunks;
+        };
+
+        // Storage structures
+        std::shared_ptr<Chunks> _slab;
+        uint32_t _allocated; // entries taken from the chunks so far
+        std::vector<uint32_t> _retired; // evicted entries whose handles are still held
+        std::vector<uint32_t> _index; // slot -> entry in slab, NIL if empty
+        uint64_t _index_mask;
+        uint8_t _index_shift;
+
+        // Recency list (head is most recently used) and free list
+        uint32_t _head;
+        uint32_t _tail;
+        uint32_t _free;
+        uint32_t _count;
 
-    public:
-        CacheDecorator() = default;
+        void evict() override;
 
-        void set_cache(std::shared_ptr<CacheIndex<K, V> > &cache) { _decorated_cache = cache; }
+        Entry &entry(uint32_t e) const { return _slab->chunks[e >> CHUNK_BITS][e & CHUNK_MASK]; }
 
-        /*
-         * Overwrite State Descriptors
-         */
-        void set_max_size(uint64_t max_size) { this->_decorated_cache->set_max_size(max_size); }
+        uint64_t slot_of(uint64_t hash) const { return (hash * 0x9E3779B97F4A7C15ULL) >> _index_shift; }
 
-        double hit_rate() {
-            return this->_decorated_cache->hit_rate();
-        }
+        uint64_t locate(const K &key, uint64_t hash) const;
 
-        uint64_t hits() { return this->_decorated_cache->hits(); }
+        void resize_index(uint64_t min_entries);
 
-        uint64_t misses() { return this->_decorated_cache->misses(); }
+        void unindex(uint64_t slot);
 
-        uint32_t capacity() { return this->_decorated_cache->capacity(); }
+        void link_front(uint32_t e);
 
-        uint32_t size() { return this->_decorated_cache->size(); }
+        void unlink(uint32_t e);
 
-        typename std::unordered_map<K, std::unique_ptr<V>>::iterator end() { return this->_decorated_cache->end(); }
+        uint32_t place(const K &key, V value, uint64_t hash);
 
-        void serialize(std::ostream &output) const {
-            _decorated_cache->serialize(output);
-        }
+        uint32_t allocate();
 
-    };
+        // recycles an unlinked entry, or retires it while handles to it are held
+        void release(uint32_t e);
 
-/*
-* BLOOM FILTER ENHANCED CACHE
-*/
+        std::shared_ptr<V> handle(uint32_t e);
 
-    template<typename K, typename V>
-    class BFECache : public CacheDecorator<K, V> {
-    private:
-        uint32_t _m; // number of bits (power of 2)
-        uint16_t _k; // number of hash functions (power of 2)
-        uint8_t _hash_size; // number of elements considered in each hash
-        uint16_t _data_len; // number of elements available to hash over
-        uint16_t _alphabits; // number of bits required to represent alphabet TODO: make this a parameter
+        // ahead of the entry being resolved, far enough for the line to arrive first
+        static constexpr size_t PREFETCH_DISTANCE = 16;
 
-        std::vector<std::vector<u_int16_t> > _funcs;
-        std::vector<bool> _bits;
+    public:
 
-        void initialize_bloom_filter();
+        SlabLRUCache() : SlabLRUCache(1048576 * 4) {};
 
-    public:
-        uint64_t hash_key(const K &key, uint16_t func);
+        explicit SlabLRUCache(uint64_t max_size);
 
-        void add_key(const K &key); // add key to bloom filter
-        bool possibly_exists(const K &key); // check if key exists (possibly returns true if key doesn't exist)
-        std::vector<std::vector<u_int16_t> > get_functions() { return _funcs; }
+        ~SlabLRUCache();
 
-    public:
-        BFECache();
+        SlabLRUCache(const SlabLRUCache &) = delete;
 
-        BFECache(uint32_t m, uint16_t k, uint16_t data_len);
+        SlabLRUCache &operator=(const SlabLRUCache &) = delete;
 
-        void set_bloom_params(uint32_t m, uint16_t k, uint16_t data_len) {
-            _m = m;
-            _k = k;
-            _data_len = data_len;
-            initialize_bloom_filter();
-        }
+        void set_max_size(uint64_t max_size) override;
 
-        void update(int event) override { this->_decorated_cache->update(event); }
+        uint32_t size() override { return _count; }
 
         void insert(const K &key, const V &value) override;
 
@@ -531,145 +967,2292 @@ namespace SeAlM {
 
         void trim() override;
 
-        typename std::unordered_map<K, std::unique_ptr<V>>::iterator find(const K &key) override;
+        uint64_t trim_to(uint64_t size, uint64_t max_entries) override;
+
+        CacheHandle<V> find(const K &key) override;
 
         V &at(const K &key) override;
 
+        std::shared_ptr<V> probe(const K &key) override;
+
+        bool contains(const K &key) override;
+
+        void find_many(const std::vector<K> &keys, std::vector<std::shared_ptr<const V> > &handles) override;
+
+        void insert_many(const std::vector<K> &keys, std::vector<V> &values, const std::vector<double> &costs) override;
+
         V &operator[](K &key) override;
 
         void clear() override;
 
         void fetch_into(const K &key, V *buff) override;
 
+        bool peek_victim(const K &candidate, K &victim) override;
     };
 
     template<typename K, typename V>
-    void BFECache<K, V>::initialize_bloom_filter() {
-        _alphabits = 3;
-        _bits.resize(_m, 0);
-        // random number generator to generate functions
-        std::default_random_engine generator;
-        generator.seed(1234);
-        // TODO: use a distribution that takes into account error profile and known prefix (e.g. Gamma)
-        std::uniform_int_distribution<u_int16_t> distribution(0, _data_len - 1);
-
-        _hash_size = ceil(log2(_m) / _alphabits);
-        // create functions
-        _funcs.resize(_k);
-        for (int i = 0; i < _k; i++) {
-            for (int j = 0; j < _hash_size; j++) {
-                _funcs[i].emplace_back(distribution(generator));
-            }
-        }
+    SlabLRUCache<K, V>::SlabLRUCache(uint64_t max_size) : BasicEvictionCache<K, V>(max_size),
+                                                         _slab{std::make_shared<Chunks>()}, _allocated{0},
+                                                         _head{NIL}, _tail{NIL}, _free{NIL}, _count{0} {
+        clear();
     }
 
     template<typename K, typename V>
-    uint64_t BFECache<K, V>::hash_key(const K &key, uint16_t func) {
-        uint64_t hash_res = 0;
-        uint8_t shift_amnt = 0;
-
-        for (int i = 0; i < _hash_size; i++) {
-            switch (key[_funcs[func][i]]) {
-                case 'A':
-                    hash_res |= 0 << shift_amnt;
-                    break;
-                case 'C':
-                    hash_res |= 1 << shift_amnt;
-                    break;
-                case 'G':
-                    hash_res |= 2 << shift_amnt;
-                    break;
-                case 'T':
-                    hash_res |= 3 << shift_amnt;
-                    break;
-                case 'N':
-                    hash_res |= 4 << shift_amnt;
-                    break;
-                default:
-                    // case where unknown character is found or reads are trimmed (thus too short for function)
-                    hash_res |= 7 << shift_amnt;
-                    break;
-            }
-            shift_amnt += _alphabits;
-        }
-
-        return hash_res;
+    SlabLRUCache<K, V>::~SlabLRUCache() {
+        // handles hold the chunks, the entries' own references would keep them alive for good
+        for (uint32_t e = 0; e < _allocated; e++)
+            entry(e).handle.reset();
     }
 
     template<typename K, typename V>
-    void BFECache<K, V>::add_key(const K &key) {
-        std::lock_guard<std::mutex> lock(this->_cache_mutex);
-        for (int i = 0; i < _k; i++) {
-            _bits[hash_key(key, i)] = 1;
+    uint64_t SlabLRUCache<K, V>::locate(const K &key, uint64_t hash) const {
+        // returns the slot holding key, or the empty slot that ends its probe sequence
+        uint64_t slot = slot_of(hash);
+        while (_index[slot] != NIL) {
+            const Entry &e = entry(_index[slot]);
+            if (e.hash == hash && e.key == key)
+                break;
+            slot = (slot + 1) & _index_mask;
         }
+        return slot;
     }
 
     template<typename K, typename V>
-    bool BFECache<K, V>::possibly_exists(const K &key) {
-        std::lock_guard<std::mutex> lock(this->_cache_mutex);
-        for (int i = 0; i < _k; i++) {
-            if (!_bits[hash_key(key, i)])
-                return false;
+    void SlabLRUCache<K, V>::resize_index(uint64_t min_entries) {
+        // keep load factor at or below 0.5 so probe sequences stay within a cache line or two
+        uint8_t bits = 4;
+        while ((1ULL << bits) < 2 * min_entries)
+            bits++;
+        _index.assign(1ULL << bits, NIL);
+        _index_mask = (1ULL << bits) - 1;
+        _index_shift = 64 - bits;
+
+        for (uint32_t e = _head; e != NIL; e = entry(e).next) {
+            uint64_t slot = slot_of(entry(e).hash);
+            while (_index[slot] != NIL)
+                slot = (slot + 1) & _index_mask;
+            _index[slot] = e;
         }
-        return true;
     }
 
     template<typename K, typename V>
-    BFECache<K, V>::BFECache() {
-        // choose m and k to get an epsilon of ~5%, will be less due to rounding to nearest pow of 2
-        // assumes cache holds default number of elements (4M keys)
-        _m = 1 < 24;
-        _k = 1 < 2;
-        _hash_size = 8;  // assumes 3 bits per base
-        _data_len = 100;
-
-        initialize_bloom_filter();
+    void SlabLRUCache<K, V>::unindex(uint64_t slot) {
+        // backward shift deletion, avoids tombstones
+        uint64_t hole = slot;
+        for (uint64_t j = (slot + 1) & _index_mask; _index[j] != NIL; j = (j + 1) & _index_mask) {
+            uint64_t home = slot_of(entry(_index[j]).hash);
+            if (((j - home) & _index_mask) >= ((j - hole) & _index_mask)) {
+                _index[hole] = _index[j];
+                hole = j;
+            }
+        }
+        _index[hole] = NIL;
     }
 
     template<typename K, typename V>
-    BFECache<K, V>::BFECache(uint32_t m, uint16_t k, uint16_t data_len) {
-        // choose m and k to get an epsilon of ~5%, will be less due to rounding to nearest pow of 2
-        // assumes cache holds default number of elements (4M keys)
-        _m = m;
-        _k = k;
-        _hash_size = 2;  // assumes 3 bits per base
-        _data_len = data_len;
+    void SlabLRUCache<K, V>::link_front(uint32_t e) {
+        entry(e).prev = NIL;
+        entry(e).next = _head;
+        if (_head != NIL)
+            entry(_head).prev = e;
+        _head = e;
+        if (_tail == NIL)
+            _tail = e;
+    }
 
-        initialize_bloom_filter();
+    template<typename K, typename V>
+    void SlabLRUCache<K, V>::unlink(uint32_t e) {
+        if (entry(e).prev != NIL)
+            entry(entry(e).prev).next = entry(e).next;
+        else
+            _head = entry(e).next;
+        if (entry(e).next != NIL)
+            entry(entry(e).next).prev = entry(e).prev;
+        else
+            _tail = entry(e).prev;
     }
 
     template<typename K, typename V>
-    void BFECache<K, V>::insert(const K &key, const V &value) {
-        if (possibly_exists(key)) {
-            // key already seen, good candidate for cache
-            this->_decorated_cache->insert(key, value);
-        } else {
-            // remember key, but don't add to cache
-            add_key(key);
+    uint32_t SlabLRUCache<K, V>::allocate() {
+        if (_free == NIL) {
+            // retired entries whose handles have all been dropped are only referenced by themselves
+            for (size_t i = 0; i < _retired.size();) {
+                if (entry(_retired[i]).handle.use_count() > 1) {
+                    i++;
+                    continue;
+                }
+                release(_retired[i]);
+                _retired[i] = _retired.back();
+                _retired.pop_back();
+            }
+        }
+        if (_free != NIL) {
+            uint32_t e = _free;
+            _free = entry(e).next;
+            return e;
         }
+        if ((_allocated & CHUNK_MASK) == 0)
+            _slab->chunks.emplace_back(new Entry[1U << CHUNK_BITS]);
+        return _allocated++;
     }
 
     template<typename K, typename V>
-    void BFECache<K, V>::insert_no_evict(const K &key, const V &value) {
-        if (possibly_exists(key)) {
-            // key already seen, good candidate for cache
-            this->_decorated_cache->insert_no_evict(key, value);
-        } else {
-            // remember key, but don't add to cache
-            add_key(key);
+    void SlabLRUCache<K, V>::release(uint32_t e) {
+        Entry &en = entry(e);
+        if (en.handle.use_count() > 1) {
+            _retired.push_back(e);
+            return;
         }
+        // release any heap memory held by the entry and recycle it
+        en.handle.reset();
+        en.key = K();
+        en.value = V();
+        en.next = _free;
+        _free = e;
     }
 
     template<typename K, typename V>
-    void BFECache<K, V>::trim() {
-        this->_decorated_cache->trim();
+    std::shared_ptr<V> SlabLRUCache<K, V>::handle(uint32_t e) {
+        Entry &en = entry(e);
+        if (!en.handle)
+            en.handle = std::shared_ptr<V>(&en.value, [slab = _slab](V *) {});
+        return en.handle;
     }
 
     template<typename K, typename V>
-    typename std::unordered_map<K, std::unique_ptr<V>>::iterator BFECache<K, V>::find(const K &key) {
-        if (!possibly_exists(key)) {
+    uint32_t SlabLRUCache<K, V>::place(const K &key, V value, uint64_t hash) {
+        // caller holds lock and has checked key is absent
+        this->on_insert(key, value);
+        uint32_t e = allocate();
+        Entry &en = entry(e);
+        en.key = key;
+        en.value = std::move(value);
+        en.hash = hash;
+        link_front(e);
+        _count++;
+        this->_keys++;
+
+        if (2 * static_cast<uint64_t>(_count) > _index.size()) {
+            // insert_no_evict may overfill until the next trim
+            resize_index(_count);
+        } else {
+            _index[locate(key, hash)] = e;
+        }
+        return e;
+    }
+
+    template<typename K, typename V>
+    void SlabLRUCache<K, V>::evict() {
+        // caller holds lock
+        uint32_t e = _tail;
+        if (e == NIL)
+            return;
+        unindex(locate(entry(e).key, entry(e).hash));
+        unlink(e);
+        this->on_evict(entry(e).key, entry(e).value);
+        release(e);
+        _count--;
+        this->_keys--;
+    }
+
+    template<typename K, typename V>
+    void SlabLRUCache<K, V>::set_max_size(uint64_t max_size) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        this->_max_cache_size = max_size;
+        if (2 * max_size > _index.size())
+            resize_index(std::max<uint64_t>(max_size, _count));
+    }
+
+    template<typename K, typename V>
+    void SlabLRUCache<K, V>::insert(const K &key, const V &value) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        uint64_t hash = std::hash<K>{}(key);
+        if (_index[locate(key, hash)] == NIL) {
+            if (_count >= this->_max_cache_size)
+                evict();
+            while (_count > 0 && this->over_budget(this->entry_bytes(key, value)))
+                evict();
+            place(key, value, hash);
+        }
+    }
+
+    template<typename K, typename V>
+    void SlabLRUCache<K, V>::insert_no_evict(const K &key, const V &value) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        uint64_t hash = std::hash<K>{}(key);
+        if (_index[locate(key, hash)] == NIL)
+            place(key, value, hash);
+    }
+
+    template<typename K, typename V>
+    void SlabLRUCache<K, V>::trim() {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        while (_count > this->_max_cache_size || (_count > 0 && this->over_budget()))
+            evict();
+    }
+
+    template<typename K, typename V>
+    uint64_t SlabLRUCache<K, V>::trim_to(uint64_t size, uint64_t max_entries) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        uint64_t evicted = 0;
+        while (evicted < max_entries && _count > 0 && (_count > size || this->over_budget())) {
+            evict();
+            evicted++;
+        }
+        return evicted;
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> SlabLRUCache<K, V>::find(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        uint32_t e = _index[locate(key, std::hash<K>{}(key))];
+        e == NIL ? this->_misses++ : this->_hits++;
+        return CacheHandle<V>(e == NIL ? nullptr : handle(e));
+    }
+
+    template<typename K, typename V>
+    V &SlabLRUCache<K, V>::at(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        uint32_t e = _index[locate(key, std::hash<K>{}(key))];
+        if (e == NIL)
+            throw std::out_of_range("SlabLRUCache::at");
+        unlink(e);
+        link_front(e);
+        return entry(e).value;
+    }
+
+    template<typename K, typename V>
+    std::shared_ptr<V> SlabLRUCache<K, V>::probe(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        uint32_t e = _index[locate(key, std::hash<K>{}(key))];
+        if (e == NIL) {
+            this->_misses++;
+            return nullptr;
+        }
+        this->_hits++;
+        if (e != _head) {
+            unlink(e);
+            link_front(e);
+        }
+        return handle(e);
+    }
+
+    template<typename K, typename V>
+    bool SlabLRUCache<K, V>::contains(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        return _index[locate(key, std::hash<K>{}(key))] != NIL;
+    }
+
+    template<typename K, typename V>
+    void SlabLRUCache<K, V>::find_many(const std::vector<K> &keys, std::vector<std::shared_ptr<const V> > &handles) {
+        // hashes are computed before taking the lock, under it each key's index slot is prefetched
+        // PREFETCH_DISTANCE keys ahead and its entry half that ahead, so the probe finds both in cache
+        std::vector<uint64_t> hashes(keys.size());
+        for (size_t i = 0; i < keys.size(); i++)
+            hashes[i] = std::hash<K>{}(keys[i]);
+        handles.resize(keys.size());
+
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (i + PREFETCH_DISTANCE < keys.size())
+                prefetch(&_index[slot_of(hashes[i + PREFETCH_DISTANCE])]);
+            if (i + PREFETCH_DISTANCE / 2 < keys.size()) {
+                uint32_t ahead = _index[slot_of(hashes[i + PREFETCH_DISTANCE / 2])];
+                if (ahead != NIL)
+                    prefetch(&entry(ahead));
+            }
+            uint32_t e = _index[locate(keys[i], hashes[i])];
+            if (e == NIL) {
+                this->_misses++;
+                handles[i] = nullptr;
+                continue;
+            }
+            this->_hits++;
+            if (e != _head) {
+                unlink(e);
+                link_front(e);
+            }
+            handles[i] = handle(e);
+        }
+    }
+
+    template<typename K, typename V>
+    void SlabLRUCache<K, V>::insert_many(const std::vector<K> &keys, std::vector<V> &values,
+                                         const std::vector<double> &) {
+        std::vector<uint64_t> hashes(keys.size());
+        for (size_t i = 0; i < keys.size(); i++)
+            hashes[i] = std::hash<K>{}(keys[i]);
+
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (i + PREFETCH_DISTANCE < keys.size())
+                prefetch(&_index[slot_of(hashes[i + PREFETCH_DISTANCE])]);
+            // place may grow the index, so the slot is located again for each key
+            if (_index[locate(keys[i], hashes[i])] == NIL)
+                place(keys[i], std::move(values[i]), hashes[i]);
+        }
+    }
+
+    template<typename K, typename V>
+    V &SlabLRUCache<K, V>::operator[](K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        uint64_t hash = std::hash<K>{}(key);
+        uint32_t e = _index[locate(key, hash)];
+        if (e == NIL)
+            e = place(key, V(), hash);
+        return entry(e).value;
+    }
+
+    template<typename K, typename V>
+    void SlabLRUCache<K, V>::clear() {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        std::vector<uint32_t> retired;
+        retired.swap(_retired);
+        for (uint32_t e : retired)
+            release(e);
+        for (uint32_t e = _head; e != NIL;) {
+            uint32_t next = entry(e).next;
+            release(e);
+            e = next;
+        }
+        if (_retired.empty()) {
+            // nothing handed out is still held, the chunks can go
+            _slab->chunks.clear();
+            _allocated = 0;
+            _free = NIL;
+        }
+        _head = NIL;
+        _tail = NIL;
+        _count = 0;
+        this->_keys = 0;
+        this->_bytes = 0;
+        resize_index(this->_max_cache_size);
+    }
+
+    template<typename K, typename V>
+    bool SlabLRUCache<K, V>::peek_victim(const K &, K &victim) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (_tail == NIL)
+            return false;
+        victim = entry(_tail).key;
+        return true;
+    }
+
+    template<typename K, typename V>
+    void SlabLRUCache<K, V>::fetch_into(const K &key, V *buff) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        uint32_t e = _index[locate(key, std::hash<K>{}(key))];
+        if (e == NIL) {
+            this->_misses++;
+            return;
+        }
+        this->_hits++;
+        unlink(e);
+        link_front(e);
+        if (buff != nullptr)
+            *buff = entry(e).value;
+    }
+
+
+/*
+ * CLOCK FAMILY CACHES
+ *
+ * Base for FIFO-derived policies (CLOCK, S3-FIFO) whose hit path only bumps a small
+ * per-entry counter. Probes run under a shared lock and never reorder anything, so
+ * hits from concurrent readers do not serialize; inserts and evictions take the
+ * lock exclusively.
+ */
+
+
+    template<typename K, typename V>
+    class ClockFamilyCache : public BasicEvictionCache<K, V> {
+    protected:
+        struct Slot {
+            K key;
+            std::shared_ptr<V> value;
+            std::atomic<uint8_t> freq;
+            uint8_t queue;
+            bool used;
+
+            Slot() : freq{0}, queue{0}, used{false} {};
+        };
+
+        // Storage structures (deque never moves slots, so atomics stay in place as it grows)
+        std::deque<Slot> _slots;
+        std::vector<uint32_t> _free_slots;
+        std::unordered_map<K, uint32_t> _slot_lookup;
+        uint8_t _max_freq;
+
+        // Locks for thread safety (shared for probes, exclusive for structural changes)
+        SharedCacheMutex _rw_mutex;
+
+        // Policy hooks, called with exclusive lock held
+        virtual void admit(const K &key, uint32_t slot) = 0;
+
+        virtual void clear_queues() = 0;
+
+        uint32_t place(const K &key, const V &value);
+
+        void release(uint32_t slot);
+
+        void bump(Slot &s) {
+            // saturating increment, skip the store once saturated to keep the line clean
+            uint8_t f = s.freq.load(std::memory_order_relaxed);
+            if (f < _max_freq)
+                s.freq.store(f + 1, std::memory_order_relaxed);
+        }
+
+    public:
+
+        ClockFamilyCache(uint64_t max_size, uint8_t max_freq);
+
+        // _keys moves with place/release under the exclusive lock and is atomic, so size() needs no lock
+        uint32_t size() override { return this->_keys; }
+
+        uint64_t lock_wait_ns() override { return this->_cache_mutex.wait_ns() + _rw_mutex.wait_ns(); }
+
+        void set_max_size(uint64_t max_size) override;
+
+        void insert(const K &key, const V &value) override;
+
+        void insert_no_evict(const K &key, const V &value) override;
+
+        void trim() override;
+
+        CacheHandle<V> find(const K &key) override;
+
+        V &at(const K &key) override;
+
+        std::shared_ptr<V> probe(const K &key) override;
+
+        bool contains(const K &key) override;
+
+        V &operator[](K &key) override;
+
+        void clear() override;
+
+        void fetch_into(const K &key, V *buff) override;
+    };
+
+    template<typename K, typename V>
+    ClockFamilyCache<K, V>::ClockFamilyCache(uint64_t max_size, uint8_t max_freq) : BasicEvictionCache<K, V>(
+            max_size), _max_freq{max_freq} {
+        // slot and slot lookup each hold the key
+        this->_key_copies = 2;
+        _slot_lookup.reserve(this->_max_cache_size);
+    }
+
+    template<typename K, typename V>
+    uint32_t ClockFamilyCache<K, V>::place(const K &key, const V &value) {
+        uint32_t e;
+        if (!_free_slots.empty()) {
+            e = _free_slots.back();
+            _free_slots.pop_back();
+        } else {
+            e = _slots.size();
+            _slots.emplace_back();
+        }
+        Slot &s = _slots[e];
+        s.key = key;
+        s.value = std::make_shared<V>(value);
+        s.freq.store(0, std::memory_order_relaxed);
+        s.used = true;
+        _slot_lookup.emplace(key, e);
+        this->_keys++;
+        this->on_insert(key, value);
+        return e;
+    }
+
+    template<typename K, typename V>
+    void ClockFamilyCache<K, V>::release(uint32_t slot) {
+        Slot &s = _slots[slot];
+        this->on_evict(s.key, *s.value);
+        _slot_lookup.erase(s.key);
+        s.key = K();
+        s.value.reset();
+        s.used = false;
+        _free_slots.emplace_back(slot);
+        this->_keys--;
+    }
+
+    template<typename K, typename V>
+    void ClockFamilyCache<K, V>::set_max_size(uint64_t max_size) {
+        std::unique_lock<SharedCacheMutex> lock(_rw_mutex);
+        this->_max_cache_size = max_size;
+        _slot_lookup.reserve(max_size);
+    }
+
+    template<typename K, typename V>
+    void ClockFamilyCache<K, V>::insert(const K &key, const V &value) {
+        std::unique_lock<SharedCacheMutex> lock(_rw_mutex);
+        if (_slot_lookup.find(key) == _slot_lookup.end()) {
+            while (!_slot_lookup.empty() && (_slot_lookup.size() >= this->_max_cache_size ||
+                                             this->over_budget(this->entry_bytes(key, value))))
+                this->evict();
+            admit(key, place(key, value));
+        }
+    }
+
+    template<typename K, typename V>
+    void ClockFamilyCache<K, V>::insert_no_evict(const K &key, const V &value) {
+        std::unique_lock<SharedCacheMutex> lock(_rw_mutex);
+        if (_slot_lookup.find(key) == _slot_lookup.end())
+            admit(key, place(key, value));
+    }
+
+    template<typename K, typename V>
+    void ClockFamilyCache<K, V>::trim() {
+        std::unique_lock<SharedCacheMutex> lock(_rw_mutex);
+        while (_slot_lookup.size() > this->_max_cache_size || (!_slot_lookup.empty() && this->over_budget()))
+            this->evict();
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> ClockFamilyCache<K, V>::find(const K &key) {
+        std::shared_lock<SharedCacheMutex> lock(_rw_mutex);
+        auto find_ptr = _slot_lookup.find(key);
+        find_ptr != _slot_lookup.end() ? this->_hits++ : this->_misses++;
+        return CacheHandle<V>(find_ptr != _slot_lookup.end() ? _slots[find_ptr->second].value : nullptr);
+    }
+
+    template<typename K, typename V>
+    V &ClockFamilyCache<K, V>::at(const K &key) {
+        std::shared_lock<SharedCacheMutex> lock(_rw_mutex);
+        Slot &s = _slots[_slot_lookup.at(key)];
+        bump(s);
+        return *s.value;
+    }
+
+    template<typename K, typename V>
+    std::shared_ptr<V> ClockFamilyCache<K, V>::probe(const K &key) {
+        std::shared_lock<SharedCacheMutex> lock(_rw_mutex);
+        auto find_ptr = _slot_lookup.find(key);
+        if (find_ptr == _slot_lookup.end()) {
+            this->_misses++;
+            return nullptr;
+        }
+        this->_hits++;
+        Slot &s = _slots[find_ptr->second];
+        bump(s);
+        return s.value;
+    }
+
+    template<typename K, typename V>
+    bool ClockFamilyCache<K, V>::contains(const K &key) {
+        std::shared_lock<SharedCacheMutex> lock(_rw_mutex);
+        return _slot_lookup.find(key) != _slot_lookup.end();
+    }
+
+    template<typename K, typename V>
+    V &ClockFamilyCache<K, V>::operator[](K &key) {
+        std::unique_lock<SharedCacheMutex> lock(_rw_mutex);
+        auto find_ptr = _slot_lookup.find(key);
+        if (find_ptr != _slot_lookup.end())
+            return *_slots[find_ptr->second].value;
+        uint32_t e = place(key, V());
+        admit(key, e);
+        return *_slots[e].value;
+    }
+
+    template<typename K, typename V>
+    void ClockFamilyCache<K, V>::clear() {
+        std::unique_lock<SharedCacheMutex> lock(_rw_mutex);
+        _slots.clear();
+        _free_slots.clear();
+        _slot_lookup.clear();
+        this->_keys = 0;
+        this->_bytes = 0;
+        clear_queues();
+    }
+
+    template<typename K, typename V>
+    void ClockFamilyCache<K, V>::fetch_into(const K &key, V *buff) {
+        auto cached = this->probe(key);
+        if (cached && buff != nullptr)
+            *buff = *cached;
+    }
+
+
+/*
+ * CLOCK CACHE
+ *
+ * Second-chance approximation of LRU: a hit sets the entry's reference bit, the
+ * hand sweeps the slots on eviction, clearing set bits and evicting the first
+ * entry found without one.
+ */
+
+
+    template<typename K, typename V>
+    class ClockCache : public ClockFamilyCache<K, V> {
+    protected:
+        uint32_t _hand;
+
+        // slots peek_victim looks at ahead of the hand
+        static constexpr uint32_t PEEK_DISTANCE = 8;
+
+        void evict() override;
+
+        void admit(const K &, uint32_t) override {};
+
+        void clear_queues() override { _hand = 0; };
+
+    public:
+        ClockCache() : ClockCache(1048576 * 4) {};
+
+        explicit ClockCache(uint64_t max_size) : ClockFamilyCache<K, V>(max_size, 1), _hand{0} {};
+
+        bool peek_victim(const K &candidate, K &victim) override;
+    };
+
+    template<typename K, typename V>
+    bool ClockCache<K, V>::peek_victim(const K &, K &victim) {
+        // first unreferenced entry within a few entries of the hand, reference bits are left alone,
+        // or the first entry there if all of them are referenced. Free slots are skipped uncounted
+        std::shared_lock<SharedCacheMutex> lock(this->_rw_mutex);
+        uint64_t n = this->_slots.size();
+        uint64_t peeked = 0;
+        bool found = false;
+        for (uint64_t i = 0; i < n && peeked < PEEK_DISTANCE; i++) {
+            auto &s = this->_slots[(_hand + i) % n];
+            if (!s.used)
+                continue;
+            peeked++;
+            if (s.freq.load(std::memory_order_relaxed) == 0) {
+                victim = s.key;
+                return true;
+            }
+            if (!found) {
+                victim = s.key;
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    template<typename K, typename V>
+    void ClockCache<K, V>::evict() {
+        // caller holds exclusive lock, terminates within two sweeps since each pass clears bits
+        if (this->_slot_lookup.empty())
+            return;
+        while (true) {
+            if (_hand >= this->_slots.size())
+                _hand = 0;
+            uint32_t e = _hand++;
+            auto &s = this->_slots[e];
+            if (!s.used)
+                continue;
+            if (s.freq.load(std::memory_order_relaxed) > 0) {
+                s.freq.store(0, std::memory_order_relaxed);
+                continue;
+            }
+            this->release(e);
+            return;
+        }
+    }
+
+
+/*
+ * S3-FIFO CACHE
+ *
+ * Small, main and ghost FIFO queues (Yang et al., SOSP '23). New keys enter the small
+ * queue (10% of capacity) and are only promoted to main if hit again before they reach
+ * its head, so one-time reads leave quickly. Keys evicted from small are remembered in
+ * the ghost queue and go straight to main if they return. Main is a FIFO with
+ * reinsertion driven by a 2-bit hit counter.
+ */
+
+
+    template<typename K, typename V>
+    class S3FIFOCache : public ClockFamilyCache<K, V> {
+    protected:
+        enum Queue : uint8_t {
+            SMALL = 0,
+            MAIN = 1
+        };
+
+        std::deque<uint32_t> _small;
+        std::deque<uint32_t> _main;
+        std::list<K> _ghost;
+        std::unordered_map<K, typename std::list<K>::iterator> _ghost_lookup;
+        float _small_ratio;
+
+        uint64_t small_capacity() { return std::max<uint64_t>(1, this->_max_cache_size * _small_ratio); }
+
+        uint64_t ghost_capacity() { return this->_max_cache_size - std::min(this->_max_cache_size, small_capacity()); }
+
+        void evict() override;
+
+        bool evict_small();
+
+        void evict_main();
+
+        void remember(const K &key);
+
+        void admit(const K &key, uint32_t slot) override;
+
+        void clear_queues() override;
+
+    public:
+        S3FIFOCache() : S3FIFOCache(1048576 * 4) {};
+
+        explicit S3FIFOCache(uint64_t max_size) : ClockFamilyCache<K, V>(max_size, 3), _small_ratio{0.1} {};
+
+        bool in_ghost(const K &key) { return _ghost_lookup.find(key) != _ghost_lookup.end(); }
+
+        bool peek_victim(const K &candidate, K &victim) override;
+    };
+
+    template<typename K, typename V>
+    bool S3FIFOCache<K, V>::peek_victim(const K &, K &victim) {
+        // the head evict() looks at first, a small head hit again on probation would be promoted
+        std::shared_lock<SharedCacheMutex> lock(this->_rw_mutex);
+        if ((_small.size() >= small_capacity() || _main.empty()) && !_small.empty()) {
+            auto &s = this->_slots[_small.front()];
+            if (s.freq.load(std::memory_order_relaxed) <= 1 || _main.empty()) {
+                victim = s.key;
+                return true;
+            }
+        }
+        if (_main.empty())
+            return false;
+        victim = this->_slots[_main.front()].key;
+        return true;
+    }
+
+    template<typename K, typename V>
+    void S3FIFOCache<K, V>::admit(const K &key, uint32_t slot) {
+        auto ghost_ptr = _ghost_lookup.find(key);
+        if (ghost_ptr != _ghost_lookup.end()) {
+            // seen recently enough to be remembered, skip probation
+            _ghost.erase(ghost_ptr->second);
+            _ghost_lookup.erase(ghost_ptr);
+            this->_slots[slot].queue = MAIN;
+            _main.push_back(slot);
+        } else {
+            this->_slots[slot].queue = SMALL;
+            _small.push_back(slot);
+        }
+    }
+
+    template<typename K, typename V>
+    void S3FIFOCache<K, V>::remember(const K &key) {
+        _ghost.push_front(key);
+        _ghost_lookup.emplace(key, _ghost.begin());
+        while (!_ghost.empty() && _ghost.size() > ghost_capacity()) {
+            _ghost_lookup.erase(_ghost.back());
+            _ghost.pop_back();
+        }
+    }
+
+    template<typename K, typename V>
+    bool S3FIFOCache<K, V>::evict_small() {
+        while (!_small.empty()) {
+            uint32_t e = _small.front();
+            _small.pop_front();
+            auto &s = this->_slots[e];
+            if (s.freq.load(std::memory_order_relaxed) > 1) {
+                // re-referenced while on probation, promote
+                s.freq.store(0, std::memory_order_relaxed);
+                s.queue = MAIN;
+                _main.push_back(e);
+            } else {
+                remember(s.key);
+                this->release(e);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template<typename K, typename V>
+    void S3FIFOCache<K, V>::evict_main() {
+        while (!_main.empty()) {
+            uint32_t e = _main.front();
+            _main.pop_front();
+            auto &s = this->_slots[e];
+            uint8_t f = s.freq.load(std::memory_order_relaxed);
+            if (f > 0) {
+                s.freq.store(f - 1, std::memory_order_relaxed);
+                _main.push_back(e);
+            } else {
+                this->release(e);
+                return;
+            }
+        }
+    }
+
+    template<typename K, typename V>
+    void S3FIFOCache<K, V>::evict() {
+        // caller holds exclusive lock
+        if (_small.size() >= small_capacity() || _main.empty()) {
+            if (evict_small())
+                return;
+        }
+        evict_main();
+    }
+
+    template<typename K, typename V>
+    void S3FIFOCache<K, V>::clear_queues() {
+        _small.clear();
+        _main.clear();
+        _ghost.clear();
+        _ghost_lookup.clear();
+    }
+
+
+/*
+ * ARC CACHE
+ *
+ * Adaptive Replacement Cache (Megiddo & Modha, FAST '03). Resident keys live in T1
+ * (seen once recently) or T2 (seen at least twice), and the keys they evict are
+ * remembered in the B1/B2 ghost lists. A miss that hits B1 grows the T1 target p and
+ * one that hits B2 shrinks it, so the split between recency and frequency follows
+ * the workload.
+ */
+
+
+    template<typename K, typename V>
+    class ARCCache : public BasicEvictionCache<K, V> {
+    protected:
+        enum List : uint8_t {
+            T1 = 0,
+            T2 = 1,
+            B1 = 2,
+            B2 = 3
+        };
+
+        struct Location {
+            List list;
+            typename std::list<K>::iterator it;
+        };
+
+        // front is most recent, moving between lists splices so iterators stay valid
+        std::list<K> _lists[4];
+        std::unordered_map<K, Location> _locations;
+        uint64_t _p; // target size of T1
+
+        void evict() override;
+
+        void replace(bool in_b2);
+
+        void adapt(const K &key);
+
+        void place(const K &key, List list);
+
+        void forget(List list);
+
+        void trim_ghosts();
+
+        void touch(const K &key);
+
+    public:
+        ARCCache() : ARCCache(1048576 * 4) {};
+
+        explicit ARCCache(uint64_t max_size) : BasicEvictionCache<K, V>(max_size), _p{0} {
+            // index, list and location map each hold the key
+            this->_key_copies = 3;
+        };
+
+        uint64_t target() {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            return _p;
+        }
+
+        uint64_t recent_size() {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            return _lists[T1].size();
+        }
+
+        uint64_t frequent_size() {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            return _lists[T2].size();
+        }
+
+        bool in_ghost(const K &key) {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            auto loc = _locations.find(key);
+            return loc != _locations.end() && (loc->second.list == B1 || loc->second.list == B2);
+        }
+
+        void insert(const K &key, const V &value) override;
+
+        void insert_no_evict(const K &key, const V &value) override;
+
+        void trim() override;
+
+        CacheHandle<V> find(const K &key) override;
+
+        V &at(const K &key) override;
+
+        std::shared_ptr<V> probe(const K &key) override;
+
+        V &operator[](K &key) override;
+
+        void clear() override;
+
+        void fetch_into(const K &key, V *buff) override;
+
+        bool peek_victim(const K &candidate, K &victim) override;
+    };
+
+    template<typename K, typename V>
+    void ARCCache<K, V>::place(const K &key, List list) {
+        auto loc = _locations.find(key);
+        if (loc == _locations.end()) {
+            _lists[list].push_front(key);
+            _locations.emplace(key, Location{list, _lists[list].begin()});
+        } else {
+            _lists[list].splice(_lists[list].begin(), _lists[loc->second.list], loc->second.it);
+            loc->second.list = list;
+        }
+    }
+
+    template<typename K, typename V>
+    void ARCCache<K, V>::forget(List list) {
+        // drop the least recent ghost
+        _locations.erase(_lists[list].back());
+        _lists[list].pop_back();
+    }
+
+    template<typename K, typename V>
+    void ARCCache<K, V>::replace(bool in_b2) {
+        // caller holds lock, moves one resident key into its ghost list
+        uint64_t t1 = _lists[T1].size();
+        List from = (t1 > 0 && ((in_b2 && t1 == _p) || t1 > _p)) || _lists[T2].empty() ? T1 : T2;
+        if (_lists[from].empty())
+            return;
+        K key = _lists[from].back();
+        auto find_ptr = this->_cache_index.find(key);
+        this->on_evict(key, *find_ptr->second);
+        this->_cache_index.erase(find_ptr);
+        this->_keys--;
+        place(key, from == T1 ? B1 : B2);
+    }
+
+    template<typename K, typename V>
+    void ARCCache<K, V>::evict() {
+        replace(false);
+    }
+
+    template<typename K, typename V>
+    void ARCCache<K, V>::adapt(const K &key) {
+        // a ghost hit means the list that evicted it was too small
+        auto loc = _locations.find(key);
+        if (loc == _locations.end())
+            return;
+        uint64_t b1 = _lists[B1].size(), b2 = _lists[B2].size();
+        if (loc->second.list == B1) {
+            _p = std::min<uint64_t>(this->_max_cache_size, _p + std::max<uint64_t>(b2 / b1, 1));
+        } else if (loc->second.list == B2) {
+            uint64_t delta = std::max<uint64_t>(b1 / b2, 1);
+            _p = _p > delta ? _p - delta : 0;
+        }
+    }
+
+    template<typename K, typename V>
+    void ARCCache<K, V>::trim_ghosts() {
+        uint64_t c = this->_max_cache_size;
+        while (!_lists[B1].empty() && _lists[T1].size() + _lists[B1].size() > c)
+            forget(B1);
+        while (!_lists[B2].empty() && _locations.size() > 2 * c)
+            forget(B2);
+    }
+
+    template<typename K, typename V>
+    void ARCCache<K, V>::touch(const K &key) {
+        // caller holds lock, any resident hit is frequency evidence
+        place(key, T2);
+    }
+
+    template<typename K, typename V>
+    void ARCCache<K, V>::insert(const K &key, const V &value) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (this->_cache_index.find(key) != this->_cache_index.end())
+            return;
+
+        auto loc = _locations.find(key);
+        bool ghost = loc != _locations.end();
+        bool in_b2 = ghost && loc->second.list == B2;
+        adapt(key);
+        if (this->_cache_index.size() >= this->_max_cache_size) {
+            // make room before the ghost lists are resized around the new key
+            if (!ghost && _lists[T1].size() + _lists[B1].size() >= this->_max_cache_size && _lists[B1].empty()) {
+                // T1 alone fills the cache, drop its oldest entry without remembering it
+                K old = _lists[T1].back();
+                auto find_ptr = this->_cache_index.find(old);
+                this->on_evict(old, *find_ptr->second);
+                this->_cache_index.erase(find_ptr);
+                this->_keys--;
+                _locations.erase(old);
+                _lists[T1].pop_back();
+            } else {
+                replace(in_b2);
+            }
+        }
+
+        while (!this->_cache_index.empty() && this->over_budget(this->entry_bytes(key, value)))
+            replace(in_b2);
+
+        this->_cache_index.emplace(key, std::make_shared<V>(value));
+        place(key, ghost ? T2 : T1);
+        this->_keys++;
+        this->on_insert(key, value);
+        trim_ghosts();
+    }
+
+    template<typename K, typename V>
+    void ARCCache<K, V>::insert_no_evict(const K &key, const V &value) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (this->_cache_index.try_emplace(key, std::make_shared<V>(value)).second) {
+            // ghost hits still adapt p, eviction is deferred to trim()
+            auto loc = _locations.find(key);
+            bool ghost = loc != _locations.end();
+            adapt(key);
+            place(key, ghost ? T2 : T1);
+            this->_keys++;
+            this->on_insert(key, value);
+        }
+    }
+
+    template<typename K, typename V>
+    void ARCCache<K, V>::trim() {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        while (this->_cache_index.size() > this->_max_cache_size ||
+               (!this->_cache_index.empty() && this->over_budget()))
+            replace(false);
+        trim_ghosts();
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> ARCCache<K, V>::find(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto find_ptr = this->_cache_index.find(key);
+        find_ptr != this->_cache_index.end() ? this->_hits++ : this->_misses++;
+        return CacheHandle<V>(find_ptr != this->_cache_index.end() ? find_ptr->second : nullptr);
+    }
+
+    template<typename K, typename V>
+    V &ARCCache<K, V>::at(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        V &value = *this->_cache_index.at(key);
+        touch(key);
+        return value;
+    }
+
+    template<typename K, typename V>
+    std::shared_ptr<V> ARCCache<K, V>::probe(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto find_ptr = this->_cache_index.find(key);
+        if (find_ptr == this->_cache_index.end()) {
+            this->_misses++;
+            return nullptr;
+        }
+        this->_hits++;
+        touch(key);
+        return find_ptr->second;
+    }
+
+    template<typename K, typename V>
+    V &ARCCache<K, V>::operator[](K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto inserted = this->_cache_index.try_emplace(key, nullptr);
+        if (inserted.second) {
+            // a missing key gets a default value in T1, eviction is deferred to trim()
+            inserted.first->second = std::make_shared<V>();
+            place(key, T1);
+            this->_keys++;
+            this->on_insert(key, *inserted.first->second);
+        }
+        return *inserted.first->second;
+    }
+
+    template<typename K, typename V>
+    bool ARCCache<K, V>::peek_victim(const K &candidate, K &victim) {
+        // mirrors replace() for the candidate without moving anything
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto loc = _locations.find(candidate);
+        bool in_b2 = loc != _locations.end() && loc->second.list == B2;
+        uint64_t t1 = _lists[T1].size();
+        List from = (t1 > 0 && ((in_b2 && t1 == _p) || t1 > _p)) || _lists[T2].empty() ? T1 : T2;
+        if (_lists[from].empty())
+            return false;
+        victim = _lists[from].back();
+        return true;
+    }
+
+    template<typename K, typename V>
+    void ARCCache<K, V>::clear() {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        for (auto &l : _lists)
+            l.clear();
+        _locations.clear();
+        _p = 0;
+        this->_cache_index.clear();
+        this->_keys = 0;
+        this->_bytes = 0;
+    }
+
+    template<typename K, typename V>
+    void ARCCache<K, V>::fetch_into(const K &key, V *buff) {
+        auto cached = this->probe(key);
+        if (cached && buff != nullptr)
+            *buff = *cached;
+    }
+
+
+/*
+ * GDSF CACHE
+ *
+ * GreedyDual-Size-Frequency. Each entry is ranked by L + frequency * cost / bytes, where
+ * cost is what recomputing the value would take (aligner seconds) and L is the rank of
+ * the last evicted entry. The lowest rank is evicted first, so cheap, large, rarely hit
+ * alignments go before expensive multi-mapping ones, and the rising L ages out entries
+ * that are no longer hit.
+ */
+
+
+    template<typename K, typename V>
+    class GDSFCache : public BasicEvictionCache<K, V> {
+    protected:
+        struct Meta {
+            double cost;
+            uint64_t bytes;
+            uint32_t freq;
+            typename std::multimap<double, K>::iterator rank;
+        };
+
+        std::multimap<double, K> _ranking; // lowest priority first
+        std::unordered_map<K, Meta> _meta;
+        double _inflation; // L, priority of the last evicted entry
+        double _default_cost; // cost assumed by inserts that do not give one
+
+        double priority(const Meta &m) const {
+            return _inflation + m.freq * m.cost / std::max<uint64_t>(1, m.bytes);
+        }
+
+        void rank(const K &key, Meta &m);
+
+        void add(const K &key, const V &value, double cost);
+
+        void evict() override;
+
+        void touch(const K &key);
+
+    public:
+        GDSFCache() : GDSFCache(1048576 * 4) {};
+
+        explicit GDSFCache(uint64_t max_size) : BasicEvictionCache<K, V>(max_size), _inflation{0},
+                                                _default_cost{1} {
+            // index, ranking and metadata each hold the key
+            this->_key_copies = 3;
+        };
+
+        double inflation() { return _inflation; }
+
+        void set_default_cost(double cost) { _default_cost = cost; }
+
+        void insert(const K &key, const V &value) override { insert(key, value, _default_cost); }
+
+        void insert(const K &key, const V &value, double cost);
+
+        void insert_no_evict(const K &key, const V &value) override { insert_no_evict(key, value, _default_cost); }
+
+        void insert_no_evict(const K &key, const V &value, double cost) override;
+
+        void trim() override;
+
+        CacheHandle<V> find(const K &key) override;
+
+        V &at(const K &key) override;
+
+        std::shared_ptr<V> probe(const K &key) override;
+
+        V &operator[](K &key) override;
+
+        void clear() override;
+
+        void fetch_into(const K &key, V *buff) override;
+
+        bool peek_victim(const K &candidate, K &victim) override;
+    };
+
+    template<typename K, typename V>
+    void GDSFCache<K, V>::rank(const K &key, Meta &m) {
+        if (m.rank != _ranking.end())
+            _ranking.erase(m.rank);
+        m.rank = _ranking.emplace(priority(m), key);
+    }
+
+    template<typename K, typename V>
+    void GDSFCache<K, V>::add(const K &key, const V &value, double cost) {
+        // caller holds lock and has checked the key is not cached
+        auto meta_ptr = _meta.emplace(key, Meta{cost, byte_size(value), 1, _ranking.end()}).first;
+        rank(key, meta_ptr->second);
+        this->_cache_index.emplace(key, std::make_shared<V>(value));
+        this->_keys++;
+        this->on_insert(key, value);
+    }
+
+    template<typename K, typename V>
+    void GDSFCache<K, V>::evict() {
+        // not publically facing, caller holds lock
+        auto lowest = _ranking.begin();
+        _inflation = lowest->first;
+        K key = lowest->second;
+        _ranking.erase(lowest);
+        _meta.erase(key);
+        auto find_ptr = this->_cache_index.find(key);
+        this->on_evict(key, *find_ptr->second);
+        this->_cache_index.erase(find_ptr);
+        this->_keys--;
+    }
+
+    template<typename K, typename V>
+    void GDSFCache<K, V>::touch(const K &key) {
+        // caller holds lock, a hit raises frequency and re-ranks against the current L
+        auto meta_ptr = _meta.find(key);
+        if (meta_ptr != _meta.end()) {
+            meta_ptr->second.freq++;
+            rank(key, meta_ptr->second);
+        }
+    }
+
+    template<typename K, typename V>
+    void GDSFCache<K, V>::insert(const K &key, const V &value, double cost) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (this->_cache_index.find(key) == this->_cache_index.end()) {
+            if (this->_cache_index.size() >= this->_max_cache_size && !_ranking.empty())
+                evict();
+            while (!_ranking.empty() && this->over_budget(this->entry_bytes(key, value)))
+                evict();
+            add(key, value, cost);
+        }
+    }
+
+    template<typename K, typename V>
+    void GDSFCache<K, V>::insert_no_evict(const K &key, const V &value, double cost) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (this->_cache_index.find(key) == this->_cache_index.end())
+            add(key, value, cost);
+    }
+
+    template<typename K, typename V>
+    void GDSFCache<K, V>::trim() {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        while ((this->_cache_index.size() > this->_max_cache_size || this->over_budget()) && !_ranking.empty())
+            evict();
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> GDSFCache<K, V>::find(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto find_ptr = this->_cache_index.find(key);
+        find_ptr != this->_cache_index.end() ? this->_hits++ : this->_misses++;
+        return CacheHandle<V>(find_ptr != this->_cache_index.end() ? find_ptr->second : nullptr);
+    }
+
+    template<typename K, typename V>
+    V &GDSFCache<K, V>::at(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        V &value = *this->_cache_index.at(key);
+        touch(key);
+        return value;
+    }
+
+    template<typename K, typename V>
+    std::shared_ptr<V> GDSFCache<K, V>::probe(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto find_ptr = this->_cache_index.find(key);
+        if (find_ptr == this->_cache_index.end()) {
+            this->_misses++;
+            return nullptr;
+        }
+        this->_hits++;
+        touch(key);
+        return find_ptr->second;
+    }
+
+    template<typename K, typename V>
+    V &GDSFCache<K, V>::operator[](K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto find_ptr = this->_cache_index.find(key);
+        if (find_ptr == this->_cache_index.end()) {
+            // a missing key gets a ranked default value at the default cost, eviction is deferred to trim()
+            add(key, V(), _default_cost);
+            find_ptr = this->_cache_index.find(key);
+        }
+        return *find_ptr->second;
+    }
+
+    template<typename K, typename V>
+    bool GDSFCache<K, V>::peek_victim(const K &, K &victim) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (_ranking.empty())
+            return false;
+        victim = _ranking.begin()->second;
+        return true;
+    }
+
+    template<typename K, typename V>
+    void GDSFCache<K, V>::clear() {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        _ranking.clear();
+        _meta.clear();
+        _inflation = 0;
+        this->_cache_index.clear();
+        this->_keys = 0;
+        this->_bytes = 0;
+    }
+
+    template<typename K, typename V>
+    void GDSFCache<K, V>::fetch_into(const K &key, V *buff) {
+        auto cached = this->probe(key);
+        if (cached && buff != nullptr)
+            *buff = *cached;
+    }
+
+
+/*
+ * LFU CACHE
+ *
+ * Least frequently used eviction over a list of frequency buckets (Shah, Mitra & Matani,
+ * 2010). Each bucket holds the keys sharing one access count in insertion order, so a hit
+ * moves a key to the neighbouring bucket and eviction takes the oldest key of the first
+ * bucket, both in O(1). With aging enabled (LFU-DA) new keys start one above the count of
+ * the last evicted key, so reads that were hot early in a run cannot hold their place forever.
+ */
+
+
+    template<typename K, typename V>
+    class LFUCache : public BasicEvictionCache<K, V> {
+    protected:
+        struct Bucket {
+            uint64_t freq;
+            std::list<K> keys; // front is most recent
+        };
+
+        struct Node {
+            typename std::list<Bucket>::iterator bucket;
+            typename std::list<K>::iterator pos;
+        };
+
+        std::list<Bucket> _buckets; // ascending frequency
+        std::unordered_map<K, Node> _nodes;
+        bool _aging;
+        uint64_t _age; // frequency of the last evicted key when aging
+
+        void evict() override;
+
+        void touch(const K &key);
+
+        void add(const K &key, const V &value);
+
+    public:
+        LFUCache() : LFUCache(1048576 * 4) {};
+
+        explicit LFUCache(uint64_t max_size, bool aging = false) : BasicEvictionCache<K, V>(max_size),
+                                                                   _aging{aging}, _age{0} {
+            // index, bucket list and node map each hold the key
+            this->_key_copies = 3;
+        };
+
+        void set_aging(bool aging) { _aging = aging; }
+
+        uint64_t frequency(const K &key) {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            auto node_ptr = _nodes.find(key);
+            return node_ptr != _nodes.end() ? node_ptr->second.bucket->freq : 0;
+        }
+
+        void insert(const K &key, const V &value) override;
+
+        void insert_no_evict(const K &key, const V &value) override;
+
+        void trim() override;
+
+        CacheHandle<V> find(const K &key) override;
+
+        V &at(const K &key) override;
+
+        std::shared_ptr<V> probe(const K &key) override;
+
+        V &operator[](K &key) override;
+
+        void clear() override;
+
+        void fetch_into(const K &key, V *buff) override;
+
+        bool peek_victim(const K &candidate, K &victim) override;
+    };
+
+    template<typename K, typename V>
+    void LFUCache<K, V>::add(const K &key, const V &value) {
+        // caller holds lock and has checked the key is not cached
+        uint64_t freq = _aging ? _age + 1 : 1;
+        // every cached key has at least _age accesses, so this walks at most two buckets
+        auto bucket = _buckets.begin();
+        while (bucket != _buckets.end() && bucket->freq < freq)
+            bucket++;
+        if (bucket == _buckets.end() || bucket->freq != freq)
+            bucket = _buckets.insert(bucket, Bucket{freq, {}});
+        bucket->keys.push_front(key);
+        _nodes.emplace(key, Node{bucket, bucket->keys.begin()});
+        this->_cache_index.emplace(key, std::make_shared<V>(value));
+        this->_keys++;
+        this->on_insert(key, value);
+    }
+
+    template<typename K, typename V>
+    void LFUCache<K, V>::evict() {
+        // not publically facing, caller holds lock
+        auto bucket = _buckets.begin();
+        K key = bucket->keys.back();
+        if (_aging)
+            _age = bucket->freq;
+        bucket->keys.pop_back();
+        if (bucket->keys.empty())
+            _buckets.erase(bucket);
+        _nodes.erase(key);
+        auto find_ptr = this->_cache_index.find(key);
+        this->on_evict(key, *find_ptr->second);
+        this->_cache_index.erase(find_ptr);
+        this->_keys--;
+    }
+
+    template<typename K, typename V>
+    void LFUCache<K, V>::touch(const K &key) {
+        // caller holds lock, splicing keeps the key's list iterator valid
+        auto node_ptr = _nodes.find(key);
+        if (node_ptr == _nodes.end())
+            return;
+        auto current = node_ptr->second.bucket;
+        auto next = std::next(current);
+        if (next == _buckets.end() || next->freq != current->freq + 1)
+            next = _buckets.insert(next, Bucket{current->freq + 1, {}});
+        next->keys.splice(next->keys.begin(), current->keys, node_ptr->second.pos);
+        node_ptr->second.bucket = next;
+        if (current->keys.empty())
+            _buckets.erase(current);
+    }
+
+    template<typename K, typename V>
+    void LFUCache<K, V>::insert(const K &key, const V &value) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (this->_cache_index.find(key) == this->_cache_index.end()) {
+            if (this->_cache_index.size() >= this->_max_cache_size && !_buckets.empty())
+                evict();
+            while (!_buckets.empty() && this->over_budget(this->entry_bytes(key, value)))
+                evict();
+            add(key, value);
+        }
+    }
+
+    template<typename K, typename V>
+    void LFUCache<K, V>::insert_no_evict(const K &key, const V &value) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (this->_cache_index.find(key) == this->_cache_index.end())
+            add(key, value);
+    }
+
+    template<typename K, typename V>
+    void LFUCache<K, V>::trim() {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        while ((this->_cache_index.size() > this->_max_cache_size || this->over_budget()) && !_buckets.empty())
+            evict();
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> LFUCache<K, V>::find(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto find_ptr = this->_cache_index.find(key);
+        find_ptr != this->_cache_index.end() ? this->_hits++ : this->_misses++;
+        return CacheHandle<V>(find_ptr != this->_cache_index.end() ? find_ptr->second : nullptr);
+    }
+
+    template<typename K, typename V>
+    V &LFUCache<K, V>::at(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        V &value = *this->_cache_index.at(key);
+        touch(key);
+        return value;
+    }
+
+    template<typename K, typename V>
+    std::shared_ptr<V> LFUCache<K, V>::probe(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto find_ptr = this->_cache_index.find(key);
+        if (find_ptr == this->_cache_index.end()) {
+            this->_misses++;
+            return nullptr;
+        }
+        this->_hits++;
+        touch(key);
+        return find_ptr->second;
+    }
+
+    template<typename K, typename V>
+    V &LFUCache<K, V>::operator[](K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto find_ptr = this->_cache_index.find(key);
+        if (find_ptr == this->_cache_index.end()) {
+            // a missing key enters the first bucket with a default value, eviction is deferred to trim()
+            add(key, V());
+            find_ptr = this->_cache_index.find(key);
+        }
+        return *find_ptr->second;
+    }
+
+    template<typename K, typename V>
+    bool LFUCache<K, V>::peek_victim(const K &, K &victim) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (_buckets.empty())
+            return false;
+        victim = _buckets.front().keys.back();
+        return true;
+    }
+
+    template<typename K, typename V>
+    void LFUCache<K, V>::clear() {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        _buckets.clear();
+        _nodes.clear();
+        _age = 0;
+        this->_cache_index.clear();
+        this->_keys = 0;
+        this->_bytes = 0;
+    }
+
+    template<typename K, typename V>
+    void LFUCache<K, V>::fetch_into(const K &key, V *buff) {
+        auto cached = this->probe(key);
+        if (cached && buff != nullptr)
+            *buff = *cached;
+    }
+
+
+/*
+ *
+ *
+ * SHARDED CACHES
+ *
+ *
+ */
+
+
+/*
+ * SHARDED CACHE
+ *
+ * Partitions the key space over N independent caches of type C (e.g. LRU or MRU).
+ * Each shard keeps its own index, recency list and lock, so probes and inserts
+ * from concurrent pipeline stages only contend when they land on the same shard.
+ */
+
+    template<typename K, typename V, typename C = LRUCache<K, V> >
+    class ShardedCache : public CacheIndex<K, V> {
+    protected:
+        std::vector<std::unique_ptr<C> > _shards;
+        uint32_t _num_shards;
+
+        uint32_t shard_of(const K &key) {
+            // keys arrive pre-hashed (e.g. PreHashedString), mix the hash so shard choice
+            // is independent of the bucket choice made by each shard's own index
+            uint64_t h = std::hash<K>{}(key) * 0x9E3779B97F4A7C15ULL;
+            return (h >> 32) % _num_shards;
+        }
+
+        C &shard(const K &key) { return *_shards[shard_of(key)]; }
+
+    public:
+
+        ShardedCache() : ShardedCache(16) {};
+
+        explicit ShardedCache(uint32_t num_shards) : ShardedCache(num_shards, 1048576 * 4) {};
+
+        ShardedCache(uint32_t num_shards, uint64_t max_size);
+
+        /*
+         * State Descriptors
+         */
+
+        void set_max_size(uint64_t max_size) override;
+
+        void set_max_bytes(uint64_t max_bytes) override;
+
+        double hit_rate() override {
+            uint64_t h = hits();
+            uint64_t m = misses();
+            return m > 0 ? static_cast<double>(h) / (h + m) : 0;
+        }
+
+        uint64_t hits() override;
+
+        uint64_t misses() override;
+
+        uint32_t capacity() override;
+
+        uint32_t size() override;
+
+        uint64_t bytes() override;
+
+        uint64_t lock_wait_ns() override;
+
+        uint32_t num_shards() { return _num_shards; }
+
+        void update(int event) override;
+
+        /*
+         * Cache Operations
+         */
+
+        void insert(const K &key, const V &value) override { shard(key).insert(key, value); }
+
+        void insert_no_evict(const K &key, const V &value) override { shard(key).insert_no_evict(key, value); }
+
+        void insert_no_evict(const K &key, const V &value, double cost) override {
+            // through the interface so shard types that only override the cost-blind insert still compile
+            static_cast<CacheIndex<K, V> &>(shard(key)).insert_no_evict(key, value, cost);
+        }
+
+        void trim() override;
+
+        CacheHandle<V> find(const K &key) override;
+
+        V &at(const K &key) override { return shard(key).at(key); }
+
+        CacheHandle<V> lookup(const K &key) override { return shard(key).lookup(key); }
+
+        std::shared_ptr<const V> acquire(const K &key) override { return shard(key).acquire(key); }
+
+        bool contains(const K &key) override { return shard(key).contains(key); }
+
+        // each shard evicts down to its share of size
+        uint64_t trim_to(uint64_t size, uint64_t max_entries) override;
+
+        // split by shard, each shard resolves its part of the batch under its own lock
+        void find_many(const std::vector<K> &keys, std::vector<std::shared_ptr<const V> > &handles) override;
+
+        void insert_many(const std::vector<K> &keys, std::vector<V> &values, const std::vector<double> &costs) override;
+
+        V &operator[](K &key) override { return shard(key)[key]; }
+
+        void clear() override;
+
+        void fetch_into(const K &key, V *buff) override { shard(key).fetch_into(key, buff); }
+
+        void set_eviction_callback(std::function<void(const K &, const V &)> callback) override {
+            for (auto &s : _shards) {
+                s->set_eviction_callback(callback);
+            }
+        }
+
+        bool peek_victim(const K &candidate, K &victim) override {
+            // the candidate can only displace an entry of its own shard
+            return shard(candidate).peek_victim(candidate, victim);
+        }
+
+        bool save_snapshot(const std::string &path, uint64_t fingerprint) override;
+
+        uint64_t load_snapshot(const std::string &path, uint64_t fingerprint) override;
+
+        void serialize(std::ostream &output) const override;
+    };
+
+    template<typename K, typename V, typename C>
+    ShardedCache<K, V, C>::ShardedCache(uint32_t num_shards, uint64_t max_size) {
+        _num_shards = num_shards > 0 ? num_shards : 1;
+        // round up so the shards together hold at least max_size elements
+        uint64_t shard_size = (max_size + _num_shards - 1) / _num_shards;
+        for (uint32_t i = 0; i < _num_shards; i++) {
+            _shards.emplace_back(std::make_unique<C>(shard_size));
+        }
+    }
+
+    template<typename K, typename V, typename C>
+    bool ShardedCache<K, V, C>::save_snapshot(const std::string &path, uint64_t fingerprint) {
+        // one file per shard, each written under its own shard's lock
+        bool saved = true;
+        for (uint32_t i = 0; i < _num_shards; i++) {
+            saved &= static_cast<CacheIndex<K, V> &>(*_shards[i]).save_snapshot(path + "." + std::to_string(i),
+                                                                                fingerprint);
+        }
+        // drop files left by an earlier run with more shards
+        for (uint32_t i = _num_shards; std::remove((path + "." + std::to_string(i)).c_str()) == 0; i++);
+        return saved;
+    }
+
+    template<typename K, typename V, typename C>
+    uint64_t ShardedCache<K, V, C>::load_snapshot(const std::string &path, uint64_t fingerprint) {
+        // entries are routed by key, so snapshots saved with any shard count can be loaded
+        uint64_t loaded = 0;
+        for (uint32_t i = 0; access((path + "." + std::to_string(i)).c_str(), R_OK) == 0; i++) {
+            loaded += CacheIndex<K, V>::load_snapshot(path + "." + std::to_string(i), fingerprint);
+        }
+        return loaded;
+    }
+
+    template<typename K, typename V, typename C>
+    void ShardedCache<K, V, C>::set_max_bytes(uint64_t max_bytes) {
+        // shards are balanced by key, so each gets an equal share of the budget
+        for (auto &s : _shards) {
+            s->set_max_bytes(max_bytes / _num_shards);
+        }
+    }
+
+    template<typename K, typename V, typename C>
+    void ShardedCache<K, V, C>::set_max_size(uint64_t max_size) {
+        uint64_t shard_size = (max_size + _num_shards - 1) / _num_shards;
+        for (auto &s : _shards) {
+            s->set_max_size(shard_size);
+        }
+    }
+
+    template<typename K, typename V, typename C>
+    uint64_t ShardedCache<K, V, C>::hits() {
+        uint64_t total = 0;
+        for (auto &s : _shards) {
+            total += s->hits();
+        }
+        return total;
+    }
+
+    template<typename K, typename V, typename C>
+    uint64_t ShardedCache<K, V, C>::misses() {
+        uint64_t total = 0;
+        for (auto &s : _shards) {
+            total += s->misses();
+        }
+        return total;
+    }
+
+    template<typename K, typename V, typename C>
+    uint32_t ShardedCache<K, V, C>::capacity() {
+        uint32_t total = 0;
+        for (auto &s : _shards) {
+            total += s->capacity();
+        }
+        return total;
+    }
+
+    template<typename K, typename V, typename C>
+    uint32_t ShardedCache<K, V, C>::size() {
+        uint32_t total = 0;
+        for (auto &s : _shards) {
+            total += s->size();
+        }
+        return total;
+    }
+
+    template<typename K, typename V, typename C>
+    uint64_t ShardedCache<K, V, C>::bytes() {
+        uint64_t total = 0;
+        for (auto &s : _shards) {
+            total += s->bytes();
+        }
+        return total;
+    }
+
+    template<typename K, typename V, typename C>
+    uint64_t ShardedCache<K, V, C>::lock_wait_ns() {
+        uint64_t total = 0;
+        for (auto &s : _shards) {
+            total += s->lock_wait_ns();
+        }
+        return total;
+    }
+
+    template<typename K, typename V, typename C>
+    void ShardedCache<K, V, C>::update(int event) {
+        for (auto &s : _shards) {
+            s->update(event);
+        }
+    }
+
+    template<typename K, typename V, typename C>
+    void ShardedCache<K, V, C>::trim() {
+        // each shard only evicts down to its share of the capacity, under its own lock
+        for (auto &s : _shards) {
+            s->trim();
+        }
+    }
+
+    template<typename K, typename V, typename C>
+    CacheHandle<V> ShardedCache<K, V, C>::find(const K &key) {
+        return shard(key).find(key);
+    }
+
+    template<typename K, typename V, typename C>
+    uint64_t ShardedCache<K, V, C>::trim_to(uint64_t size, uint64_t max_entries) {
+        uint64_t share = (size + _num_shards - 1) / _num_shards;
+        uint64_t evicted = 0;
+        for (auto &s : _shards) {
+            if (evicted >= max_entries)
+                break;
+            evicted += s->trim_to(share, max_entries - evicted);
+        }
+        return evicted;
+    }
+
+    template<typename K, typename V, typename C>
+    void ShardedCache<K, V, C>::find_many(const std::vector<K> &keys,
+                                          std::vector<std::shared_ptr<const V> > &handles) {
+        std::vector<std::vector<size_t> > positions(_num_shards);
+        for (size_t i = 0; i < keys.size(); i++)
+            positions[shard_of(keys[i])].push_back(i);
+        handles.resize(keys.size());
+        std::vector<K> shard_keys;
+        std::vector<std::shared_ptr<const V> > shard_handles;
+        for (uint32_t s = 0; s < _num_shards; s++) {
+            if (positions[s].empty())
+                continue;
+            shard_keys.clear();
+            for (size_t i : positions[s])
+                shard_keys.push_back(keys[i]);
+            _shards[s]->find_many(shard_keys, shard_handles);
+            for (size_t j = 0; j < positions[s].size(); j++)
+                handles[positions[s][j]] = std::move(shard_handles[j]);
+        }
+    }
+
+    template<typename K, typename V, typename C>
+    void ShardedCache<K, V, C>::insert_many(const std::vector<K> &keys, std::vector<V> &values,
+                                            const std::vector<double> &costs) {
+        std::vector<std::vector<size_t> > positions(_num_shards);
+        for (size_t i = 0; i < keys.size(); i++)
+            positions[shard_of(keys[i])].push_back(i);
+        std::vector<K> shard_keys;
+        std::vector<V> shard_values;
+        std::vector<double> shard_costs;
+        for (uint32_t s = 0; s < _num_shards; s++) {
+            if (positions[s].empty())
+                continue;
+            shard_keys.clear();
+            shard_values.clear();
+            shard_costs.clear();
+            for (size_t i : positions[s]) {
+                shard_keys.push_back(keys[i]);
+                shard_values.push_back(std::move(values[i]));
+                shard_costs.push_back(costs[i]);
+            }
+            _shards[s]->insert_many(shard_keys, shard_values, shard_costs);
+        }
+    }
+
+    template<typename K, typename V, typename C>
+    void ShardedCache<K, V, C>::clear() {
+        for (auto &s : _shards) {
+            s->clear();
+        }
+    }
+
+    template<typename K, typename V, typename C>
+    void ShardedCache<K, V, C>::serialize(std::ostream &output) const {
+        uint64_t hits = 0, misses = 0, size = 0;
+        for (auto &s : _shards) {
+            hits += s->hits();
+            misses += s->misses();
+            size += s->size();
+        }
+        output << "Hits: " << hits << " Misses: " << misses << " Size: " << size << " Shards: " << _num_shards
+               << std::endl;
+    }
+
+
+/*
+ *
+ *
+ * CACHE DECORATORS
+ *
+ *
+ */
+
+
+/*
+ * BASE CACHE DECORATOR
+ */
+
+    template<typename K, typename V>
+    class CacheDecorator : public CacheIndex<K, V> {
+    protected:
+        std::shared_ptr<CacheIndex<K, V> > _decorated_cache;
+        // Locks for thread safety
+        CacheMutex _cache_mutex;
+
+    public:
+        CacheDecorator() = default;
+
+        virtual void set_cache(std::shared_ptr<CacheIndex<K, V> > &cache) { _decorated_cache = cache; }
+
+        /*
+         * Overwrite State Descriptors
+         */
+        void set_max_size(uint64_t max_size) { this->_decorated_cache->set_max_size(max_size); }
+
+        void set_max_bytes(uint64_t max_bytes) { this->_decorated_cache->set_max_bytes(max_bytes); }
+
+        double hit_rate() {
+            return this->_decorated_cache->hit_rate();
+        }
+
+        uint64_t hits() { return this->_decorated_cache->hits(); }
+
+        uint64_t misses() { return this->_decorated_cache->misses(); }
+
+        uint32_t capacity() { return this->_decorated_cache->capacity(); }
+
+        uint32_t size() { return this->_decorated_cache->size(); }
+
+        uint64_t bytes() { return this->_decorated_cache->bytes(); }
+
+        uint64_t lock_wait_ns() { return _cache_mutex.wait_ns() + this->_decorated_cache->lock_wait_ns(); }
+
+        void set_eviction_callback(std::function<void(const K &, const V &)> callback) {
+            this->_decorated_cache->set_eviction_callback(std::move(callback));
+        }
+
+        bool peek_victim(const K &candidate, K &victim) {
+            return this->_decorated_cache->peek_victim(candidate, victim);
+        }
+
+        CacheHandle<V> lookup_near(const K &key, K &match) {
+            return this->_decorated_cache->lookup_near(key, match);
+        }
+
+        bool contains(const K &key) { return this->_decorated_cache->contains(key); }
+
+        // decorators that do not act on cost hand it down
+        void insert_no_evict(const K &key, const V &value, double cost) {
+            this->_decorated_cache->insert_no_evict(key, value, cost);
+        }
+
+        bool save_snapshot(const std::string &path, uint64_t fingerprint) {
+            return this->_decorated_cache->save_snapshot(path, fingerprint);
+        }
+
+        // straight into the decorated cache, entries already passed admission when they were cached
+        uint64_t load_snapshot(const std::string &path, uint64_t fingerprint) {
+            return this->_decorated_cache->load_snapshot(path, fingerprint);
+        }
+
+        void serialize(std::ostream &output) const {
+            _decorated_cache->serialize(output);
+        }
+
+    };
+
+/*
+ * BLOCKED BLOOM FILTER
+ *
+ * Bloom filter of 64-byte blocks, one cache line each. A key maps to one block and sets one
+ * bit in each of its eight words, so a probe touches a single line. Bits are set with an
+ * atomic or and read without a lock. Keys are given by a well mixed 64-bit hash.
+ */
+
+    class BlockedBloomFilter {
+    private:
+        static constexpr uint8_t WORDS_PER_BLOCK = 8; // one bit per word and key
+
+        struct alignas(64) Block {
+            std::atomic<uint64_t> words[WORDS_PER_BLOCK];
+        };
+
+        std::unique_ptr<Block[]> _blocks;
+        uint64_t _num_blocks;
+        std::atomic<uint64_t> _keys; // additions that set at least one bit
+
+        const Block &block(uint64_t hash) const { return _blocks[hash % _num_blocks]; }
+
+        Block &block(uint64_t hash) { return _blocks[hash % _num_blocks]; }
+
+        // bit of word w set for hash, 6 bits of the remixed hash per word
+        static uint64_t word_mask(uint64_t hash, uint8_t w) {
+            uint64_t h = (hash ^ (hash >> 31)) * 0x9E3779B97F4A7C15ULL;
+            return 1ULL << ((h >> (w * 6 + 16)) & 63);
+        }
+
+    public:
+        BlockedBloomFilter() : _num_blocks{0}, _keys{0} {}
+
+        // reallocates and clears the filter, not safe against concurrent probes
+        void resize(uint64_t expected_keys, double false_positive_rate);
+
+        // false if every bit was already set, the key (or a colliding one) was in the filter
+        bool add(uint64_t hash) {
+            Block &b = block(hash);
+            bool added = false;
+            for (uint8_t w = 0; w < WORDS_PER_BLOCK; w++) {
+                uint64_t mask = word_mask(hash, w);
+                added |= (b.words[w].fetch_or(mask, std::memory_order_relaxed) & mask) == 0;
+            }
+            if (added)
+                _keys.fetch_add(1, std::memory_order_relaxed);
+            return added;
+        }
+
+        bool contains(uint64_t hash) const {
+            const Block &b = block(hash);
+            for (uint8_t w = 0; w < WORDS_PER_BLOCK; w++) {
+                uint64_t mask = word_mask(hash, w);
+                if ((b.words[w].load(std::memory_order_relaxed) & mask) != mask)
+                    return false;
+            }
+            return true;
+        }
+
+        void clear() {
+            for (uint64_t b = 0; b < _num_blocks; b++) {
+                for (auto &word : _blocks[b].words)
+                    word.store(0, std::memory_order_relaxed);
+            }
+            _keys.store(0, std::memory_order_relaxed);
+        }
+
+        uint64_t keys() const { return _keys.load(std::memory_order_relaxed); }
+
+        uint64_t bytes() const { return _num_blocks * sizeof(Block); }
+    };
+
+    inline void BlockedBloomFilter::resize(uint64_t expected_keys, double false_positive_rate) {
+        // bits of a standard filter for the rate, plus a quarter for keys crowding into blocks
+        double rate = std::min(std::max(false_positive_rate, 1e-6), 0.5);
+        double bits = -static_cast<double>(std::max<uint64_t>(expected_keys, 1)) * std::log(rate) /
+                      (std::log(2) * std::log(2)) * 1.25;
+        _num_blocks = std::max<uint64_t>(1, std::ceil(bits / (sizeof(Block) * 8)));
+        _blocks = std::make_unique<Block[]>(_num_blocks);
+        clear();
+    }
+
+/*
+ * BLOOM FILTER ENHANCED CACHE
+ *
+ * Admits a key to the decorated cache only on its second insert, remembering keys seen once
+ * in two generations of blocked Bloom filters. Keys are added to the current generation and
+ * found in either. The older generation is cleared and becomes the current one when the
+ * current one holds its share of the expected keys, or when the decorated cache has evicted
+ * as many entries as it holds, so the filter forgets keys not seen for about two cache
+ * lifetimes and its false positive rate stays bounded however long the run. Keys are hashed
+ * with their std::hash, which PreHashedString keys have precomputed, remixed so that
+ * neighbouring hashes spread out.
+ */
+
+    template<typename K, typename V>
+    class BFECache : public CacheDecorator<K, V> {
+    private:
+        BlockedBloomFilter _generations[2];
+        std::atomic<uint8_t> _current; // generation keys are added to
+        uint64_t _generation_keys; // keys a generation holds before it is rotated out
+        std::atomic<uint64_t> _turnover; // evictions that rotate the generations, 0 never
+        std::atomic<uint64_t> _evictions; // since the last rotation
+        std::atomic<uint64_t> _rotations;
+        std::function<void(const K &, const V &)> _eviction_callback;
+
+        void initialize_bloom_filter(uint64_t expected_keys, double false_positive_rate);
+
+        // clears the older generation and makes it current, unless another thread already has
+        void rotate(uint8_t from);
+
+        void evicted(const K &key, const V &value);
+
+        static uint64_t key_hash(const K &key) {
+            uint64_t h = std::hash<K>{}(key);
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+            return h ^ (h >> 31);
+        }
+
+    public:
+        void add_key(const K &key); // add key to bloom filter
+        bool possibly_exists(const K &key); // check if key exists (possibly returns true if key doesn't exist)
+
+        // filter size in bytes, both generations
+        uint64_t filter_bytes() { return _generations[0].bytes() + _generations[1].bytes(); }
+
+        // times the older generation has been cleared
+        uint64_t rotations() { return _rotations.load(std::memory_order_relaxed); }
+
+    public:
+        // sized for the default cache capacity
+        BFECache();
+
+        explicit BFECache(uint64_t expected_keys, double false_positive_rate = 0.01);
+
+        ~BFECache();
+
+        BFECache(const BFECache &) = delete;
+
+        BFECache &operator=(const BFECache &) = delete;
+
+        // resizes and clears the filter for the number of distinct keys expected
+        void set_expected_keys(uint64_t expected_keys, double false_positive_rate = 0.01) {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            initialize_bloom_filter(expected_keys, false_positive_rate);
+        }
+
+        void set_cache(std::shared_ptr<CacheIndex<K, V> > &cache) override;
+
+        void set_max_size(uint64_t max_size) override {
+            this->_decorated_cache->set_max_size(max_size);
+            _turnover.store(max_size, std::memory_order_relaxed);
+        }
+
+        void set_eviction_callback(std::function<void(const K &, const V &)> callback) override;
+
+        uint64_t bytes() override { return this->_decorated_cache->bytes() + filter_bytes(); }
+
+        void update(int event) override { this->_decorated_cache->update(event); }
+
+        void insert(const K &key, const V &value) override;
+
+        void insert_no_evict(const K &key, const V &value) override;
+
+        void insert_no_evict(const K &key, const V &value, double cost) override;
+
+        void trim() override;
+
+        CacheHandle<V> find(const K &key) override;
+
+        V &at(const K &key) override;
+
+        CacheHandle<V> lookup(const K &key) override;
+
+        std::shared_ptr<const V> acquire(const K &key) override;
+
+        uint64_t trim_to(uint64_t size, uint64_t max_entries) override {
+            return this->_decorated_cache->trim_to(size, max_entries);
+        }
+
+        // only keys the filter may have seen reach the decorated cache's batch
+        void find_many(const std::vector<K> &keys, std::vector<std::shared_ptr<const V> > &handles) override;
+
+        void insert_many(const std::vector<K> &keys, std::vector<V> &values, const std::vector<double> &costs) override;
+
+        V &operator[](K &key) override;
+
+        void clear() override;
+
+        void fetch_into(const K &key, V *buff) override;
+
+    };
+
+    template<typename K, typename V>
+    void BFECache<K, V>::initialize_bloom_filter(uint64_t expected_keys, double false_positive_rate) {
+        // a probe sees both generations, each gets half the keys and half the rate
+        _generation_keys = std::max<uint64_t>(1, expected_keys / 2);
+        for (auto &generation : _generations)
+            generation.resize(_generation_keys, false_positive_rate / 2);
+        _current.store(0);
+        _evictions.store(0);
+    }
+
+    template<typename K, typename V>
+    void BFECache<K, V>::rotate(uint8_t from) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (_current.load() != from)
+            return;
+        _generations[1 - from].clear();
+        _current.store(1 - from);
+        _evictions.store(0);
+        _rotations++;
+    }
+
+    template<typename K, typename V>
+    void BFECache<K, V>::evicted(const K &key, const V &value) {
+        uint64_t turnover = _turnover.load(std::memory_order_relaxed);
+        if (turnover > 0 && _evictions.fetch_add(1) + 1 >= turnover)
+            rotate(_current.load());
+        if (_eviction_callback)
+            _eviction_callback(key, value);
+    }
+
+    template<typename K, typename V>
+    void BFECache<K, V>::add_key(const K &key) {
+        uint8_t current = _current.load();
+        if (_generations[current].keys() >= _generation_keys) {
+            rotate(current);
+            current = _current.load();
+        }
+        _generations[current].add(key_hash(key));
+    }
+
+    template<typename K, typename V>
+    bool BFECache<K, V>::possibly_exists(const K &key) {
+        uint64_t hash = key_hash(key);
+        return _generations[0].contains(hash) || _generations[1].contains(hash);
+    }
+
+    template<typename K, typename V>
+    BFECache<K, V>::BFECache() : _turnover{0}, _rotations{0} {
+        // default cache capacity (4M keys) at ~1% false positives, 5MB
+        initialize_bloom_filter(1048576 * 4, 0.01);
+    }
+
+    template<typename K, typename V>
+    BFECache<K, V>::BFECache(uint64_t expected_keys, double false_positive_rate) : _turnover{0}, _rotations{0} {
+        initialize_bloom_filter(expected_keys, false_positive_rate);
+    }
+
+    template<typename K, typename V>
+    BFECache<K, V>::~BFECache() {
+        // the decorated cache may outlive this one
+        if (this->_decorated_cache)
+            this->_decorated_cache->set_eviction_callback(nullptr);
+    }
+
+    template<typename K, typename V>
+    void BFECache<K, V>::set_cache(std::shared_ptr<CacheIndex<K, V> > &cache) {
+        this->_decorated_cache = cache;
+        // evictions drive the rotation, the decorated cache has turned over once it evicts its capacity
+        _turnover.store(cache->capacity(), std::memory_order_relaxed);
+        this->_decorated_cache->set_eviction_callback([this](const K &key, const V &value) {
+            this->evicted(key, value);
+        });
+    }
+
+    template<typename K, typename V>
+    void BFECache<K, V>::set_eviction_callback(std::function<void(const K &, const V &)> callback) {
+        _eviction_callback = std::move(callback);
+    }
+
+    template<typename K, typename V>
+    void BFECache<K, V>::insert(const K &key, const V &value) {
+        if (possibly_exists(key)) {
+            // key already seen, good candidate for cache
+            this->_decorated_cache->insert(key, value);
+        } else {
+            // remember key, but don't add to cache
+            add_key(key);
+        }
+    }
+
+    template<typename K, typename V>
+    void BFECache<K, V>::insert_no_evict(const K &key, const V &value) {
+        if (possibly_exists(key)) {
+            // key already seen, good candidate for cache
+            this->_decorated_cache->insert_no_evict(key, value);
+        } else {
+            // remember key, but don't add to cache
+            add_key(key);
+        }
+    }
+
+    template<typename K, typename V>
+    void BFECache<K, V>::insert_no_evict(const K &key, const V &value, double cost) {
+        if (possibly_exists(key)) {
+            this->_decorated_cache->insert_no_evict(key, value, cost);
+        } else {
+            add_key(key);
+        }
+    }
+
+    template<typename K, typename V>
+    void BFECache<K, V>::trim() {
+        this->_decorated_cache->trim();
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> BFECache<K, V>::find(const K &key) {
+        if (!possibly_exists(key)) {
             // use bloom filter to prevent unecessary cache searches
-            return this->_decorated_cache->end();
+            return std::nullopt;
         } else {
             add_key(key); // TODO: should key be added to bloom filter here? or only on insert?
             return this->_decorated_cache->find(key);
@@ -681,6 +3264,61 @@ namespace SeAlM {
         return this->_decorated_cache->at(key);
     }
 
+    template<typename K, typename V>
+    CacheHandle<V> BFECache<K, V>::lookup(const K &key) {
+        if (!possibly_exists(key)) {
+            // use bloom filter to prevent unecessary cache searches
+            return std::nullopt;
+        } else {
+            add_key(key);
+            return this->_decorated_cache->lookup(key);
+        }
+    }
+
+    template<typename K, typename V>
+    std::shared_ptr<const V> BFECache<K, V>::acquire(const K &key) {
+        if (!possibly_exists(key))
+            return nullptr;
+        add_key(key);
+        return this->_decorated_cache->acquire(key);
+    }
+
+    template<typename K, typename V>
+    void BFECache<K, V>::find_many(const std::vector<K> &keys, std::vector<std::shared_ptr<const V> > &handles) {
+        std::vector<size_t> positions;
+        std::vector<K> seen;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (possibly_exists(keys[i])) {
+                add_key(keys[i]);
+                positions.push_back(i);
+                seen.push_back(keys[i]);
+            }
+        }
+        std::vector<std::shared_ptr<const V> > seen_handles;
+        this->_decorated_cache->find_many(seen, seen_handles);
+        handles.assign(keys.size(), nullptr);
+        for (size_t j = 0; j < positions.size(); j++)
+            handles[positions[j]] = std::move(seen_handles[j]);
+    }
+
+    template<typename K, typename V>
+    void BFECache<K, V>::insert_many(const std::vector<K> &keys, std::vector<V> &values,
+                                     const std::vector<double> &costs) {
+        std::vector<K> admitted_keys;
+        std::vector<V> admitted_values;
+        std::vector<double> admitted_costs;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (possibly_exists(keys[i])) {
+                admitted_keys.push_back(keys[i]);
+                admitted_values.push_back(std::move(values[i]));
+                admitted_costs.push_back(costs[i]);
+            } else {
+                add_key(keys[i]);
+            }
+        }
+        this->_decorated_cache->insert_many(admitted_keys, admitted_values, admitted_costs);
+    }
+
     template<typename K, typename V>
     V &BFECache<K, V>::operator[](K &key) {
         return this->_decorated_cache->operator[](key);
@@ -688,9 +3326,14 @@ namespace SeAlM {
 
     template<typename K, typename V>
     void BFECache<K, V>::clear() {
-        // reset bloom filter
-        _bits.clear();
-        _bits.resize(_m, 0);
+        {
+            // reset bloom filter
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            for (auto &generation : _generations)
+                generation.clear();
+            _current.store(0);
+            _evictions.store(0);
+        }
         this->_decorated_cache->clear();
     }
 
@@ -698,6 +3341,340 @@ namespace SeAlM {
     void BFECache<K, V>::fetch_into(const K &key, V *buff) {
         this->_decorated_cache->fetch_into(key, buff);
     }
+
+/*
+ * FREQUENCY SKETCH
+ *
+ * Count-min sketch of 4-bit counters (4 rows, 16 counters per word) used to estimate
+ * how often a key has been requested. Counters are halved every sample_size additions
+ * so the estimate follows the recent workload instead of the whole run.
+ */
+
+    template<typename K>
+    class FrequencySketch {
+    private:
+        std::vector<uint64_t> _table;
+        uint64_t _row_words; // words per row
+        uint64_t _row_mask; // counters per row - 1 (power of 2)
+        uint64_t _additions;
+        uint64_t _sample_size;
+
+        // Locks for thread safety
+        std::mutex _sketch_mutex;
+
+        static constexpr uint8_t ROWS = 4;
+        static constexpr uint64_t SEEDS[ROWS] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+                                                  0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL};
+
+        uint64_t counter_index(uint64_t hash, uint8_t row) const {
+            uint64_t h = (hash + row) * SEEDS[row];
+            return (h ^ (h >> 32)) & _row_mask;
+        }
+
+        uint8_t get(uint8_t row, uint64_t c) const {
+            return (_table[row * _row_words + (c >> 4)] >> ((c & 15) << 2)) & 0xF;
+        }
+
+        void increment_counter(uint8_t row, uint64_t c) {
+            _table[row * _row_words + (c >> 4)] += 1ULL << ((c & 15) << 2);
+        }
+
+        void halve() {
+            for (auto &word : _table) {
+                word = (word >> 1) & 0x7777777777777777ULL;
+            }
+            _additions /= 2;
+        }
+
+    public:
+        FrequencySketch() { ensure_capacity(1024); }
+
+        void ensure_capacity(uint64_t max_size) {
+            std::lock_guard<std::mutex> lock(_sketch_mutex);
+            uint64_t counters = 64;
+            while (counters < max_size)
+                counters <<= 1;
+            _row_words = counters / 16;
+            _row_mask = counters - 1;
+            _table.assign(ROWS * _row_words, 0);
+            _additions = 0;
+            _sample_size = 10 * counters;
+        }
+
+        void increment(const K &key) {
+            // conservative update, only raise the counters holding the current minimum
+            uint64_t hash = std::hash<K>{}(key);
+            std::lock_guard<std::mutex> lock(_sketch_mutex);
+            uint64_t idx[ROWS];
+            uint8_t min = 15;
+            for (uint8_t r = 0; r < ROWS; r++) {
+                idx[r] = counter_index(hash, r);
+                min = std::min(min, get(r, idx[r]));
+            }
+            if (min == 15)
+                return;
+            for (uint8_t r = 0; r < ROWS; r++) {
+                if (get(r, idx[r]) == min)
+                    increment_counter(r, idx[r]);
+            }
+            if (++_additions >= _sample_size)
+                halve();
+        }
+
+        uint8_t estimate(const K &key) {
+            uint64_t hash = std::hash<K>{}(key);
+            std::lock_guard<std::mutex> lock(_sketch_mutex);
+            uint8_t min = 15;
+            for (uint8_t r = 0; r < ROWS; r++) {
+                min = std::min(min, get(r, counter_index(hash, r)));
+            }
+            return min;
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> lock(_sketch_mutex);
+            std::fill(_table.begin(), _table.end(), 0);
+            _additions = 0;
+        }
+    };
+
+/*
+ * W-TINYLFU ADMISSION CACHE
+ *
+ * New entries land in a small LRU window (1% of capacity). Entries leaving the window
+ * are only admitted to the decorated (main) cache if the frequency sketch rates them
+ * above the entry main would evict for them, so one-time reads cannot push out
+ * frequently duplicated ones.
+ */
+
+    template<typename K, typename V>
+    class TinyLFUCache : public CacheDecorator<K, V> {
+    private:
+        std::shared_ptr<LRUCache<K, V> > _window;
+        FrequencySketch<K> _sketch;
+        float _window_ratio;
+
+        // Metrics (window and main probed together count once)
+        std::atomic<uint64_t> _hits;
+        std::atomic<uint64_t> _misses;
+
+        // Listener for entries evicted by main or rejected by admission
+        std::function<void(const K &, const V &)> _eviction_callback;
+
+        // cost of costed entries while they are in the window, handed to main on admission
+        std::unordered_map<K, double> _window_costs;
+
+        void admit(const K &key, const V &value);
+
+        void partition(uint64_t max_size);
+
+    public:
+        TinyLFUCache();
+
+        void set_cache(std::shared_ptr<CacheIndex<K, V> > &cache) override;
+
+        void set_max_size(uint64_t max_size) override { partition(max_size); }
+
+        void set_max_bytes(uint64_t max_bytes) override {
+            uint64_t window_bytes = max_bytes * _window_ratio;
+            _window->set_max_bytes(window_bytes);
+            this->_decorated_cache->set_max_bytes(max_bytes - window_bytes);
+        }
+
+        uint8_t estimate(const K &key) { return _sketch.estimate(key); }
+
+        /*
+         * Overwrite State Descriptors
+         */
+
+        double hit_rate() override {
+            uint64_t h = _hits, m = _misses;
+            return m > 0 ? static_cast<double>(h) / (h + m) : 0;
+        }
+
+        uint64_t hits() override { return _hits; }
+
+        uint64_t misses() override { return _misses; }
+
+        uint32_t capacity() override { return _window->capacity() + this->_decorated_cache->capacity(); }
+
+        uint32_t size() override { return _window->size() + this->_decorated_cache->size(); }
+
+        uint64_t bytes() override { return _window->bytes() + this->_decorated_cache->bytes(); }
+
+        uint64_t lock_wait_ns() override {
+            return this->_cache_mutex.wait_ns() + _window->lock_wait_ns() + this->_decorated_cache->lock_wait_ns();
+        }
+
+        void update(int event) override {
+            _window->update(event);
+            this->_decorated_cache->update(event);
+        }
+
+        void insert(const K &key, const V &value) override { _window->insert(key, value); }
+
+        void insert_no_evict(const K &key, const V &value) override { _window->insert_no_evict(key, value); }
+
+        void insert_no_evict(const K &key, const V &value, double cost) override;
+
+        void trim() override;
+
+        CacheHandle<V> find(const K &key) override;
+
+        V &at(const K &key) override;
+
+        CacheHandle<V> lookup(const K &key) override;
+
+        std::shared_ptr<const V> acquire(const K &key) override;
+
+        bool contains(const K &key) override { return _window->contains(key) || this->_decorated_cache->contains(key); }
+
+        V &operator[](K &key) override { return this->_decorated_cache->operator[](key); }
+
+        void clear() override;
+
+        void fetch_into(const K &key, V *buff) override;
+
+        void set_eviction_callback(std::function<void(const K &, const V &)> callback) override;
+
+        void serialize(std::ostream &output) const override {
+            output << "Hits: " << _hits << " Misses: " << _misses << " Size: "
+                   << _window->size() + this->_decorated_cache->size() << std::endl;
+        }
+    };
+
+    template<typename K, typename V>
+    TinyLFUCache<K, V>::TinyLFUCache() : _window_ratio{0.01}, _hits{0}, _misses{0} {
+        _window = std::make_shared<LRUCache<K, V> >(1);
+        // entries leaving the window compete for a place in main
+        _window->set_eviction_callback([this](const K &key, const V &value) { this->admit(key, value); });
+    }
+
+    template<typename K, typename V>
+    void TinyLFUCache<K, V>::set_cache(std::shared_ptr<CacheIndex<K, V> > &cache) {
+        this->_decorated_cache = cache;
+        this->_decorated_cache->set_eviction_callback(_eviction_callback);
+        // carve the window out of the decorated cache's capacity so total memory is unchanged
+        partition(cache->capacity());
+    }
+
+    template<typename K, typename V>
+    void TinyLFUCache<K, V>::partition(uint64_t max_size) {
+        uint64_t window_size = std::max<uint64_t>(1, max_size * _window_ratio);
+        _window->set_max_size(window_size);
+        this->_decorated_cache->set_max_size(max_size > window_size ? max_size - window_size : 1);
+        _sketch.ensure_capacity(max_size);
+    }
+
+    template<typename K, typename V>
+    void TinyLFUCache<K, V>::insert_no_evict(const K &key, const V &value, double cost) {
+        {
+            // released before the window's lock, admission takes them the other way around
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            _window_costs[key] = cost;
+        }
+        _window->insert_no_evict(key, value);
+    }
+
+    template<typename K, typename V>
+    void TinyLFUCache<K, V>::admit(const K &key, const V &value) {
+        // called under the window's lock with the window's victim
+        double cost = 0;
+        bool costed;
+        {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            auto cost_ptr = _window_costs.find(key);
+            costed = cost_ptr != _window_costs.end();
+            if (costed) {
+                cost = cost_ptr->second;
+                _window_costs.erase(cost_ptr);
+            }
+        }
+        auto &main = this->_decorated_cache;
+        if (main->size() < main->capacity()) {
+            costed ? main->insert_no_evict(key, value, cost) : main->insert_no_evict(key, value);
+            return;
+        }
+        K victim;
+        if (!main->peek_victim(key, victim) || _sketch.estimate(key) > _sketch.estimate(victim)) {
+            // replaces main's victim, there is no costed insert so a costed entry waits for trim() to make room
+            if (costed)
+                main->insert_no_evict(key, value, cost);
+            else
+                main->insert(key, value);
+        } else if (_eviction_callback) {
+            _eviction_callback(key, value);
+        }
+    }
+
+    template<typename K, typename V>
+    void TinyLFUCache<K, V>::trim() {
+        // window overflow flows through admission, main then trims once for everything admitted past its capacity
+        _window->trim();
+        this->_decorated_cache->trim();
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> TinyLFUCache<K, V>::find(const K &key) {
+        _sketch.increment(key);
+        if (auto cached = _window->find(key)) {
+            _hits++;
+            return cached;
+        }
+        auto cached = this->_decorated_cache->find(key);
+        cached ? _hits++ : _misses++;
+        return cached;
+    }
+
+    template<typename K, typename V>
+    V &TinyLFUCache<K, V>::at(const K &key) {
+        if (_window->contains(key))
+            return _window->at(key);
+        return this->_decorated_cache->at(key);
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> TinyLFUCache<K, V>::lookup(const K &key) {
+        _sketch.increment(key);
+        auto cached = _window->lookup(key);
+        if (!cached)
+            cached = this->_decorated_cache->lookup(key);
+        cached ? _hits++ : _misses++;
+        return cached;
+    }
+
+    template<typename K, typename V>
+    std::shared_ptr<const V> TinyLFUCache<K, V>::acquire(const K &key) {
+        _sketch.increment(key);
+        auto cached = _window->acquire(key);
+        if (!cached)
+            cached = this->_decorated_cache->acquire(key);
+        cached ? _hits++ : _misses++;
+        return cached;
+    }
+
+    template<typename K, typename V>
+    void TinyLFUCache<K, V>::clear() {
+        _window->clear();
+        this->_decorated_cache->clear();
+        _sketch.clear();
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        _window_costs.clear();
+    }
+
+    template<typename K, typename V>
+    void TinyLFUCache<K, V>::fetch_into(const K &key, V *buff) {
+        auto cached = lookup(key);
+        if (cached && buff != nullptr)
+            *buff = cached->get();
+    }
+
+    template<typename K, typename V>
+    void TinyLFUCache<K, V>::set_eviction_callback(std::function<void(const K &, const V &)> callback) {
+        _eviction_callback = callback;
+        if (this->_decorated_cache)
+            this->_decorated_cache->set_eviction_callback(std::move(callback));
+    }
 }
 
 #endif //SEALM_CACHE_HPP
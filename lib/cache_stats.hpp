@@ -0,0 +1,453 @@
+#ifndef SEALM_CACHE_STATS_HPP
+#define SEALM_CACHE_STATS_HPP
+
+#include <array>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+
+namespace SeAlM {
+
+/*
+ * MISS RATIO CURVE
+ *
+ * Online estimate of the hit rate an LRU cache of every capacity would have had on the keys
+ * seen so far, after SHARDS (Waldspurger et al., FAST '15). Keys whose hash falls below a
+ * threshold are sampled and their LRU stack distance (distinct sampled keys since the last
+ * access, itself included) is found in a Fenwick tree over access positions holding a 1 where
+ * each key was last accessed. Distances are scaled up by the inverse sampling rate. At most
+ * max_keys keys are followed: past that the threshold is lowered to drop the keys with the
+ * highest hash values, so memory is fixed however many distinct keys the run has. Counts
+ * taken at the higher rate are scaled down with it, else the first pass over the keys,
+ * sampled at the highest rate, would outweigh everything after it.
+ *
+ * Distances are kept in buckets of SUB_BUCKETS per power of two, the curve has a point at
+ * the top of each non-empty bucket.
+ */
+
+    class MissRatioCurve {
+    public:
+        struct Point {
+            uint64_t capacity; // entries
+            double hit_rate;
+        };
+
+        static constexpr uint64_t MODULUS = 1 << 24;
+        static constexpr uint64_t SUB_BUCKETS = 8;
+        static constexpr uint64_t BUCKETS = SUB_BUCKETS * 62;
+
+    private:
+        uint64_t _max_keys;
+        uint64_t _threshold; // keys with a sample value below it are sampled
+        double _accesses; // sampled accesses at the current rate, first accesses included
+        uint64_t _next; // next access position, 1 based
+
+        std::unordered_map<uint64_t, uint64_t> _positions; // sampled key hash -> last access position
+        std::set<std::pair<uint64_t, uint64_t> > _by_value; // (sample value, key hash), highest dropped first
+        std::vector<int32_t> _tree;
+        std::vector<double> _histogram;
+
+        static uint64_t sample_value(uint64_t hash) { return (hash >> 32) % MODULUS; }
+
+        void add(uint64_t position, int32_t delta) {
+            for (; position < _tree.size(); position += position & -position)
+                _tree[position] += delta;
+        }
+
+        // keys last accessed at or before position
+        uint64_t prefix(uint64_t position) const {
+            uint64_t sum = 0;
+            for (; position > 0; position -= position & -position)
+                sum += _tree[position];
+            return sum;
+        }
+
+        // renumbers the live positions from 1 once the tree is full
+        void compact();
+
+        // lowers the threshold until at most _max_keys keys are followed
+        void shrink();
+
+    public:
+        static uint64_t bucket(uint64_t distance);
+
+        // smallest distance in bucket b
+        static uint64_t bucket_floor(uint64_t b);
+
+        explicit MissRatioCurve(double sample_rate = 0.01, uint64_t max_keys = 1 << 16);
+
+        void access(uint64_t hash);
+
+        double accesses() const { return _accesses; }
+
+        uint64_t tracked() const { return _positions.size(); }
+
+        double sample_rate() const { return static_cast<double>(_threshold) / MODULUS; }
+
+        // estimated hit rate of an LRU cache holding capacity entries
+        double hit_rate(uint64_t capacity) const;
+
+        std::vector<Point> curve() const;
+    };
+
+    inline MissRatioCurve::MissRatioCurve(double sample_rate, uint64_t max_keys)
+            : _max_keys{std::max<uint64_t>(1, max_keys)}, _accesses{0}, _next{1}, _histogram(BUCKETS, 0) {
+        _threshold = std::max<uint64_t>(1, std::min<uint64_t>(MODULUS, sample_rate * MODULUS));
+        _tree.assign(4 * _max_keys + 1, 0);
+    }
+
+    inline uint64_t MissRatioCurve::bucket(uint64_t distance) {
+        if (distance < SUB_BUCKETS)
+            return distance;
+        uint64_t exponent = 63;
+        while (!(distance >> exponent))
+            exponent--;
+        // SUB_BUCKETS = 8, so the three bits below the top one pick the sub-bucket
+        return SUB_BUCKETS * (exponent - 2) + ((distance >> (exponent - 3)) & (SUB_BUCKETS - 1));
+    }
+
+    inline uint64_t MissRatioCurve::bucket_floor(uint64_t b) {
+        if (b < SUB_BUCKETS)
+            return b;
+        return (SUB_BUCKETS + b % SUB_BUCKETS) << (b / SUB_BUCKETS - 1);
+    }
+
+    inline void MissRatioCurve::access(uint64_t hash) {
+        uint64_t value = sample_value(hash);
+        if (value >= _threshold)
+            return;
+        _accesses++;
+        if (_next >= _tree.size())
+            compact();
+
+        auto it = _positions.find(hash);
+        if (it != _positions.end()) {
+            uint64_t distance = prefix(_next - 1) - prefix(it->second) + 1;
+            uint64_t scaled = distance * MODULUS / _threshold;
+            _histogram[std::min(bucket(scaled), BUCKETS - 1)]++;
+            add(it->second, -1);
+            it->second = _next;
+        } else {
+            _positions.emplace(hash, _next);
+            _by_value.emplace(value, hash);
+        }
+        add(_next, 1);
+        _next++;
+        if (_positions.size() > _max_keys)
+            shrink();
+    }
+
+    inline void MissRatioCurve::compact() {
+        std::vector<std::pair<uint64_t, uint64_t> > live; // position, key hash
+        live.reserve(_positions.size());
+        for (const auto &p : _positions)
+            live.emplace_back(p.second, p.first);
+        std::sort(live.begin(), live.end());
+        std::fill(_tree.begin(), _tree.end(), 0);
+        _next = 1;
+        for (const auto &l : live) {
+            _positions[l.second] = _next;
+            add(_next, 1);
+            _next++;
+        }
+    }
+
+    inline void MissRatioCurve::shrink() {
+        while (_positions.size() > _max_keys && !_by_value.empty()) {
+            // every key with the highest sample value goes, the threshold drops to that value
+            uint64_t top = _by_value.rbegin()->first;
+            while (!_by_value.empty() && _by_value.rbegin()->first == top) {
+                uint64_t hash = _by_value.rbegin()->second;
+                auto it = _positions.find(hash);
+                add(it->second, -1);
+                _positions.erase(it);
+                _by_value.erase(std::prev(_by_value.end()));
+            }
+            uint64_t threshold = std::max<uint64_t>(1, top);
+            double scale = static_cast<double>(threshold) / _threshold;
+            for (double &count : _histogram)
+                count *= scale;
+            _accesses *= scale;
+            _threshold = threshold;
+        }
+    }
+
+    inline double MissRatioCurve::hit_rate(uint64_t capacity) const {
+        if (_accesses == 0)
+            return 0;
+        double hits = 0;
+        for (uint64_t b = 0; b + 1 < BUCKETS && bucket_floor(b + 1) - 1 <= capacity; b++)
+            hits += _histogram[b];
+        return hits / _accesses;
+    }
+
+    inline std::vector<MissRatioCurve::Point> MissRatioCurve::curve() const {
+        std::vector<Point> points;
+        double hits = 0;
+        for (uint64_t b = 0; b + 1 < BUCKETS; b++) {
+            if (_histogram[b] == 0)
+                continue;
+            hits += _histogram[b];
+            points.push_back(Point{bucket_floor(b + 1) - 1, _accesses > 0 ? hits / _accesses : 0});
+        }
+        return points;
+    }
+
+/*
+ * CACHE STATISTICS
+ *
+ * What the pipeline saw of its cache: probes, hits, inserts and evictions in total and per
+ * window (counts since the previous window() call, the mapper takes one per batch), and hit
+ * rates split by input file and by storage chain. Two histograms run on a logical clock that
+ * advances once per probe: the reuse distance of a key is the probes since it was last
+ * probed, the age of an evicted entry the probes since it was inserted. Histograms follow the
+ * keys whose hash falls in 1/SAMPLE_RATE of the hash space, so they cost a small fraction of
+ * the cache's memory; bucket b counts values in [2^(b-1), 2^b). Every probe also feeds a miss
+ * ratio curve.
+ */
+
+    template<typename K>
+    class CacheStats {
+    public:
+        static constexpr uint64_t SAMPLE_RATE = 64;
+        static constexpr uint64_t HISTOGRAM_BUCKETS = 48;
+        // sampled keys followed for reuse distance, all are forgotten once this many are
+        static constexpr uint64_t MAX_TRACKED = 1 << 20;
+
+        struct Counts {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t inserts = 0;
+            uint64_t evictions = 0;
+
+            double hit_rate() const {
+                return hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0;
+            }
+        };
+
+        typedef std::array<uint64_t, HISTOGRAM_BUCKETS> Histogram;
+
+    private:
+        std::atomic<uint64_t> _hits;
+        std::atomic<uint64_t> _misses;
+        std::atomic<uint64_t> _inserts;
+        std::atomic<uint64_t> _evictions;
+
+        // Locks for thread safety, evictions are recorded under the cache's lock
+        std::mutex _stats_mutex;
+
+        Counts _window_start; // totals at the previous window() call
+        uint64_t _clock;
+        std::unordered_map<uint64_t, uint64_t> _last_probe; // sampled key hash -> clock
+        std::unordered_map<uint64_t, uint64_t> _inserted; // sampled key hash -> clock
+        Histogram _reuse_distance;
+        Histogram _eviction_age;
+        std::vector<Counts> _per_file; // probes only
+        std::vector<Counts> _per_chain; // probes only
+        MissRatioCurve _curve;
+
+        static uint64_t hash(const K &key) {
+            // spread the key's hash, prehashed keys may keep their entropy in few bits
+            uint64_t h = std::hash<K>{}(key);
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            return h;
+        }
+
+        static bool sampled(uint64_t h) { return h % SAMPLE_RATE == 0; }
+
+        static uint64_t bucket(uint64_t value) {
+            uint64_t b = 0;
+            while (value > 0 && b < HISTOGRAM_BUCKETS - 1) {
+                value >>= 1;
+                b++;
+            }
+            return b;
+        }
+
+        static Counts &slot(std::vector<Counts> &counts, uint64_t i) {
+            if (i >= counts.size())
+                counts.resize(i + 1);
+            return counts[i];
+        }
+
+    public:
+        CacheStats() : _hits{0}, _misses{0}, _inserts{0}, _evictions{0}, _clock{0}, _reuse_distance{},
+                       _eviction_age{} {}
+
+        // one probe per key, found[i] if keys[i] was in the cache, files[i] the input file it was read from
+        void record_probes(const std::vector<K> &keys, const std::vector<bool> &found,
+                           const std::vector<uint64_t> &files, uint64_t chain);
+
+        // called before the keys are inserted, so an eviction during the insert finds them
+        void record_inserts(const std::vector<K> &keys);
+
+        void record_eviction(const K &key);
+
+        Counts totals() {
+            Counts c;
+            c.hits = _hits;
+            c.misses = _misses;
+            c.inserts = _inserts;
+            c.evictions = _evictions;
+            return c;
+        }
+
+        // counts since the previous call
+        Counts window();
+
+        Histogram reuse_distance() {
+            std::lock_guard<std::mutex> lock(_stats_mutex);
+            return _reuse_distance;
+        }
+
+        Histogram eviction_age() {
+            std::lock_guard<std::mutex> lock(_stats_mutex);
+            return _eviction_age;
+        }
+
+        std::vector<Counts> per_file() {
+            std::lock_guard<std::mutex> lock(_stats_mutex);
+            return _per_file;
+        }
+
+        std::vector<Counts> per_chain() {
+            std::lock_guard<std::mutex> lock(_stats_mutex);
+            return _per_chain;
+        }
+
+        std::vector<MissRatioCurve::Point> miss_ratio_curve() {
+            std::lock_guard<std::mutex> lock(_stats_mutex);
+            return _curve.curve();
+        }
+
+        // histograms and per file and chain hit rates as CSV sections, each under a # title line
+        void serialize(std::ostream &output, const std::vector<std::string> &file_names);
+
+        // miss ratio curve as CSV, capacities also in bytes at entry_bytes per entry
+        void serialize_curve(std::ostream &output, double entry_bytes);
+    };
+
+    template<typename K>
+    void CacheStats<K>::record_probes(const std::vector<K> &keys, const std::vector<bool> &found,
+                                      const std::vector<uint64_t> &files, uint64_t chain) {
+        uint64_t hits = 0;
+        std::lock_guard<std::mutex> lock(_stats_mutex);
+        Counts &chain_counts = slot(_per_chain, chain);
+        for (uint64_t i = 0; i < keys.size(); i++) {
+            Counts &file_counts = slot(_per_file, files[i]);
+            if (found[i]) {
+                hits++;
+                file_counts.hits++;
+                chain_counts.hits++;
+            } else {
+                file_counts.misses++;
+                chain_counts.misses++;
+            }
+            _clock++;
+            uint64_t h = hash(keys[i]);
+            _curve.access(h);
+            if (!sampled(h))
+                continue;
+            auto it = _last_probe.find(h);
+            if (it != _last_probe.end()) {
+                _reuse_distance[bucket(_clock - it->second)]++;
+                it->second = _clock;
+            } else {
+                if (_last_probe.size() >= MAX_TRACKED)
+                    _last_probe.clear();
+                _last_probe.emplace(h, _clock);
+            }
+        }
+        _hits += hits;
+        _misses += keys.size() - hits;
+    }
+
+    template<typename K>
+    void CacheStats<K>::record_inserts(const std::vector<K> &keys) {
+        _inserts += keys.size();
+        std::lock_guard<std::mutex> lock(_stats_mutex);
+        for (const K &key : keys) {
+            uint64_t h = hash(key);
+            if (sampled(h))
+                _inserted[h] = _clock;
+        }
+    }
+
+    template<typename K>
+    void CacheStats<K>::record_eviction(const K &key) {
+        _evictions++;
+        uint64_t h = hash(key);
+        if (!sampled(h))
+            return;
+        std::lock_guard<std::mutex> lock(_stats_mutex);
+        auto it = _inserted.find(h);
+        if (it == _inserted.end())
+            return; // loaded from a snapshot or inserted around the pipeline
+        _eviction_age[bucket(_clock - it->second)]++;
+        _inserted.erase(it);
+    }
+
+    template<typename K>
+    typename CacheStats<K>::Counts CacheStats<K>::window() {
+        Counts now = totals();
+        std::lock_guard<std::mutex> lock(_stats_mutex);
+        Counts delta;
+        delta.hits = now.hits - _window_start.hits;
+        delta.misses = now.misses - _window_start.misses;
+        delta.inserts = now.inserts - _window_start.inserts;
+        delta.evictions = now.evictions - _window_start.evictions;
+        _window_start = now;
+        return delta;
+    }
+
+    template<typename K>
+    void CacheStats<K>::serialize(std::ostream &output, const std::vector<std::string> &file_names) {
+        std::lock_guard<std::mutex> lock(_stats_mutex);
+        auto histogram = [&output](const std::string &title, const Histogram &h) {
+            output << "# " << title << std::endl;
+            output << "Min_Probes,Sampled_Keys" << std::endl;
+            for (uint64_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+                if (h[b] > 0)
+                    output << (b == 0 ? 0 : 1ULL << (b - 1)) << "," << h[b] << std::endl;
+            }
+        };
+        histogram("Reuse_Distance", _reuse_distance);
+        histogram("Eviction_Age", _eviction_age);
+
+        output << "# Files" << std::endl;
+        output << "File,Hits,Misses,Hit_Rate" << std::endl;
+        for (uint64_t i = 0; i < _per_file.size(); i++) {
+            output << (i < file_names.size() ? file_names[i] : std::to_string(i)) << "," << _per_file[i].hits
+                   << "," << _per_file[i].misses << "," << _per_file[i].hit_rate() << std::endl;
+        }
+
+        output << "# Chains" << std::endl;
+        output << "Chain,Hits,Misses,Hit_Rate" << std::endl;
+        for (uint64_t i = 0; i < _per_chain.size(); i++) {
+            if (_per_chain[i].hits + _per_chain[i].misses > 0)
+                output << i << "," << _per_chain[i].hits << "," << _per_chain[i].misses << ","
+                       << _per_chain[i].hit_rate() << std::endl;
+        }
+    }
+
+    template<typename K>
+    void CacheStats<K>::serialize_curve(std::ostream &output, double entry_bytes) {
+        std::lock_guard<std::mutex> lock(_stats_mutex);
+        output << "# Sample_Rate:" << _curve.sample_rate() << " Sampled_Probes:" << _curve.accesses() << std::endl;
+        output << "Capacity,Bytes,Hit_Rate,Miss_Rate" << std::endl;
+        for (const auto &p : _curve.curve()) {
+            output << p.capacity << "," << static_cast<uint64_t>(p.capacity * entry_bytes) << "," << p.hit_rate
+                   << "," << (1 - p.hit_rate) << std::endl;
+        }
+    }
+}
+
+#endif //SEALM_CACHE_STATS_HPP
@@ -0,0 +1,359 @@
+#ifndef SEALM_COMPRESSED_CACHE_HPP
+#define SEALM_COMPRESSED_CACHE_HPP
+
+#include <string>
+#include <string_view>
+#include <stdexcept>
+
+#include <zlib.h>
+
+#include "cache.hpp"
+#include "snapshot.hpp"
+
+namespace SeAlM {
+
+/*
+ * COMPRESSED CACHE
+ *
+ * Keeps recently inserted values as is in a small hot LRU and stores older values deflated
+ * in the decorated cache, which then fits several times more SAM lines in the same byte
+ * budget. Single SAM lines are too short to compress well alone, so they are deflated against
+ * a preset dictionary built from the first values that go cold; SAM lines of one run share
+ * most of their read names, tags and reference names. A hit on a cold value inflates it
+ * without moving it, the reference stays valid until the thread's next lookup.
+ *
+ * Stored values start with one tag byte saying how the rest was encoded, so values packed
+ * before the dictionary was ready stay readable after.
+ */
+
+    template<typename K, typename V>
+    class CompressedCache : public CacheDecorator<K, V> {
+        static_assert(snapshot_storable<V>, "compressed cache stores values as raw bytes");
+
+    private:
+        enum Encoding : char {
+            RAW = 0, // did not shrink
+            DEFLATE = 1, // raw deflate, no dictionary yet
+            DEFLATE_DICT = 2 // raw deflate with the preset dictionary
+        };
+
+        // zlib dictionaries are limited to the deflate window
+        static constexpr uint64_t DICTIONARY_BYTES = 32768;
+
+        std::shared_ptr<LRUCache<K, V> > _hot;
+        float _hot_ratio;
+
+        // written under _deflate_mutex until ready, which is published with release once it is final
+        std::string _dictionary;
+        std::atomic<bool> _dictionary_ready;
+        std::atomic<uint64_t> _dictionary_bytes;
+
+        // streams are reset between values rather than reinitialized
+        z_stream _deflate;
+        z_stream _inflate;
+        std::mutex _deflate_mutex;
+        std::mutex _inflate_mutex;
+
+        // Metrics (hot and cold probed together count once)
+        std::atomic<uint64_t> _hits;
+        std::atomic<uint64_t> _misses;
+        std::atomic<uint64_t> _raw_bytes;
+        std::atomic<uint64_t> _packed_bytes;
+
+        // Listener for entries evicted from the cold cache, called with the original value
+        std::function<void(const K &, const V &)> _eviction_callback;
+
+        void train(std::string_view value);
+
+        std::string pack(std::string_view value);
+
+        std::string unpack(std::string_view packed);
+
+        void cool(const K &key, const V &value);
+
+        void partition(uint64_t max_size);
+
+    public:
+        CompressedCache();
+
+        ~CompressedCache();
+
+        CompressedCache(const CompressedCache &) = delete;
+
+        CompressedCache &operator=(const CompressedCache &) = delete;
+
+        void set_cache(std::shared_ptr<CacheIndex<K, V> > &cache) override;
+
+        void set_max_size(uint64_t max_size) override { partition(max_size); }
+
+        void set_max_bytes(uint64_t max_bytes) override {
+            uint64_t hot_bytes = max_bytes * _hot_ratio;
+            _hot->set_max_bytes(hot_bytes);
+            this->_decorated_cache->set_max_bytes(max_bytes - hot_bytes);
+        }
+
+        /*
+         * Overwrite State Descriptors
+         */
+
+        double hit_rate() override {
+            uint64_t h = _hits, m = _misses;
+            return m > 0 ? static_cast<double>(h) / (h + m) : 0;
+        }
+
+        uint64_t hits() override { return _hits; }
+
+        uint64_t misses() override { return _misses; }
+
+        uint32_t capacity() override { return _hot->capacity() + this->_decorated_cache->capacity(); }
+
+        uint32_t size() override { return _hot->size() + this->_decorated_cache->size(); }
+
+        uint64_t bytes() override { return _hot->bytes() + this->_decorated_cache->bytes() + _dictionary_bytes; }
+
+        uint64_t lock_wait_ns() override {
+            return this->_cache_mutex.wait_ns() + _hot->lock_wait_ns() + this->_decorated_cache->lock_wait_ns();
+        }
+
+        // packed / original size of the values compressed so far
+        double compression_ratio() {
+            uint64_t raw = _raw_bytes, packed = _packed_bytes;
+            return raw > 0 ? static_cast<double>(packed) / raw : 1;
+        }
+
+        bool dictionary_ready() { return _dictionary_ready.load(std::memory_order_acquire); }
+
+        void update(int event) override {
+            _hot->update(event);
+            this->_decorated_cache->update(event);
+        }
+
+        void insert(const K &key, const V &value) override { _hot->insert(key, value); }
+
+        void insert_no_evict(const K &key, const V &value) override { _hot->insert_no_evict(key, value); }
+
+        // the hot tier is an LRU, cost has no bearing on it
+        void insert_no_evict(const K &key, const V &value, double) override { insert_no_evict(key, value); }
+
+        void trim() override;
+
+        CacheHandle<V> find(const K &key) override;
+
+        V &at(const K &key) override;
+
+        CacheHandle<V> lookup(const K &key) override;
+
+        // hot values are shared, cold ones are inflated into a value of their own
+        std::shared_ptr<const V> acquire(const K &key) override;
+
+        bool contains(const K &key) override { return _hot->contains(key) || this->_decorated_cache->contains(key); }
+
+        V &operator[](K &key) override { return at(key); }
+
+        void clear() override;
+
+        void fetch_into(const K &key, V *buff) override;
+
+        void set_eviction_callback(std::function<void(const K &, const V &)> callback) override {
+            _eviction_callback = std::move(callback);
+        }
+
+        bool peek_victim(const K &candidate, K &victim) override {
+            return this->_decorated_cache->peek_victim(candidate, victim);
+        }
+
+        // cold values are only readable with this run's dictionary
+        bool save_snapshot(const std::string &, uint64_t) override {
+            log_warn("Compressed caches do not save snapshots.");
+            return false;
+        }
+
+        // entries are inserted hot and compressed as they cool like any other insert
+        uint64_t load_snapshot(const std::string &path, uint64_t fingerprint) override {
+            return CacheIndex<K, V>::load_snapshot(path, fingerprint);
+        }
+
+        void serialize(std::ostream &output) const override {
+            output << "Hits: " << _hits << " Misses: " << _misses << " Size: "
+                   << _hot->size() + this->_decorated_cache->size() << std::endl;
+        }
+    };
+
+    template<typename K, typename V>
+    CompressedCache<K, V>::CompressedCache() : _hot_ratio{0.05}, _dictionary_ready{false}, _dictionary_bytes{0},
+                                               _deflate{}, _inflate{}, _hits{0}, _misses{0}, _raw_bytes{0},
+                                               _packed_bytes{0} {
+        // negative window bits select raw deflate, no zlib header or checksum per value
+        if (deflateInit2(&_deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK ||
+            inflateInit2(&_inflate, -15) != Z_OK)
+            throw std::runtime_error("Failed to initialize zlib streams");
+        _hot = std::make_shared<LRUCache<K, V> >(1);
+        // entries leaving the hot cache are compressed into the decorated cache
+        _hot->set_eviction_callback([this](const K &key, const V &value) { this->cool(key, value); });
+    }
+
+    template<typename K, typename V>
+    CompressedCache<K, V>::~CompressedCache() {
+        deflateEnd(&_deflate);
+        inflateEnd(&_inflate);
+    }
+
+    template<typename K, typename V>
+    void CompressedCache<K, V>::set_cache(std::shared_ptr<CacheIndex<K, V> > &cache) {
+        this->_decorated_cache = cache;
+        this->_decorated_cache->set_eviction_callback([this](const K &key, const V &packed) {
+            if (this->_eviction_callback)
+                this->_eviction_callback(key, V(this->unpack(snapshot_view(packed))));
+        });
+        partition(cache->capacity());
+    }
+
+    template<typename K, typename V>
+    void CompressedCache<K, V>::partition(uint64_t max_size) {
+        uint64_t hot_size = std::max<uint64_t>(2, max_size * _hot_ratio);
+        _hot->set_max_size(hot_size);
+        this->_decorated_cache->set_max_size(max_size > hot_size ? max_size - hot_size : 1);
+    }
+
+    template<typename K, typename V>
+    void CompressedCache<K, V>::train(std::string_view value) {
+        // caller holds _deflate_mutex, the dictionary is the first DICTIONARY_BYTES of cold values
+        _dictionary.append(value.substr(0, DICTIONARY_BYTES - _dictionary.size()));
+        _dictionary_bytes = _dictionary.size();
+        if (_dictionary.size() < DICTIONARY_BYTES)
+            return;
+        _dictionary_ready.store(true, std::memory_order_release);
+        log_info("Compressed cache dictionary ready.");
+    }
+
+    template<typename K, typename V>
+    std::string CompressedCache<K, V>::pack(std::string_view value) {
+        std::lock_guard<std::mutex> lock(_deflate_mutex);
+        bool with_dictionary = _dictionary_ready.load(std::memory_order_acquire);
+        if (!with_dictionary)
+            train(value);
+
+        std::string packed(1 + deflateBound(&_deflate, value.size()), '\0');
+        deflateReset(&_deflate);
+        if (with_dictionary)
+            deflateSetDictionary(&_deflate, reinterpret_cast<const Bytef *>(_dictionary.data()), _dictionary.size());
+        _deflate.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(value.data()));
+        _deflate.avail_in = value.size();
+        _deflate.next_out = reinterpret_cast<Bytef *>(&packed[1]);
+        _deflate.avail_out = packed.size() - 1;
+        if (deflate(&_deflate, Z_FINISH) != Z_STREAM_END || _deflate.total_out >= value.size()) {
+            packed.assign(1, RAW);
+            packed.append(value);
+        } else {
+            packed[0] = with_dictionary ? DEFLATE_DICT : DEFLATE;
+            packed.resize(1 + _deflate.total_out);
+        }
+        _raw_bytes += value.size();
+        _packed_bytes += packed.size();
+        return packed;
+    }
+
+    template<typename K, typename V>
+    std::string CompressedCache<K, V>::unpack(std::string_view packed) {
+        if (packed.empty())
+            return std::string();
+        std::string_view body = packed.substr(1);
+        if (packed[0] == RAW)
+            return std::string(body);
+
+        std::lock_guard<std::mutex> lock(_inflate_mutex);
+        inflateReset(&_inflate);
+        if (packed[0] == DEFLATE_DICT)
+            inflateSetDictionary(&_inflate, reinterpret_cast<const Bytef *>(_dictionary.data()), _dictionary.size());
+        _inflate.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(body.data()));
+        _inflate.avail_in = body.size();
+        std::string value;
+        char chunk[4096];
+        int rc;
+        do {
+            _inflate.next_out = reinterpret_cast<Bytef *>(chunk);
+            _inflate.avail_out = sizeof(chunk);
+            rc = inflate(&_inflate, Z_NO_FLUSH);
+            value.append(chunk, sizeof(chunk) - _inflate.avail_out);
+        } while (rc == Z_OK);
+        if (rc != Z_STREAM_END)
+            log_error("Corrupt value in compressed cache.");
+        return value;
+    }
+
+    template<typename K, typename V>
+    void CompressedCache<K, V>::cool(const K &key, const V &value) {
+        // called under the hot cache's lock with its victim
+        this->_decorated_cache->insert_no_evict(key, V(pack(snapshot_view(value))));
+    }
+
+    template<typename K, typename V>
+    void CompressedCache<K, V>::trim() {
+        // hot overflow is compressed into the decorated cache, which then trims to its own limits
+        _hot->trim();
+        this->_decorated_cache->trim();
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> CompressedCache<K, V>::find(const K &key) {
+        auto cached = _hot->find(key);
+        if (!cached) {
+            auto packed = this->_decorated_cache->find(key);
+            if (packed)
+                cached = CacheHandle<V>(std::make_shared<V>(unpack(snapshot_view(packed->get()))));
+        }
+        cached ? _hits++ : _misses++;
+        return cached;
+    }
+
+    template<typename K, typename V>
+    V &CompressedCache<K, V>::at(const K &key) {
+        // a cold hit is inflated on the probe, the reference is valid until this thread's next at()
+        static thread_local std::shared_ptr<V> held;
+        auto cached = lookup(key);
+        if (!cached)
+            throw std::out_of_range("Key not in compressed cache");
+        held = cached.shared();
+        return *held;
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> CompressedCache<K, V>::lookup(const K &key) {
+        auto cached = _hot->lookup(key);
+        if (!cached) {
+            auto packed = this->_decorated_cache->lookup(key);
+            if (packed)
+                cached = CacheHandle<V>(std::make_shared<V>(unpack(snapshot_view(packed->get()))));
+        }
+        cached ? _hits++ : _misses++;
+        return cached;
+    }
+
+    template<typename K, typename V>
+    std::shared_ptr<const V> CompressedCache<K, V>::acquire(const K &key) {
+        auto cached = _hot->acquire(key);
+        if (!cached) {
+            auto packed = this->_decorated_cache->lookup(key);
+            if (packed)
+                cached = std::make_shared<const V>(unpack(snapshot_view(packed->get())));
+        }
+        cached ? _hits++ : _misses++;
+        return cached;
+    }
+
+    template<typename K, typename V>
+    void CompressedCache<K, V>::clear() {
+        // the dictionary is kept, it still matches this run's output
+        _hot->clear();
+        this->_decorated_cache->clear();
+    }
+
+    template<typename K, typename V>
+    void CompressedCache<K, V>::fetch_into(const K &key, V *buff) {
+        auto cached = lookup(key);
+        if (cached && buff != nullptr)
+            *buff = cached->get();
+    }
+}
+
+#endif //SEALM_COMPRESSED_CACHE_HPP
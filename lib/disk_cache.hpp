@@ -0,0 +1,466 @@
+#ifndef SEALM_DISK_CACHE_HPP
+#define SEALM_DISK_CACHE_HPP
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cache.hpp"
+#include "snapshot.hpp"
+
+namespace SeAlM {
+
+/*
+ * DISK TIER CACHE
+ *
+ * Second cache level on local disk. Entries evicted by the decorated (memory) cache are
+ * appended to a log of fixed-size segment files instead of being lost, and a hit on disk moves
+ * the entry back into memory. Only a 64 bit fingerprint and the record location are kept in
+ * memory per disk entry, so the disk tier can be far larger than the memory tier. Once the
+ * log exceeds its byte budget the oldest segment is dropped whole, FIFO like the log itself.
+ *
+ * Records are    hash | key_len | value_len | key | value    and are never rewritten; entries
+ * promoted back to memory leave dead records behind that are reclaimed with their segment.
+ * Segment files belong to one process and are removed when the cache is destroyed.
+ */
+
+    template<typename K, typename V>
+    class DiskTierCache : public CacheDecorator<K, V> {
+        static_assert(snapshot_storable<K> && snapshot_storable<V>,
+                      "disk tier stores keys and values as raw bytes");
+
+    private:
+        struct RecordHeader {
+            uint64_t hash;
+            uint32_t key_len;
+            uint32_t value_len;
+        };
+
+        struct Location {
+            uint32_t segment;
+            uint32_t offset;
+            uint32_t key_len;
+            uint32_t value_len;
+        };
+
+        struct Segment {
+            uint32_t id;
+            int fd;
+            uint64_t size; // bytes appended, including those still in the write buffer
+            std::vector<uint64_t> hashes; // records written to this segment, live or not
+        };
+
+        std::string _dir;
+        uint64_t _max_disk_bytes; // 0 if unbounded
+        uint64_t _segment_bytes;
+        bool _disabled;
+
+        std::unordered_map<uint64_t, Location> _index;
+        std::deque<Segment> _segments; // oldest first, back is appended to
+        uint32_t _next_segment;
+        uint64_t _disk_bytes;
+
+        // appends to the active segment are batched, _pending starts at _pending_offset
+        std::string _pending;
+        uint64_t _pending_offset;
+        static constexpr uint64_t WRITE_BUFFER_BYTES = 1 << 20;
+
+        // Metrics (memory and disk probed together count once)
+        std::atomic<uint64_t> _hits;
+        std::atomic<uint64_t> _misses;
+        std::atomic<uint64_t> _disk_hits;
+
+        // Listener for entries that leave both tiers
+        std::function<void(const K &, const V &)> _eviction_callback;
+
+        std::string segment_path(uint32_t id) {
+            return _dir + "/sealm." + std::to_string(getpid()) + "." + std::to_string(id) + ".log";
+        }
+
+        Segment *segment(uint32_t id) {
+            if (_segments.empty() || id < _segments.front().id || id > _segments.back().id)
+                return nullptr;
+            return &_segments[id - _segments.front().id];
+        }
+
+        bool open_segment();
+
+        void drop_segment();
+
+        bool flush();
+
+        bool read(const Location &loc, std::string &key, std::string &value);
+
+        void spill(const K &key, const V &value);
+
+        bool promote(const K &key);
+
+    public:
+        explicit DiskTierCache(const std::string &dir, uint64_t max_disk_bytes = 16ULL << 30,
+                               uint64_t segment_bytes = 64 << 20);
+
+        ~DiskTierCache();
+
+        DiskTierCache(const DiskTierCache &) = delete;
+
+        DiskTierCache &operator=(const DiskTierCache &) = delete;
+
+        void set_cache(std::shared_ptr<CacheIndex<K, V> > &cache) override;
+
+        void set_max_disk_bytes(uint64_t max_disk_bytes) {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            _max_disk_bytes = max_disk_bytes;
+            while (_max_disk_bytes > 0 && _disk_bytes > _max_disk_bytes && _segments.size() > 1)
+                drop_segment();
+        }
+
+        /*
+         * Overwrite State Descriptors
+         */
+
+        double hit_rate() override {
+            uint64_t h = _hits, m = _misses;
+            return m > 0 ? static_cast<double>(h) / (h + m) : 0;
+        }
+
+        uint64_t hits() override { return _hits; }
+
+        uint64_t misses() override { return _misses; }
+
+        uint64_t disk_hits() { return _disk_hits; }
+
+        uint64_t disk_size() {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            return _index.size();
+        }
+
+        uint64_t disk_bytes() {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            return _disk_bytes;
+        }
+
+        void update(int event) override { this->_decorated_cache->update(event); }
+
+        void insert(const K &key, const V &value) override;
+
+        void insert_no_evict(const K &key, const V &value) override;
+
+        void insert_no_evict(const K &key, const V &value, double cost) override;
+
+        void trim() override;
+
+        CacheHandle<V> find(const K &key) override;
+
+        V &at(const K &key) override;
+
+        CacheHandle<V> lookup(const K &key) override;
+
+        std::shared_ptr<const V> acquire(const K &key) override;
+
+        // a record on disk counts by its key hash, promote() checks the key itself
+        bool contains(const K &key) override;
+
+        V &operator[](K &key) override { return at(key); }
+
+        void clear() override;
+
+        void fetch_into(const K &key, V *buff) override;
+
+        void set_eviction_callback(std::function<void(const K &, const V &)> callback) override {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            _eviction_callback = std::move(callback);
+        }
+
+        void serialize(std::ostream &output) const override {
+            output << "Hits: " << _hits << " Misses: " << _misses << " Disk Hits: " << _disk_hits
+                   << " Size: " << this->_decorated_cache->size() << " Disk Size: " << _index.size() << std::endl;
+        }
+    };
+
+    template<typename K, typename V>
+    DiskTierCache<K, V>::DiskTierCache(const std::string &dir, uint64_t max_disk_bytes, uint64_t segment_bytes)
+            : _dir{dir}, _max_disk_bytes{max_disk_bytes},
+              _segment_bytes{std::min<uint64_t>(segment_bytes, UINT32_MAX)}, _disabled{false},
+              _next_segment{0}, _disk_bytes{0}, _pending_offset{0}, _hits{0}, _misses{0}, _disk_hits{0} {
+        if (mkdir(_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            log_error("Cannot create disk cache directory " + _dir + ", disk tier disabled.");
+            _disabled = true;
+            return;
+        }
+        _disabled = !open_segment();
+    }
+
+    template<typename K, typename V>
+    DiskTierCache<K, V>::~DiskTierCache() {
+        if (this->_decorated_cache)
+            this->_decorated_cache->set_eviction_callback(nullptr);
+        // the index only lives in memory, so the log is useless once the process exits
+        for (auto &s : _segments) {
+            close(s.fd);
+            std::remove(segment_path(s.id).c_str());
+        }
+    }
+
+    template<typename K, typename V>
+    void DiskTierCache<K, V>::set_cache(std::shared_ptr<CacheIndex<K, V> > &cache) {
+        this->_decorated_cache = cache;
+        // memory evictions spill to disk instead of leaving the cache
+        this->_decorated_cache->set_eviction_callback([this](const K &key, const V &value) { this->spill(key, value); });
+    }
+
+    template<typename K, typename V>
+    bool DiskTierCache<K, V>::open_segment() {
+        // caller holds _cache_mutex and has flushed the previous segment
+        std::string path = segment_path(_next_segment);
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            log_error("Cannot open disk cache segment " + path + ": " + std::strerror(errno));
+            return false;
+        }
+        _segments.push_back(Segment{_next_segment++, fd, 0, {}});
+        _pending_offset = 0;
+        return true;
+    }
+
+    template<typename K, typename V>
+    void DiskTierCache<K, V>::drop_segment() {
+        // caller holds _cache_mutex, never called on the active segment
+        Segment &s = _segments.front();
+        for (uint64_t hash : s.hashes) {
+            auto loc = _index.find(hash);
+            if (loc == _index.end() || loc->second.segment != s.id)
+                continue;
+            if (_eviction_callback) {
+                std::string key, value;
+                if (read(loc->second, key, value))
+                    _eviction_callback(K(key), V(value));
+            }
+            _index.erase(loc);
+        }
+        close(s.fd);
+        std::remove(segment_path(s.id).c_str());
+        _disk_bytes -= s.size;
+        _segments.pop_front();
+    }
+
+    template<typename K, typename V>
+    bool DiskTierCache<K, V>::flush() {
+        // caller holds _cache_mutex
+        if (_pending.empty())
+            return true;
+        Segment &s = _segments.back();
+        const char *data = _pending.data();
+        uint64_t left = _pending.size();
+        uint64_t offset = _pending_offset;
+        while (left > 0) {
+            ssize_t n = pwrite(s.fd, data, left, offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                log_error("Failed to write disk cache segment " + segment_path(s.id) + ", disk tier disabled.");
+                _disabled = true;
+                return false;
+            }
+            data += n;
+            offset += n;
+            left -= n;
+        }
+        _pending_offset += _pending.size();
+        _pending.clear();
+        return true;
+    }
+
+    template<typename K, typename V>
+    bool DiskTierCache<K, V>::read(const Location &loc, std::string &key, std::string &value) {
+        // caller holds _cache_mutex
+        Segment *s = segment(loc.segment);
+        if (s == nullptr)
+            return false;
+        uint64_t offset = loc.offset + sizeof(RecordHeader);
+        uint64_t len = loc.key_len + loc.value_len;
+        std::string record(len, '\0');
+        if (s == &_segments.back() && offset >= _pending_offset) {
+            // still in the write buffer
+            record.assign(_pending, offset - _pending_offset, len);
+        } else {
+            uint64_t done = 0;
+            while (done < len) {
+                ssize_t n = pread(s->fd, &record[done], len - done, offset + done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    log_error("Failed to read disk cache segment " + segment_path(s->id));
+                    return false;
+                }
+                done += n;
+            }
+        }
+        key = record.substr(0, loc.key_len);
+        value = record.substr(loc.key_len);
+        return true;
+    }
+
+    template<typename K, typename V>
+    void DiskTierCache<K, V>::spill(const K &key, const V &value) {
+        // called under the decorated cache's lock with its victim
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        std::string_view k = snapshot_view(key);
+        std::string_view v = snapshot_view(value);
+        uint64_t record_bytes = sizeof(RecordHeader) + k.size() + v.size();
+        if (_disabled || record_bytes > _segment_bytes) {
+            if (_eviction_callback)
+                _eviction_callback(key, value);
+            return;
+        }
+
+        if (_segments.back().size + record_bytes > _segment_bytes) {
+            if (!flush() || !open_segment()) {
+                _disabled = true;
+                if (_eviction_callback)
+                    _eviction_callback(key, value);
+                return;
+            }
+        }
+        while (_max_disk_bytes > 0 && _disk_bytes + record_bytes > _max_disk_bytes && _segments.size() > 1)
+            drop_segment();
+
+        Segment &s = _segments.back();
+        uint64_t hash = stable_hash(k);
+        RecordHeader header{hash, static_cast<uint32_t>(k.size()), static_cast<uint32_t>(v.size())};
+        _pending.append(reinterpret_cast<const char *>(&header), sizeof(header));
+        _pending.append(k);
+        _pending.append(v);
+        // a fingerprint collision replaces the older record
+        _index[hash] = Location{s.id, static_cast<uint32_t>(s.size), header.key_len, header.value_len};
+        s.hashes.push_back(hash);
+        s.size += record_bytes;
+        _disk_bytes += record_bytes;
+        if (_pending.size() >= WRITE_BUFFER_BYTES)
+            flush();
+    }
+
+    template<typename K, typename V>
+    bool DiskTierCache<K, V>::contains(const K &key) {
+        if (this->_decorated_cache->contains(key))
+            return true;
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        return _index.find(stable_hash(snapshot_view(key))) != _index.end();
+    }
+
+    template<typename K, typename V>
+    bool DiskTierCache<K, V>::promote(const K &key) {
+        std::string k, v;
+        {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            std::string_view key_bytes = snapshot_view(key);
+            auto loc = _index.find(stable_hash(key_bytes));
+            if (loc == _index.end())
+                return false;
+            if (!read(loc->second, k, v) || k != key_bytes)
+                return false;
+            // moved to memory, the record on disk is now dead
+            _index.erase(loc);
+        }
+        // outside our lock, the insert may spill memory's victim to disk
+        this->_decorated_cache->insert(key, V(v));
+        _disk_hits++;
+        return true;
+    }
+
+    template<typename K, typename V>
+    void DiskTierCache<K, V>::insert(const K &key, const V &value) {
+        this->_decorated_cache->insert(key, value);
+    }
+
+    template<typename K, typename V>
+    void DiskTierCache<K, V>::insert_no_evict(const K &key, const V &value) {
+        this->_decorated_cache->insert_no_evict(key, value);
+    }
+
+    template<typename K, typename V>
+    void DiskTierCache<K, V>::insert_no_evict(const K &key, const V &value, double cost) {
+        this->_decorated_cache->insert_no_evict(key, value, cost);
+    }
+
+    template<typename K, typename V>
+    void DiskTierCache<K, V>::trim() {
+        this->_decorated_cache->trim();
+        // spilled entries reach the disk once per bucket
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        if (!_disabled)
+            flush();
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> DiskTierCache<K, V>::find(const K &key) {
+        auto cached = this->_decorated_cache->find(key);
+        if (!cached && promote(key))
+            cached = this->_decorated_cache->find(key);
+        cached ? _hits++ : _misses++;
+        return cached;
+    }
+
+    template<typename K, typename V>
+    V &DiskTierCache<K, V>::at(const K &key) {
+        // a promoted entry can be evicted again at once, the reference is valid until this thread's next at()
+        static thread_local std::shared_ptr<V> held;
+        auto cached = lookup(key);
+        if (!cached)
+            throw std::out_of_range("Key not in memory or disk cache");
+        held = cached.shared();
+        return *held;
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> DiskTierCache<K, V>::lookup(const K &key) {
+        auto cached = this->_decorated_cache->lookup(key);
+        if (!cached && promote(key))
+            cached = this->_decorated_cache->lookup(key);
+        cached ? _hits++ : _misses++;
+        return cached;
+    }
+
+    template<typename K, typename V>
+    std::shared_ptr<const V> DiskTierCache<K, V>::acquire(const K &key) {
+        auto cached = this->_decorated_cache->acquire(key);
+        if (!cached && promote(key))
+            cached = this->_decorated_cache->acquire(key);
+        cached ? _hits++ : _misses++;
+        return cached;
+    }
+
+    template<typename K, typename V>
+    void DiskTierCache<K, V>::clear() {
+        this->_decorated_cache->clear();
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        _pending.clear();
+        _index.clear();
+        while (_segments.size() > 1)
+            drop_segment();
+        if (!_segments.empty()) {
+            Segment &s = _segments.back();
+            _disk_bytes -= s.size;
+            s.size = 0;
+            s.hashes.clear();
+            _pending_offset = 0;
+            if (ftruncate(s.fd, 0) != 0)
+                log_warn("Could not truncate disk cache segment " + segment_path(s.id));
+        }
+    }
+
+    template<typename K, typename V>
+    void DiskTierCache<K, V>::fetch_into(const K &key, V *buff) {
+        auto cached = lookup(key);
+        if (cached && buff != nullptr)
+            *buff = cached->get();
+    }
+}
+
+#endif //SEALM_DISK_CACHE_HPP
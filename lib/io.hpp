@@ -149,6 +149,9 @@ public:
 
         std::vector<std::string> get_input_filenames();
 
+        // storage chain of the bucket last returned by request_bucket
+        uint64_t last_bucket_chain() { return _storage_subsystem->last_chain(); }
+
         void set_async_flag(bool flag) { _async_fill_flag.store(flag); }
 
         void set_max_interleave(uint64_t max_interleave) { _max_io_interleave = max_interleave; }
@@ -0,0 +1,309 @@
+#ifndef SEALM_MAINTAINED_CACHE_HPP
+#define SEALM_MAINTAINED_CACHE_HPP
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <condition_variable>
+
+#include "cache.hpp"
+
+namespace SeAlM {
+
+/*
+ * BACKGROUND MAINTENANCE
+ *
+ * Moves inserts and eviction off the thread that calls them. Inserts are queued and a
+ * dedicated worker applies them to the decorated cache in batches; once the cache grows past
+ * the high watermark the worker evicts down to the low watermark a bounded number of entries
+ * at a time, releasing the decorated cache's lock in between so probes are not held up behind
+ * a long eviction. trim() only wakes the worker, the byte budget is enforced the same way.
+ *
+ * Queued entries are not visible to lookups until the worker has applied them, flush() waits
+ * for that. The worker is joined when the decorator is destroyed, entries still queued then are
+ * dropped.
+ */
+
+    template<typename K, typename V>
+    class MaintainedCache : public CacheDecorator<K, V> {
+    private:
+        struct Pending {
+            K key;
+            V value;
+            double cost;
+            bool costed;
+        };
+
+        // entries inserted or evicted per hold of the decorated cache's lock
+        static constexpr uint64_t MAINTENANCE_STEP = 4096;
+
+        double _low_watermark;
+        double _high_watermark;
+
+        std::deque<Pending> _queue;
+        std::mutex _queue_mutex;
+        std::condition_variable _work;
+        std::condition_variable _drained;
+        bool _busy; // worker holds a batch taken from _queue
+        bool _trim_requested;
+        bool _stopping;
+
+        // Metrics
+        std::atomic<uint64_t> _queued;
+        std::atomic<uint64_t> _evicted;
+
+        std::thread _worker;
+
+        void enqueue(const K &key, const V &value, double cost, bool costed);
+
+        void apply(std::deque<Pending> &batch);
+
+        void maintain(bool trim_requested);
+
+        void run();
+
+    public:
+        explicit MaintainedCache(double low_watermark = 0.95, double high_watermark = 1.0);
+
+        ~MaintainedCache();
+
+        MaintainedCache(const MaintainedCache &) = delete;
+
+        MaintainedCache &operator=(const MaintainedCache &) = delete;
+
+        // fractions of the decorated cache's capacity
+        void set_watermarks(double low_watermark, double high_watermark);
+
+        // blocks until every queued entry is in the decorated cache and it is back within bounds
+        void flush();
+
+        uint64_t pending() {
+            std::lock_guard<std::mutex> lock(_queue_mutex);
+            return _queue.size();
+        }
+
+        uint64_t evicted() { return _evicted; }
+
+        /*
+         * Overwrite State Descriptors
+         */
+
+        double hit_rate() override { return this->_decorated_cache->hit_rate(); }
+
+        void update(int event) override { this->_decorated_cache->update(event); }
+
+        void insert(const K &key, const V &value) override { enqueue(key, value, 0, false); }
+
+        void insert_no_evict(const K &key, const V &value) override { enqueue(key, value, 0, false); }
+
+        void insert_no_evict(const K &key, const V &value, double cost) override {
+            enqueue(key, value, cost, true);
+        }
+
+        void insert_many(const std::vector<K> &keys, std::vector<V> &values, const std::vector<double> &costs) override;
+
+        void trim() override;
+
+        uint64_t trim_to(uint64_t size, uint64_t max_entries) override {
+            return this->_decorated_cache->trim_to(size, max_entries);
+        }
+
+        CacheHandle<V> find(const K &key) override {
+            return this->_decorated_cache->find(key);
+        }
+
+        V &at(const K &key) override { return this->_decorated_cache->at(key); }
+
+        CacheHandle<V> lookup(const K &key) override {
+            return this->_decorated_cache->lookup(key);
+        }
+
+        std::shared_ptr<const V> acquire(const K &key) override { return this->_decorated_cache->acquire(key); }
+
+        void find_many(const std::vector<K> &keys, std::vector<std::shared_ptr<const V> > &handles) override {
+            this->_decorated_cache->find_many(keys, handles);
+        }
+
+        V &operator[](K &key) override {
+            // a queued insert of key must land first, or the default value placed here would shadow it
+            flush();
+            return this->_decorated_cache->operator[](key);
+        }
+
+        void clear() override;
+
+        void fetch_into(const K &key, V *buff) override { this->_decorated_cache->fetch_into(key, buff); }
+
+        bool save_snapshot(const std::string &path, uint64_t fingerprint) override {
+            flush();
+            return this->_decorated_cache->save_snapshot(path, fingerprint);
+        }
+
+        void serialize(std::ostream &output) const override {
+            output << "Queued: " << _queued << " Evicted in background: " << _evicted << std::endl;
+            this->_decorated_cache->serialize(output);
+        }
+    };
+
+    template<typename K, typename V>
+    MaintainedCache<K, V>::MaintainedCache(double low_watermark, double high_watermark)
+            : _low_watermark{0}, _high_watermark{0}, _busy{false}, _trim_requested{false}, _stopping{false},
+              _queued{0}, _evicted{0} {
+        set_watermarks(low_watermark, high_watermark);
+        _worker = std::thread(&MaintainedCache<K, V>::run, this);
+    }
+
+    template<typename K, typename V>
+    MaintainedCache<K, V>::~MaintainedCache() {
+        {
+            std::lock_guard<std::mutex> lock(_queue_mutex);
+            _stopping = true;
+        }
+        _work.notify_one();
+        if (_worker.joinable())
+            _worker.join();
+    }
+
+    template<typename K, typename V>
+    void MaintainedCache<K, V>::set_watermarks(double low_watermark, double high_watermark) {
+        if (high_watermark <= 0 || low_watermark <= 0 || low_watermark > high_watermark) {
+            log_warn("Cache watermarks must satisfy 0 < low <= high, using 0.95 and 1.0.");
+            low_watermark = 0.95;
+            high_watermark = 1.0;
+        }
+        std::lock_guard<std::mutex> lock(_queue_mutex);
+        _low_watermark = low_watermark;
+        _high_watermark = high_watermark;
+    }
+
+    template<typename K, typename V>
+    void MaintainedCache<K, V>::enqueue(const K &key, const V &value, double cost, bool costed) {
+        {
+            std::lock_guard<std::mutex> lock(_queue_mutex);
+            _queue.push_back(Pending{key, value, cost, costed});
+        }
+        _queued++;
+        _work.notify_one();
+    }
+
+    template<typename K, typename V>
+    void MaintainedCache<K, V>::insert_many(const std::vector<K> &keys, std::vector<V> &values,
+                                            const std::vector<double> &costs) {
+        {
+            std::lock_guard<std::mutex> lock(_queue_mutex);
+            for (uint64_t i = 0; i < keys.size(); i++)
+                _queue.push_back(Pending{keys[i], std::move(values[i]), costs[i], true});
+        }
+        _queued += keys.size();
+        _work.notify_one();
+    }
+
+    template<typename K, typename V>
+    void MaintainedCache<K, V>::trim() {
+        {
+            std::lock_guard<std::mutex> lock(_queue_mutex);
+            _trim_requested = true;
+        }
+        _work.notify_one();
+    }
+
+    template<typename K, typename V>
+    void MaintainedCache<K, V>::flush() {
+        std::unique_lock<std::mutex> lock(_queue_mutex);
+        _drained.wait(lock, [this] { return (_queue.empty() && !_busy && !_trim_requested) || _stopping; });
+    }
+
+    template<typename K, typename V>
+    void MaintainedCache<K, V>::clear() {
+        // drop what is queued and wait out the batch in flight so it does not land after the clear
+        std::unique_lock<std::mutex> lock(_queue_mutex);
+        _queue.clear();
+        _drained.wait(lock, [this] { return !_busy || _stopping; });
+        this->_decorated_cache->clear();
+    }
+
+    template<typename K, typename V>
+    void MaintainedCache<K, V>::apply(std::deque<Pending> &batch) {
+        std::vector<K> keys;
+        std::vector<V> values;
+        std::vector<double> costs;
+        keys.reserve(std::min<uint64_t>(batch.size(), MAINTENANCE_STEP));
+        values.reserve(keys.capacity());
+        costs.reserve(keys.capacity());
+        auto flush_run = [&]() {
+            if (keys.empty())
+                return;
+            this->_decorated_cache->insert_many(keys, values, costs);
+            keys.clear();
+            values.clear();
+            costs.clear();
+        };
+        for (auto &p : batch) {
+            if (!p.costed) {
+                // policies without costs keep their own default for cost-blind inserts
+                flush_run();
+                this->_decorated_cache->insert_no_evict(p.key, p.value);
+                continue;
+            }
+            keys.emplace_back(std::move(p.key));
+            values.emplace_back(std::move(p.value));
+            costs.emplace_back(p.cost);
+            if (keys.size() >= MAINTENANCE_STEP)
+                flush_run();
+        }
+        flush_run();
+    }
+
+    template<typename K, typename V>
+    void MaintainedCache<K, V>::maintain(bool trim_requested) {
+        double low, high;
+        {
+            std::lock_guard<std::mutex> lock(_queue_mutex);
+            low = _low_watermark;
+            high = _high_watermark;
+        }
+        uint64_t capacity = this->_decorated_cache->capacity();
+        uint64_t size = this->_decorated_cache->size();
+        uint64_t target;
+        if (size > capacity * high)
+            target = capacity * low;
+        else if (trim_requested)
+            target = capacity * high; // only the byte budget can be over
+        else
+            return;
+        uint64_t evicted;
+        do {
+            evicted = this->_decorated_cache->trim_to(target, MAINTENANCE_STEP);
+            _evicted += evicted;
+        } while (evicted == MAINTENANCE_STEP);
+    }
+
+    template<typename K, typename V>
+    void MaintainedCache<K, V>::run() {
+        std::deque<Pending> batch;
+        std::unique_lock<std::mutex> lock(_queue_mutex);
+        while (true) {
+            _work.wait(lock, [this] { return _stopping || !_queue.empty() || _trim_requested; });
+            if (_stopping)
+                break;
+            batch.swap(_queue);
+            bool trim_requested = _trim_requested;
+            _trim_requested = false;
+            _busy = true;
+            lock.unlock();
+
+            if (this->_decorated_cache) {
+                apply(batch);
+                maintain(trim_requested || !batch.empty());
+            }
+            batch.clear();
+
+            lock.lock();
+            _busy = false;
+            _drained.notify_all();
+        }
+        _drained.notify_all();
+    }
+}
+
+#endif //SEALM_MAINTAINED_CACHE_HPP
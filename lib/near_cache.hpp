@@ -0,0 +1,433 @@
+#ifndef SEALM_NEAR_CACHE_HPP
+#define SEALM_NEAR_CACHE_HPP
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <unordered_set>
+
+#include "cache.hpp"
+#include "snapshot.hpp"
+
+namespace SeAlM {
+
+/*
+ * SIMILAR KEY CACHE
+ *
+ * Base of decorators that find a cached key similar to a key that missed, so the value cached
+ * for it can be adapted rather than recomputed. Keys are indexed as they are inserted and
+ * unindexed through the decorated cache's eviction callback, so the index never points at an
+ * entry the cache no longer holds. A lookup this index cannot answer is passed on to the
+ * decorated cache, which lets similarity decorators be stacked.
+ */
+
+    template<typename K, typename V>
+    class SimilarKeyCache : public CacheDecorator<K, V> {
+        static_assert(snapshot_storable<K>, "similar keys are compared as raw bytes");
+
+    protected:
+        std::unordered_set<K> _keys; // node based, indexes point into it
+        uint64_t _index_bytes;
+
+        // Metrics, near probes also count as hits or misses in the decorated cache
+        std::atomic<uint64_t> _near_hits;
+        std::atomic<uint64_t> _near_probe_misses;
+
+        // Listener for entries evicted from the decorated cache
+        std::function<void(const K &, const V &)> _eviction_callback;
+
+        // add or remove a key held in _keys, caller holds _cache_mutex
+        virtual void index(const K &stored) = 0;
+
+        virtual void unindex(const K &stored) = 0;
+
+        virtual void clear_index() = 0;
+
+        // best indexed key for key other than key itself, caller holds _cache_mutex
+        virtual bool nearest(const K &key, K &match) = 0;
+
+        void add(const K &key);
+
+        void remove(const K &key);
+
+    public:
+        SimilarKeyCache() : _index_bytes{0}, _near_hits{0}, _near_probe_misses{0} {}
+
+        ~SimilarKeyCache();
+
+        SimilarKeyCache(const SimilarKeyCache &) = delete;
+
+        SimilarKeyCache &operator=(const SimilarKeyCache &) = delete;
+
+        void set_cache(std::shared_ptr<CacheIndex<K, V> > &cache) override;
+
+        /*
+         * Overwrite State Descriptors
+         */
+
+        double hit_rate() override {
+            uint64_t h = hits(), m = misses();
+            return m > 0 ? static_cast<double>(h) / (h + m) : 0;
+        }
+
+        // exact hits only
+        uint64_t hits() override { return this->_decorated_cache->hits() - _near_hits; }
+
+        uint64_t misses() override { return this->_decorated_cache->misses() - _near_probe_misses; }
+
+        // similar keys found and still cached, whether or not their value was used
+        uint64_t near_hits() { return _near_hits; }
+
+        uint64_t bytes() override {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            return this->_decorated_cache->bytes() + _index_bytes;
+        }
+
+        void update(int event) override { this->_decorated_cache->update(event); }
+
+        // indexed first so an immediate eviction finds the key, then unindexed again if the decorated
+        // cache turned the entry away (admission filters drop entries without an eviction callback)
+        void insert(const K &key, const V &value) override {
+            add(key);
+            this->_decorated_cache->insert(key, value);
+            if (!this->_decorated_cache->contains(key))
+                remove(key);
+        }
+
+        void insert_no_evict(const K &key, const V &value) override {
+            add(key);
+            this->_decorated_cache->insert_no_evict(key, value);
+            if (!this->_decorated_cache->contains(key))
+                remove(key);
+        }
+
+        void insert_no_evict(const K &key, const V &value, double cost) override {
+            add(key);
+            this->_decorated_cache->insert_no_evict(key, value, cost);
+            if (!this->_decorated_cache->contains(key))
+                remove(key);
+        }
+
+        void insert_many(const std::vector<K> &keys, std::vector<V> &values, const std::vector<double> &costs) override {
+            for (auto &key : keys)
+                add(key);
+            this->_decorated_cache->insert_many(keys, values, costs);
+            for (auto &key : keys)
+                if (!this->_decorated_cache->contains(key))
+                    remove(key);
+        }
+
+        void trim() override { this->_decorated_cache->trim(); }
+
+        uint64_t trim_to(uint64_t size, uint64_t max_entries) override {
+            return this->_decorated_cache->trim_to(size, max_entries);
+        }
+
+        CacheHandle<V> find(const K &key) override {
+            return this->_decorated_cache->find(key);
+        }
+
+        V &at(const K &key) override { return this->_decorated_cache->at(key); }
+
+        CacheHandle<V> lookup(const K &key) override {
+            return this->_decorated_cache->lookup(key);
+        }
+
+        std::shared_ptr<const V> acquire(const K &key) override { return this->_decorated_cache->acquire(key); }
+
+        CacheHandle<V> lookup_near(const K &key, K &match) override;
+
+        V &operator[](K &key) override { return this->_decorated_cache->operator[](key); }
+
+        void clear() override;
+
+        void fetch_into(const K &key, V *buff) override { this->_decorated_cache->fetch_into(key, buff); }
+
+        void set_eviction_callback(std::function<void(const K &, const V &)> callback) override {
+            _eviction_callback = std::move(callback);
+        }
+
+        // loaded entries are inserted through this cache so they are indexed
+        uint64_t load_snapshot(const std::string &path, uint64_t fingerprint) override {
+            return CacheIndex<K, V>::load_snapshot(path, fingerprint);
+        }
+
+        void serialize(std::ostream &output) const override {
+            this->_decorated_cache->serialize(output);
+            output << "Near Hits: " << _near_hits << std::endl;
+        }
+    };
+
+    template<typename K, typename V>
+    SimilarKeyCache<K, V>::~SimilarKeyCache() {
+        // the decorated cache may outlive this one
+        if (this->_decorated_cache)
+            this->_decorated_cache->set_eviction_callback(nullptr);
+    }
+
+    template<typename K, typename V>
+    void SimilarKeyCache<K, V>::set_cache(std::shared_ptr<CacheIndex<K, V> > &cache) {
+        this->_decorated_cache = cache;
+        this->_decorated_cache->set_eviction_callback([this](const K &key, const V &value) {
+            this->remove(key);
+            if (this->_eviction_callback)
+                this->_eviction_callback(key, value);
+        });
+    }
+
+    template<typename K, typename V>
+    void SimilarKeyCache<K, V>::add(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto inserted = _keys.insert(key);
+        if (inserted.second)
+            index(*inserted.first);
+    }
+
+    template<typename K, typename V>
+    void SimilarKeyCache<K, V>::remove(const K &key) {
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        auto it = _keys.find(key);
+        if (it == _keys.end())
+            return;
+        unindex(*it);
+        _keys.erase(it);
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> SimilarKeyCache<K, V>::lookup_near(const K &key, K &match) {
+        bool found;
+        {
+            std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+            found = nearest(key, match);
+        }
+        if (!found)
+            return this->_decorated_cache->lookup_near(key, match);
+        // not under _cache_mutex, the decorated cache may evict and call back into the index
+        auto cached = this->_decorated_cache->lookup(match);
+        cached ? _near_hits++ : _near_probe_misses++;
+        return cached;
+    }
+
+    template<typename K, typename V>
+    void SimilarKeyCache<K, V>::clear() {
+        this->_decorated_cache->clear();
+        std::lock_guard<CacheMutex> lock(this->_cache_mutex);
+        clear_index();
+        _keys.clear();
+        _index_bytes = 0;
+    }
+
+/*
+ * NEAR MATCH CACHE
+ *
+ * Finds a cached key within a few mismatches of a key that missed, so a read that differs from
+ * a cached read by a sequencing error can reuse its alignment once it has been verified. Keys
+ * are compared byte for byte, which bounds base mismatches for plain and 2-bit packed keys
+ * alike since a base never spans two bytes.
+ *
+ * Pigeonhole signatures: a key split into d + 1 segments shares at least one segment exactly
+ * with any key of the same length within d mismatches, so each cached key is indexed under
+ * the hash of each of its segments and a near lookup only compares against keys sharing one.
+ */
+
+    template<typename K, typename V>
+    class NearMatchCache : public SimilarKeyCache<K, V> {
+    private:
+        uint8_t _max_mismatches;
+        uint32_t _max_candidates; // compared per lookup, bounds the cost of low complexity keys
+
+        std::unordered_multimap<uint64_t, const K *> _signatures;
+
+        uint64_t signature(std::string_view key, uint8_t segment) const;
+
+        uint64_t entry_bytes(const K &key) const {
+            return byte_size(key) + (_max_mismatches + 1) * (sizeof(uint64_t) + sizeof(const K *));
+        }
+
+    protected:
+        void index(const K &stored) override;
+
+        void unindex(const K &stored) override;
+
+        void clear_index() override { _signatures.clear(); }
+
+        bool nearest(const K &key, K &match) override;
+
+    public:
+        explicit NearMatchCache(uint8_t max_mismatches = 1, uint32_t max_candidates = 64)
+                : _max_mismatches{std::max<uint8_t>(max_mismatches, 1)}, _max_candidates{max_candidates} {}
+
+        uint8_t max_mismatches() { return _max_mismatches; }
+    };
+
+    template<typename K, typename V>
+    uint64_t NearMatchCache<K, V>::signature(std::string_view key, uint8_t segment) const {
+        uint64_t parts = _max_mismatches + 1;
+        uint64_t begin = key.size() * segment / parts;
+        uint64_t end = key.size() * (segment + 1) / parts;
+        // keys of different lengths never match, so the length is part of every signature
+        uint64_t header[2] = {key.size(), segment};
+        uint64_t hash = stable_hash(std::string_view(reinterpret_cast<const char *>(header), sizeof(header)));
+        return stable_hash(key.substr(begin, end - begin), hash);
+    }
+
+    template<typename K, typename V>
+    void NearMatchCache<K, V>::index(const K &stored) {
+        for (uint8_t s = 0; s <= _max_mismatches; s++) {
+            _signatures.emplace(signature(snapshot_view(stored), s), &stored);
+        }
+        this->_index_bytes += entry_bytes(stored);
+    }
+
+    template<typename K, typename V>
+    void NearMatchCache<K, V>::unindex(const K &stored) {
+        for (uint8_t s = 0; s <= _max_mismatches; s++) {
+            auto range = _signatures.equal_range(signature(snapshot_view(stored), s));
+            for (auto sig = range.first; sig != range.second; sig++) {
+                if (sig->second == &stored) {
+                    _signatures.erase(sig);
+                    break;
+                }
+            }
+        }
+        this->_index_bytes -= entry_bytes(stored);
+    }
+
+    template<typename K, typename V>
+    bool NearMatchCache<K, V>::nearest(const K &key, K &match) {
+        std::string_view bytes = snapshot_view(key);
+        const K *best = nullptr;
+        uint32_t best_distance = _max_mismatches + 1;
+        uint32_t compared = 0;
+        for (uint8_t s = 0; s <= _max_mismatches && compared < _max_candidates; s++) {
+            auto range = _signatures.equal_range(signature(bytes, s));
+            for (auto sig = range.first; sig != range.second && compared < _max_candidates; sig++) {
+                std::string_view other = snapshot_view(*sig->second);
+                if (other.size() != bytes.size())
+                    continue; // signature collision
+                compared++;
+                uint32_t distance = 0;
+                for (size_t i = 0; i < bytes.size() && distance < best_distance; i++) {
+                    distance += bytes[i] != other[i];
+                }
+                // distance 0 is the key itself, which the exact lookup already missed
+                if (distance > 0 && distance < best_distance) {
+                    best = sig->second;
+                    best_distance = distance;
+                }
+            }
+        }
+        if (best == nullptr)
+            return false;
+        match = *best;
+        return true;
+    }
+
+/*
+ * CONTAINMENT CACHE
+ *
+ * Finds a cached key that contains a key that missed, so a read trimmed from a longer read
+ * that is already cached can reuse that read's alignment. Cached keys are indexed by the
+ * hash of their ANCHOR_BYTES long substrings at every step'th offset. Whatever its offset in
+ * a cached key, a key at least ANCHOR_BYTES + step - 1 long has one of its first step
+ * substrings aligned with an indexed anchor, so a lookup hashes those and checks each key
+ * they point to. Keys are compared as bytes, so this is meant for plain sequence keys.
+ */
+
+    template<typename K, typename V>
+    class ContainmentCache : public SimilarKeyCache<K, V> {
+    public:
+        static constexpr uint32_t ANCHOR_BYTES = 16;
+
+    private:
+        struct Anchor {
+            const K *key;
+            uint32_t offset;
+        };
+
+        uint32_t _step;
+        uint32_t _max_candidates;
+
+        std::unordered_multimap<uint64_t, Anchor> _anchors;
+
+        uint64_t anchors(const K &key) const {
+            uint64_t size = snapshot_view(key).size();
+            return size < ANCHOR_BYTES ? 0 : (size - ANCHOR_BYTES) / _step + 1;
+        }
+
+        uint64_t entry_bytes(const K &key) const {
+            return byte_size(key) + anchors(key) * (sizeof(uint64_t) + sizeof(Anchor));
+        }
+
+    protected:
+        void index(const K &stored) override;
+
+        void unindex(const K &stored) override;
+
+        void clear_index() override { _anchors.clear(); }
+
+        bool nearest(const K &key, K &match) override;
+
+    public:
+        explicit ContainmentCache(uint32_t step = 8, uint32_t max_candidates = 64)
+                : _step{std::max<uint32_t>(step, 1)}, _max_candidates{max_candidates} {}
+
+        // shortest key a lookup can find
+        uint32_t min_length() { return ANCHOR_BYTES + _step - 1; }
+    };
+
+    template<typename K, typename V>
+    void ContainmentCache<K, V>::index(const K &stored) {
+        std::string_view bytes = snapshot_view(stored);
+        for (uint64_t a = 0; a < anchors(stored); a++) {
+            uint32_t offset = a * _step;
+            _anchors.emplace(stable_hash(bytes.substr(offset, ANCHOR_BYTES)), Anchor{&stored, offset});
+        }
+        this->_index_bytes += entry_bytes(stored);
+    }
+
+    template<typename K, typename V>
+    void ContainmentCache<K, V>::unindex(const K &stored) {
+        std::string_view bytes = snapshot_view(stored);
+        for (uint64_t a = 0; a < anchors(stored); a++) {
+            uint32_t offset = a * _step;
+            auto range = _anchors.equal_range(stable_hash(bytes.substr(offset, ANCHOR_BYTES)));
+            for (auto anchor = range.first; anchor != range.second; anchor++) {
+                if (anchor->second.key == &stored && anchor->second.offset == offset) {
+                    _anchors.erase(anchor);
+                    break;
+                }
+            }
+        }
+        this->_index_bytes -= entry_bytes(stored);
+    }
+
+    template<typename K, typename V>
+    bool ContainmentCache<K, V>::nearest(const K &key, K &match) {
+        std::string_view bytes = snapshot_view(key);
+        if (bytes.size() < min_length())
+            return false;
+        // the shortest containing key wastes the least of its alignment
+        const K *best = nullptr;
+        uint32_t compared = 0;
+        for (uint32_t q = 0; q < _step && compared < _max_candidates; q++) {
+            auto range = _anchors.equal_range(stable_hash(bytes.substr(q, ANCHOR_BYTES)));
+            for (auto anchor = range.first; anchor != range.second && compared < _max_candidates; anchor++) {
+                std::string_view other = snapshot_view(*anchor->second.key);
+                if (anchor->second.offset < q || other.size() <= bytes.size() ||
+                    anchor->second.offset - q + bytes.size() > other.size())
+                    continue;
+                compared++;
+                if (std::memcmp(other.data() + anchor->second.offset - q, bytes.data(), bytes.size()) == 0 &&
+                    (best == nullptr || other.size() < snapshot_view(*best).size()))
+                    best = anchor->second.key;
+            }
+        }
+        if (best == nullptr)
+            return false;
+        match = *best;
+        return true;
+    }
+}
+
+#endif //SEALM_NEAR_CACHE_HPP
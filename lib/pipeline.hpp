@@ -10,6 +10,7 @@
 #include <queue>
 #include "types.hpp"
 #include "cache.hpp"
+#include "cache_stats.hpp"
 #include "io.hpp"
 
 namespace SeAlM {
@@ -43,8 +44,20 @@ namespace SeAlM {
         // extract key from data or transform data into key, may convert key
         virtual K _extract_key_fn(T &d) = 0;
 
-        // transform data and/or value to string for writing to file
-        virtual PreHashedString _postprocess_fn(T &d, V &v) = 0;
+        // transform data and/or value to string for writing to file, v may be shared with the cache
+        virtual PreHashedString _postprocess_fn(T &d, const V &v) = 0;
+
+        // _postprocess_fn into out, which the pipeline reuses from line to line so its storage can be too
+        virtual void _postprocess_into_fn(T &d, const V &v, PreHashedString &out) { out = _postprocess_fn(d, v); }
+
+        // value kept in the cache for newly aligned data, may drop what can be rebuilt from the data
+        virtual V _cache_value_fn(T &, V &v) { return v; }
+
+        // cost of recomputing v if it is evicted, given the read's share of the batch align time
+        virtual double _cost_fn(T &, V &, double align_share) { return align_share; }
+
+        // value for d adapted from v, which was cached for the similar key match, false if it cannot be verified
+        virtual bool _adapt_fn(T &, const K &, V &, V &) { return false; }
     };
 
 
@@ -64,18 +77,26 @@ namespace SeAlM {
         // Global cache variables
         // TODO implement cross-only compression for caching
         std::shared_ptr<CacheIndex<K, V> > _cache_subsystem;
+        CacheStats<K> _cache_stats;
 
         // Current bucket data structures
         std::vector<T> _current_bucket;
         std::vector<T> _unique_entries;
         std::vector<std::pair<uint64_t, uint64_t> > _multiplexer; // file id, value lookup
+        std::queue<std::shared_ptr<const V> > _current_cache_hits; // values found in cache when bucket was read
 
         // Lock free I/O buffers
         std::queue<std::unique_ptr<std::vector<T> > > _bucket_buffer;
         std::queue<std::unique_ptr<std::vector<std::pair<uint64_t, uint64_t> > > > _multiplexer_buffer;
-        std::queue<std::unique_ptr<std::queue<V> > > _cached_values;
+        std::queue<std::unique_ptr<std::queue<std::shared_ptr<const V> > > > _cached_values;
         std::queue<uint64_t> _prev_bucket_sizes;
         std::queue<double> _prev_compression_ratios;
+        double _batch_align_time; // aligner seconds spent on the bucket being written
+        std::atomic<uint64_t> _near_hits; // values adapted from a similar key's rather than aligned
+
+        // Cache persistence
+        std::string _snapshot_path; // written on close() if set
+        uint64_t _snapshot_fingerprint;
 
         // Compression variables
         CompressionLevel _compression_level;
@@ -89,6 +110,13 @@ namespace SeAlM {
 
         // Data processing functions template
         std::shared_ptr<DataProcessor<T, K, V> > _processor;
+
+        // queues a handle to the cached value for data, or one adapted from a similar key's, false if neither
+        bool lookup_cached(T &data, const K &key, std::queue<std::shared_ptr<const V> > &hits);
+
+        // lookup_cached with the exact probe already made (e.g. by a batch), cached is null if it missed
+        bool queue_cached(T &data, const K &key, std::shared_ptr<const V> cached,
+                          std::queue<std::shared_ptr<const V> > &hits);
     public:
         /*
          * Constructors
@@ -96,6 +124,8 @@ namespace SeAlM {
 
         BucketedPipelineManager();
 
+        ~BucketedPipelineManager();
+
         /*
          * Subprocess Initialization
          */
@@ -130,12 +160,19 @@ namespace SeAlM {
 
         void set_compression_level(CompressionLevel cl) { _compression_level = cl; }
 
-        void set_cache_subsystem(std::shared_ptr<CacheIndex<K, V> > &other) { _cache_subsystem = other; }
+        void set_cache_subsystem(std::shared_ptr<CacheIndex<K, V> > &other);
 
         void set_io_subsystem(std::shared_ptr<InterleavedIOScheduler<T> > &other) { _io_subsystem = other; }
 
         void set_processor(std::shared_ptr<DataProcessor<T, K, V> > &other) { _processor = other; }
 
+        void set_batch_align_time(double seconds) { _batch_align_time = seconds; }
+
+        void set_cache_snapshot(const std::string &path, uint64_t fingerprint) {
+            _snapshot_path = path;
+            _snapshot_fingerprint = fingerprint;
+        }
+
         /*
          * State Descriptors
          */
@@ -168,6 +205,18 @@ namespace SeAlM {
 
         uint64_t cache_misses() { return _cache_subsystem->misses(); }
 
+        uint64_t near_hits() { return _near_hits; }
+
+        CacheStats<K> &cache_stats() { return _cache_stats; }
+
+        uint64_t cache_lock_wait_ns() { return _cache_subsystem->lock_wait_ns(); }
+
+        // average footprint of a cached entry, 0 while the cache is empty
+        double cache_entry_bytes() {
+            uint64_t entries = _cache_subsystem->size();
+            return entries > 0 ? static_cast<double>(_cache_subsystem->bytes()) / entries : 0;
+        }
+
         uint64_t capacity() { return _io_subsystem->capacity(); }
 
         /*
@@ -190,9 +239,29 @@ namespace SeAlM {
     BucketedPipelineManager<T, K, V>::BucketedPipelineManager() {
         _compression_level = NONE;
         _pipe_clear_flag = false;
+        _batch_align_time = 0;
+        _near_hits = 0;
+        _snapshot_fingerprint = 0;
         _cache_subsystem = std::make_shared<DummyCache<K, V> >();
     }
 
+    template<typename T, typename K, typename V>
+    BucketedPipelineManager<T, K, V>::~BucketedPipelineManager() {
+        // the cache may outlive the pipeline
+        if (_cache_subsystem)
+            _cache_subsystem->set_eviction_callback(nullptr);
+    }
+
+    template<typename T, typename K, typename V>
+    void BucketedPipelineManager<T, K, V>::set_cache_subsystem(std::shared_ptr<CacheIndex<K, V> > &other) {
+        if (_cache_subsystem)
+            _cache_subsystem->set_eviction_callback(nullptr);
+        _cache_subsystem = other;
+        _cache_subsystem->set_eviction_callback([this](const K &key, const V &) {
+            _cache_stats.record_eviction(key);
+        });
+    }
+
     template<typename T, typename K, typename V>
     void BucketedPipelineManager<T, K, V>::set_params(PipelineParams &params) {
         _io_subsystem->set_input_pattern(params.input_file_pattern);
@@ -205,6 +274,33 @@ namespace SeAlM {
         _pipe_clear_flag = true;
     }
 
+    template<typename T, typename K, typename V>
+    bool BucketedPipelineManager<T, K, V>::lookup_cached(T &data, const K &key,
+                                                         std::queue<std::shared_ptr<const V> > &hits) {
+        return queue_cached(data, key, _cache_subsystem->acquire(key), hits);
+    }
+
+    template<typename T, typename K, typename V>
+    bool BucketedPipelineManager<T, K, V>::queue_cached(T &data, const K &key, std::shared_ptr<const V> cached,
+                                                        std::queue<std::shared_ptr<const V> > &hits) {
+        // the handle keeps the value alive until it is written, even if it is evicted meanwhile
+        if (cached) {
+            hits.push(std::move(cached));
+            return true;
+        }
+        // a similar key's value is only used once the processor has verified it for this data
+        K match;
+        if (auto near = _cache_subsystem->lookup_near(key, match)) {
+            V adapted;
+            if (this->_processor->_adapt_fn(data, match, near->get(), adapted)) {
+                hits.push(std::make_shared<const V>(std::move(adapted)));
+                _near_hits++;
+                return true;
+            }
+        }
+        return false;
+    }
+
     template<typename T, typename K, typename V>
     std::vector<T> BucketedPipelineManager<T, K, V>::read() {
         std::lock_guard<std::mutex> lock(_pipe_mutex);
@@ -224,7 +320,7 @@ namespace SeAlM {
                     // extract data
                     _current_bucket[i] = mtpx_item.second;
                     key = this->_processor->_extract_key_fn(_current_bucket[i]);
-                    if (_cache_subsystem->find(key) != _cache_subsystem->end()) {
+                    if (lookup_cached(_current_bucket[i], key, _current_cache_hits)) {
                         // if not duplicate but found in cache (or duplicate but all exist in cache), flag for lookup later
                         _multiplexer[i] = std::make_pair(mtpx_item.first, UINT64_MAX);
                     } else {
@@ -259,7 +355,7 @@ namespace SeAlM {
                             default:
                                 break;
                         }
-                    } else if (_cache_subsystem->find(key) != _cache_subsystem->end()) {
+                    } else if (lookup_cached(_current_bucket[i], key, _current_cache_hits)) {
                         // if not duplicate but found in cache (or duplicate but all exist in cache), flag for lookup later
                         _multiplexer[i] = std::make_pair(mtpx_item.first, UINT64_MAX);
                     } else {
@@ -296,19 +392,34 @@ namespace SeAlM {
         std::vector<T> unique_entries;
         auto temp_bucket = std::make_unique<std::vector<T> >();
         auto temp_multiplexer = std::make_unique<std::vector<std::pair<uint64_t, uint64_t>>>();
-        auto temp_cache_hits = std::make_unique<std::queue<V> >();
+        auto temp_cache_hits = std::make_unique<std::queue<std::shared_ptr<const V> > >();
 
         temp_bucket->resize(next_bucket->size());
         temp_multiplexer->resize(next_bucket->size());
 
+        // extract data (separate from file id) and probe the cache for the whole bucket at once
+        std::vector<K> keys(next_bucket->size());
+        std::vector<uint64_t> files(next_bucket->size());
+        std::vector<std::shared_ptr<const V> > cached;
         uint64_t i = 0;
+        for (const auto &mtpx_item : *next_bucket) {
+            (*temp_bucket)[i] = mtpx_item.second;
+            keys[i] = this->_processor->_extract_key_fn((*temp_bucket)[i]);
+            files[i] = mtpx_item.first;
+            i++;
+        }
+        _cache_subsystem->find_many(keys, cached);
+
+        std::vector<bool> found(cached.size());
+        for (i = 0; i < cached.size(); i++)
+            found[i] = static_cast<bool>(cached[i]);
+        _cache_stats.record_probes(keys, found, files, _io_subsystem->last_bucket_chain());
+
+        i = 0;
         // V *tmp = nullptr;
-        K key;
         if (_compression_level == CompressionLevel::NONE) {
             for (const auto &mtpx_item : *next_bucket) {
-                // extract data
-                (*temp_bucket)[i] = mtpx_item.second;
-                key = this->_processor->_extract_key_fn((*temp_bucket)[i]);
+                const K &key = keys[i];
 //            _cache_subsystem->fetch_into(this->_processor->_extract_key_fn((*temp_bucket)[i]), tmp);
 //            if (tmp != nullptr){
 //                (*temp_multiplexer)[i] = std::make_pair(mtpx_item.first, UINT64_MAX);
@@ -318,11 +429,9 @@ namespace SeAlM {
 //                (*temp_multiplexer)[i] = std::make_pair(mtpx_item.first, unique_entries.size() - 1);
 //            }
 
-                if (_cache_subsystem->find(key) != _cache_subsystem->end()) {
-                    // TODO make this atomic
+                if (queue_cached((*temp_bucket)[i], key, std::move(cached[i]), *temp_cache_hits)) {
                     // if not duplicate but found in cache (or duplicate but all exist in cache), flag for lookup later
                     (*temp_multiplexer)[i] = std::make_pair(mtpx_item.first, UINT64_MAX);
-                    temp_cache_hits->push(_cache_subsystem->at(key));
                 } else {
                     // unique, non-cached value return as part of compressed bucket
                     unique_entries.emplace_back(mtpx_item.second);
@@ -331,13 +440,11 @@ namespace SeAlM {
                 i++;
             }
         } else {
-            // extract data (separate from file id) and compress
+            // compress
 
             // TODO add locking for cache lookup and inserting
             for (const auto &mtpx_item : *next_bucket) {
-                // extract data
-                (*temp_bucket)[i] = mtpx_item.second;
-                key = this->_processor->_extract_key_fn((*temp_bucket)[i]);
+                const K &key = keys[i];
                 if (duplicate_finder.find(key) != duplicate_finder.end()) {
                     // duplicate found, handle according to compression level
                     switch (_compression_level) {
@@ -369,11 +476,9 @@ namespace SeAlM {
 //                    (*temp_multiplexer)[i] = std::make_pair(mtpx_item.first, unique_entries.size() - 1);
 //                }
 
-                    if (_cache_subsystem->find(key) != _cache_subsystem->end()) {
-                        // TODO make this atomic
+                    if (queue_cached((*temp_bucket)[i], key, std::move(cached[i]), *temp_cache_hits)) {
                         // if not duplicate but found in cache (or duplicate but all exist in cache), flag for lookup later
                         (*temp_multiplexer)[i] = std::make_pair(mtpx_item.first, UINT64_MAX);
-                        temp_cache_hits->push(_cache_subsystem->at(key));
                     } else {
                         // unique, non-cached value return as part of compressed bucket
                         unique_entries.emplace_back(mtpx_item.second);
@@ -426,18 +531,23 @@ namespace SeAlM {
             PreHashedString line_out;
             // should have exactly as many unique enties as values
             assert(_unique_entries.size() == out.size());
+            double align_share = _unique_entries.empty() ? 0 : _batch_align_time / _unique_entries.size();
             // de-multiplex using multiplexer built when reading
-            K key;
             for (uint64_t i = 0; i < _current_bucket.size(); i++) {
-                key = _encode(this->_processor->_extract_key_fn(_current_bucket[i]));
                 if (_multiplexer[i].second == UINT64_MAX) {
-                    // found in cache earlier, report cached value
-                    line_out = this->_processor->_postprocess_fn(_current_bucket[i], _cache_subsystem->at(key));
+                    // found in cache earlier, report value retrieved when reading
+                    this->_processor->_postprocess_into_fn(_current_bucket[i], *_current_cache_hits.front(), line_out);
+                    _current_cache_hits.pop();
                     _io_subsystem->write_async(_multiplexer[i].first, line_out);
                 } else {
                     // otherwise, write value indicated by multiplexer
-                    line_out = this->_processor->_postprocess_fn(_current_bucket[i], out[_multiplexer[i].second]);
-                    _cache_subsystem->insert_no_evict(key, out[_multiplexer[i].second]);
+                    this->_processor->_postprocess_into_fn(_current_bucket[i], out[_multiplexer[i].second], line_out);
+                    _cache_subsystem->insert_no_evict(this->_processor->_extract_key_fn(_current_bucket[i]),
+                                                      this->_processor->_cache_value_fn(_current_bucket[i],
+                                                                                        out[_multiplexer[i].second]),
+                                                      this->_processor->_cost_fn(_current_bucket[i],
+                                                                                 out[_multiplexer[i].second],
+                                                                                 align_share));
                     _io_subsystem->write_async(_multiplexer[i].first, line_out);
                 }
             }
@@ -468,25 +578,41 @@ namespace SeAlM {
             // assert(_unique_entries.size() == out.size()); have to ignore for lock free
             // de-multiplex using multiplexer built when reading
 
+            // values are indexed by unique entry, so the highest index gives the number aligned
+            uint64_t aligned = 0;
+            for (auto &m : *temp_multiplexer) {
+                if (m.second != UINT64_MAX)
+                    aligned = std::max(aligned, m.second + 1);
+            }
+            double align_share = aligned > 0 ? _batch_align_time / aligned : 0;
+
+            // newly aligned values are cached as one batch once the bucket is written
+            std::vector<K> miss_keys;
+            std::vector<V> miss_values;
+            std::vector<double> miss_costs;
+
             // long w_start = std::chrono::duration_cast<Mills>(std::chrono::system_clock::now().time_since_epoch()).count();
             for (uint64_t i = 0; i < temp_bucket->size(); i++) {
                 if ((*temp_multiplexer)[i].second == UINT64_MAX) {
                     // found in cache earlier, report cached value
-                    line_out = this->_processor->_postprocess_fn((*temp_bucket)[i], temp_cache_hits->front());
+                    this->_processor->_postprocess_into_fn((*temp_bucket)[i], *temp_cache_hits->front(), line_out);
                     temp_cache_hits->pop();
                     _io_subsystem->write_async((*temp_multiplexer)[i].first, line_out);
                 } else {
                     // otherwise, write value indicated by multiplexer
-                    line_out = this->_processor->_postprocess_fn((*temp_bucket)[i], out[(*temp_multiplexer)[i].second]);
+                    V &value = out[(*temp_multiplexer)[i].second];
+                    this->_processor->_postprocess_into_fn((*temp_bucket)[i], value, line_out);
                     _io_subsystem->write_async((*temp_multiplexer)[i].first, line_out);
-                    // TODO: figure out why this is so slow
-                    _cache_subsystem->insert_no_evict(this->_processor->_extract_key_fn((*temp_bucket)[i]),
-                                                      out[(*temp_multiplexer)[i].second]);
+                    miss_keys.emplace_back(this->_processor->_extract_key_fn((*temp_bucket)[i]));
+                    miss_values.emplace_back(this->_processor->_cache_value_fn((*temp_bucket)[i], value));
+                    miss_costs.emplace_back(this->_processor->_cost_fn((*temp_bucket)[i], value, align_share));
                 }
             }
+            _cache_stats.record_inserts(miss_keys);
+            _cache_subsystem->insert_many(miss_keys, miss_values, miss_costs);
             notify(1);
-            if (_cache_subsystem->size() > _cache_subsystem->capacity())
-                _cache_subsystem->trim();
+            // trim unconditionally, a byte budget can be exceeded before the entry limit is
+            _cache_subsystem->trim();
             // long w_end = std::chrono::duration_cast<Mills>(std::chrono::system_clock::now().time_since_epoch()).count();
             // std::cout << "Write time: " << (w_end - w_start) << std::endl;
             return true;
@@ -506,6 +632,13 @@ namespace SeAlM {
         _pipe_clear_flag = false;
         _io_subsystem->stop_reading();
         _io_subsystem->flush();
+
+        if (!_snapshot_path.empty()) {
+            if (_cache_subsystem->save_snapshot(_snapshot_path, _snapshot_fingerprint))
+                log_info("Saved " + std::to_string(_cache_subsystem->size()) + " cache entries to " + _snapshot_path);
+            else
+                log_warn("No cache snapshot saved to " + _snapshot_path);
+        }
     }
 
     template<typename T, typename K, typename V>
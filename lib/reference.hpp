@@ -0,0 +1,265 @@
+#ifndef SEALM_REFERENCE_HPP
+#define SEALM_REFERENCE_HPP
+
+#include <cctype>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <stdexcept>
+
+#include "alignment.hpp"
+
+namespace SeAlM {
+
+/*
+ *
+ *  REFERENCE GENOME
+ *
+ *  Contig sequences of a FASTA file held in memory, one byte per base and uppercased. Contigs
+ *  are named by their header up to the first whitespace, as aligners name them in RNAME.
+ *
+ */
+
+    class ReferenceGenome {
+    private:
+        std::unordered_map<std::string, std::string> _contigs;
+        uint64_t _bases;
+
+    public:
+        ReferenceGenome() : _bases{0} {}
+
+        explicit ReferenceGenome(const std::string &path);
+
+        void add_contig(const std::string &name, std::string_view seq);
+
+        // empty if the reference has no contig by that name
+        std::optional<std::string_view> contig(std::string_view name) const {
+            auto it = _contigs.find(std::string(name));
+            if (it == _contigs.end())
+                return std::nullopt;
+            return std::string_view(it->second);
+        }
+
+        uint64_t contigs() const { return _contigs.size(); }
+
+        uint64_t bases() const { return _bases; }
+    };
+
+    inline ReferenceGenome::ReferenceGenome(const std::string &path) : _bases{0} {
+        std::ifstream fin(path);
+        if (!fin.is_open())
+            throw std::runtime_error("Failed to open reference " + path);
+        std::string line;
+        std::string *current = nullptr;
+        while (std::getline(fin, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (line.empty())
+                continue;
+            if (line[0] == '>') {
+                std::string name = line.substr(1, line.find_first_of(" \t") - 1);
+                current = &_contigs[name];
+                current->clear();
+                continue;
+            }
+            if (current == nullptr)
+                throw std::runtime_error("Reference " + path + " does not start with a FASTA header");
+            for (char base : line)
+                current->push_back(std::toupper(static_cast<unsigned char>(base)));
+            _bases += line.size();
+        }
+    }
+
+    inline void ReferenceGenome::add_contig(const std::string &name, std::string_view seq) {
+        std::string &contig = _contigs[name];
+        _bases -= contig.size();
+        contig.clear();
+        for (char base : seq)
+            contig.push_back(std::toupper(static_cast<unsigned char>(base)));
+        _bases += contig.size();
+    }
+
+/*
+ *
+ *  ALIGNMENT RESCORING
+ *
+ *  Checks a cached alignment against the reference for a read that differs from the read it
+ *  was made for, and rewrites the fields that depend on the read's bases. Position and CIGAR
+ *  are kept, the alignment is only accepted if it still scores above the aligner's minimum and
+ *  above the best secondary score (XS) the aligner reported for the original read. MAPQ is
+ *  kept: a read that passes both checks is as well separated from its secondary hit as the
+ *  original was.
+ *
+ */
+
+    class AlignmentRescorer {
+    public:
+        struct Result {
+            int64_t score;
+            uint32_t mismatches;
+            uint32_t edit_distance;
+            std::string md;
+            std::vector<uint32_t> cigar;
+        };
+
+    private:
+        std::shared_ptr<const ReferenceGenome> _reference;
+        ScoringScheme _scoring;
+
+    public:
+        AlignmentRescorer(std::shared_ptr<const ReferenceGenome> reference, const ScoringScheme &scoring)
+                : _reference{std::move(reference)}, _scoring{scoring} {}
+
+        // scores SEQ and QUAL as written in a SAM line along the record's position and CIGAR,
+        // false if the CIGAR does not fit the read or runs off the contig
+        bool score(const AlignmentRecord &record, std::string_view contig, std::string_view seq,
+                   std::string_view qual, Result &result) const;
+
+        // SAM line for a read from an alignment made for a similar read, appended to out, false
+        // if the alignment does not hold for this read
+        bool rescore(const AlignmentRecord &record, std::string_view name, std::string_view seq,
+                     std::string_view qual, std::string &out) const;
+    };
+
+    inline bool AlignmentRescorer::score(const AlignmentRecord &record, std::string_view contig,
+                                         std::string_view seq, std::string_view qual, Result &result) const {
+        result.score = 0;
+        result.mismatches = 0;
+        result.edit_distance = 0;
+        result.md.clear();
+        result.cigar.clear();
+        if (record.pos < 1)
+            return false;
+        uint64_t r = record.pos - 1, q = 0;
+        uint32_t run = 0; // matching bases since the last MD mismatch or deletion
+        for (uint32_t c : record.cigar) {
+            uint32_t len = c >> 4;
+            uint8_t op = c & 0xf;
+            switch (op) {
+                case CIGAR_MATCH:
+                case CIGAR_EQUAL:
+                case CIGAR_DIFF:
+                    if (q + len > seq.size() || r + len > contig.size())
+                        return false;
+                    for (uint32_t i = 0; i < len; i++) {
+                        char base = std::toupper(static_cast<unsigned char>(seq[q + i]));
+                        char ref = contig[r + i];
+                        bool match = base == ref && base != 'N';
+                        if (match) {
+                            result.score += _scoring.match_bonus;
+                            run++;
+                        } else {
+                            // without qualities every base counts as high quality
+                            char base_qual = q + i < qual.size() ? qual[q + i] : 'I';
+                            result.score -= base == 'N' || ref == 'N' ? _scoring.n_penalty
+                                                                      : _scoring.mismatch_penalty(base_qual);
+                            result.mismatches++;
+                            detail::append_int(result.md, run);
+                            result.md.push_back(ref);
+                            run = 0;
+                        }
+                        // =/X runs are rebuilt for this read, M stays as it is
+                        if (op != CIGAR_MATCH)
+                            detail::append_cigar_op(result.cigar, 1, match ? CIGAR_EQUAL : CIGAR_DIFF);
+                    }
+                    if (op == CIGAR_MATCH)
+                        detail::append_cigar_op(result.cigar, len, op);
+                    q += len;
+                    r += len;
+                    break;
+                case CIGAR_INS:
+                    if (q + len > seq.size())
+                        return false;
+                    result.score -= _scoring.gap_penalty(len);
+                    result.edit_distance += len;
+                    detail::append_cigar_op(result.cigar, len, op);
+                    q += len;
+                    break;
+                case CIGAR_DEL:
+                    if (r + len > contig.size())
+                        return false;
+                    result.score -= _scoring.gap_penalty(len);
+                    result.edit_distance += len;
+                    detail::append_int(result.md, run);
+                    result.md.push_back('^');
+                    result.md.append(contig.substr(r, len));
+                    run = 0;
+                    detail::append_cigar_op(result.cigar, len, op);
+                    r += len;
+                    break;
+                case CIGAR_REF_SKIP:
+                    if (r + len > contig.size())
+                        return false;
+                    detail::append_cigar_op(result.cigar, len, op);
+                    r += len;
+                    break;
+                case CIGAR_SOFT_CLIP:
+                    // clipped bases score nothing, in local mode that is what clipping is for
+                    if (q + len > seq.size())
+                        return false;
+                    detail::append_cigar_op(result.cigar, len, op);
+                    q += len;
+                    break;
+                default:
+                    detail::append_cigar_op(result.cigar, len, op);
+                    break;
+            }
+        }
+        if (q != seq.size())
+            return false;
+        detail::append_int(result.md, run);
+        result.edit_distance += result.mismatches;
+        return true;
+    }
+
+    inline bool AlignmentRescorer::rescore(const AlignmentRecord &record, std::string_view name,
+                                           std::string_view seq, std::string_view qual, std::string &out) const {
+        if ((record.flag & AlignmentRecord::UNMAPPED) || record.cigar.empty())
+            return false;
+        auto contig = _reference->contig(record.rname);
+        if (!contig)
+            return false;
+
+        // the read may be the reverse complement of the one aligned (canonical keys), so both
+        // strands are scored at the cached locus and the better one kept
+        AlignmentRecord rescored = record;
+        Result best{}, other{};
+        std::string sam_seq, sam_qual;
+        bool found = false;
+        for (bool reverse : {record.reverse(), !record.reverse()}) {
+            sam_seq.clear();
+            detail::append_read(sam_seq, seq, qual, reverse);
+            sam_qual = sam_seq.substr(seq.size() + 1);
+            sam_seq.resize(seq.size());
+            if (!score(record, *contig, sam_seq, sam_qual, other))
+                continue;
+            if (!found || other.score > best.score) {
+                std::swap(best, other);
+                rescored.flag = static_cast<uint16_t>(reverse ? record.flag | AlignmentRecord::REVERSE
+                                                              : record.flag & ~AlignmentRecord::REVERSE);
+                found = true;
+            }
+        }
+        if (!found || best.score < _scoring.min_score(seq.size()))
+            return false;
+        // the original read had a secondary hit at least this good, this read may prefer it
+        if (auto xs = detail::find_tag(record.tags, "XS:i:")) {
+            int64_t secondary;
+            if (!detail::parse_int(*xs, secondary) || best.score <= secondary)
+                return false;
+        }
+
+        std::string tags;
+        detail::rewrite_score_tags(tags, record.tags, best.score, best.mismatches, best.edit_distance, best.md);
+        rescored.cigar = std::move(best.cigar);
+        rescored.tags = tags;
+        rescored.flipped = false;
+        rescored.render(out, name, seq, qual);
+        return true;
+    }
+}
+
+#endif //SEALM_REFERENCE_HPP
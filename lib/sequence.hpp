@@ -0,0 +1,215 @@
+#ifndef SEALM_SEQUENCE_HPP
+#define SEALM_SEQUENCE_HPP
+
+#include <array>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+
+namespace SeAlM {
+
+/*
+ *
+ *  PACKED SEQUENCES
+ *
+ *  Read sequence stored at 2 bits per base in fixed-width words held inline, so a 150bp read
+ *  takes 40 bytes of words instead of a heap allocated string. Bases other than A, C, G and T
+ *  are packed as A and their positions kept in an escape list, which is only allocated for
+ *  reads that have any; aligners treat all of them as N, and so does unpacking. Lowercase
+ *  bases pack the same as uppercase.
+ *
+ */
+
+    // 2 bit code of a base, 4 for bases that must be escaped
+    inline uint8_t base_code(char base) {
+        switch (base) {
+            case 'A':
+            case 'a':
+                return 0;
+            case 'C':
+            case 'c':
+                return 1;
+            case 'G':
+            case 'g':
+                return 2;
+            case 'T':
+            case 't':
+                return 3;
+            default:
+                return 4;
+        }
+    }
+
+    template<uint16_t MAX_BASES = 160>
+    class PackedSequence {
+    public:
+        static constexpr uint16_t MAX_LENGTH = MAX_BASES;
+        static constexpr uint16_t BASES_PER_WORD = 32;
+        static constexpr uint16_t WORDS = (MAX_BASES + BASES_PER_WORD - 1) / BASES_PER_WORD;
+
+    private:
+        std::array<uint64_t, WORDS> _words;
+        uint16_t _length;
+        uint16_t _escape_count;
+        std::unique_ptr<uint16_t[]> _escapes; // positions of escaped bases, ascending
+
+    public:
+        PackedSequence() : _words{}, _length{0}, _escape_count{0} {}
+
+        explicit PackedSequence(std::string_view seq);
+
+        PackedSequence(const PackedSequence &other);
+
+        PackedSequence(PackedSequence &&other) noexcept = default;
+
+        PackedSequence &operator=(const PackedSequence &other);
+
+        PackedSequence &operator=(PackedSequence &&other) noexcept = default;
+
+        /*
+         * Sequence Functions
+         */
+
+        uint16_t size() const { return _length; }
+
+        uint16_t escapes() const { return _escape_count; }
+
+        char operator[](uint16_t i) const;
+
+        std::string unpack() const;
+
+        // compact byte form, equal only for equal sequences
+        void append_bytes(std::string &out) const;
+
+        // approximate footprint, used by size-aware cache policies
+        uint64_t bytes() const { return sizeof(*this) + _escape_count * sizeof(uint16_t); }
+
+        /*
+         * Hash Functions
+         */
+
+        uint64_t hash() const;
+
+        bool operator==(const PackedSequence &other) const;
+
+        bool operator!=(const PackedSequence &other) const { return !(*this == other); }
+
+        friend std::ostream &operator<<(std::ostream &out, const PackedSequence &s) {
+            out << s.unpack();
+            return out;
+        }
+    };
+
+    template<uint16_t MAX_BASES>
+    PackedSequence<MAX_BASES>::PackedSequence(std::string_view seq) : _words{}, _length{0}, _escape_count{0} {
+        if (seq.size() > MAX_BASES)
+            throw std::length_error("Sequence of " + std::to_string(seq.size()) + " bases does not fit a "
+                                    + std::to_string(MAX_BASES) + " base packed sequence");
+        _length = seq.size();
+        for (uint16_t i = 0; i < _length; i++) {
+            uint8_t code = base_code(seq[i]);
+            if (code > 3) {
+                _escape_count++;
+                continue;
+            }
+            _words[i / BASES_PER_WORD] |= static_cast<uint64_t>(code) << (2 * (i % BASES_PER_WORD));
+        }
+        if (_escape_count == 0)
+            return;
+        _escapes = std::make_unique<uint16_t[]>(_escape_count);
+        for (uint16_t i = 0, e = 0; i < _length; i++) {
+            if (base_code(seq[i]) > 3)
+                _escapes[e++] = i;
+        }
+    }
+
+    template<uint16_t MAX_BASES>
+    PackedSequence<MAX_BASES>::PackedSequence(const PackedSequence &other) : _words{other._words},
+                                                                           _length{other._length},
+                                                                           _escape_count{other._escape_count} {
+        if (_escape_count > 0) {
+            _escapes = std::make_unique<uint16_t[]>(_escape_count);
+            std::memcpy(_escapes.get(), other._escapes.get(), _escape_count * sizeof(uint16_t));
+        }
+    }
+
+    template<uint16_t MAX_BASES>
+    PackedSequence<MAX_BASES> &PackedSequence<MAX_BASES>::operator=(const PackedSequence &other) {
+        if (this != &other) {
+            PackedSequence copy(other);
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+
+    template<uint16_t MAX_BASES>
+    char PackedSequence<MAX_BASES>::operator[](uint16_t i) const {
+        for (uint16_t e = 0; e < _escape_count && _escapes[e] <= i; e++) {
+            if (_escapes[e] == i)
+                return 'N';
+        }
+        return "ACGT"[(_words[i / BASES_PER_WORD] >> (2 * (i % BASES_PER_WORD))) & 0b11];
+    }
+
+    template<uint16_t MAX_BASES>
+    std::string PackedSequence<MAX_BASES>::unpack() const {
+        std::string seq(_length, 'A');
+        for (uint16_t i = 0; i < _length; i++) {
+            seq[i] = "ACGT"[(_words[i / BASES_PER_WORD] >> (2 * (i % BASES_PER_WORD))) & 0b11];
+        }
+        for (uint16_t e = 0; e < _escape_count; e++) {
+            seq[_escapes[e]] = 'N';
+        }
+        return seq;
+    }
+
+    template<uint16_t MAX_BASES>
+    void PackedSequence<MAX_BASES>::append_bytes(std::string &out) const {
+        // only the words the sequence reaches, so short reads give short keys
+        uint16_t words = (_length + BASES_PER_WORD - 1) / BASES_PER_WORD;
+        out.append(reinterpret_cast<const char *>(&_length), sizeof(_length));
+        out.append(reinterpret_cast<const char *>(_words.data()), words * sizeof(uint64_t));
+        if (_escape_count > 0)
+            out.append(reinterpret_cast<const char *>(_escapes.get()), _escape_count * sizeof(uint16_t));
+    }
+
+    template<uint16_t MAX_BASES>
+    uint64_t PackedSequence<MAX_BASES>::hash() const {
+        // words past the sequence are zero, so hashing all of them is safe
+        auto mix = [](uint64_t h, uint64_t v) {
+            h = (h ^ v) * 0xbf58476d1ce4e5b9ULL;
+            return h ^ (h >> 31);
+        };
+        uint64_t h = mix(0x9e3779b97f4a7c15ULL, _length);
+        for (uint64_t w : _words) {
+            h = mix(h, w);
+        }
+        for (uint16_t e = 0; e < _escape_count; e++) {
+            h = mix(h, _escapes[e]);
+        }
+        return h;
+    }
+
+    template<uint16_t MAX_BASES>
+    bool PackedSequence<MAX_BASES>::operator==(const PackedSequence &other) const {
+        return _length == other._length && _escape_count == other._escape_count && _words == other._words &&
+               (_escape_count == 0 ||
+                std::memcmp(_escapes.get(), other._escapes.get(), _escape_count * sizeof(uint16_t)) == 0);
+    }
+
+    template<uint16_t MAX_BASES>
+    uint64_t byte_size(const PackedSequence<MAX_BASES> &seq) { return seq.bytes(); }
+}
+
+namespace std {
+    template<uint16_t MAX_BASES>
+    struct hash<SeAlM::PackedSequence<MAX_BASES> > {
+        size_t operator()(const SeAlM::PackedSequence<MAX_BASES> &s) const { return s.hash(); }
+    };
+}
+
+#endif //SEALM_SEQUENCE_HPP
@@ -0,0 +1,488 @@
+#ifndef SEALM_SHM_CACHE_HPP
+#define SEALM_SHM_CACHE_HPP
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.hpp"
+#include "snapshot.hpp"
+
+namespace SeAlM {
+
+/*
+ * SHARED MEMORY CACHE
+ *
+ * Cache stored in a named POSIX shared-memory segment (/dev/shm/<name>) that any number of
+ * SeAlM processes can attach to, so a read aligned by one process is a hit for all of them.
+ * The segment is set-associative: a key hashes to one bucket of WAYS fixed-size slots and
+ * replaces within the bucket by CLOCK. Buckets are striped over robust process-shared
+ * mutexes, so a process that dies holding a stripe only costs the slot it was writing.
+ * Keys and values longer than the slot size are not cached. Hit/miss counts are per process.
+ * The segment records the fingerprint of the setup (reference and aligner) it was created for,
+ * processes with a different setup refuse to attach rather than share alignments that do not
+ * hold for them.
+ */
+
+    template<typename K, typename V>
+    class SharedMemoryCache : public BasicEvictionCache<K, V> {
+        static_assert(snapshot_storable<K> && snapshot_storable<V>,
+                      "shared memory cache stores keys and values as raw bytes");
+
+    protected:
+        static constexpr char SHM_MAGIC[8] = {'S', 'E', 'A', 'L', 'M', 'S', 'H', 'M'};
+        static constexpr uint32_t SHM_VERSION = 2;
+        static constexpr uint32_t WAYS = 8;
+
+        enum SlotState : uint8_t {
+            EMPTY = 0,
+            WRITING = 1, // only seen after its writer died mid-insert
+            USED = 2
+        };
+
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t stripes;
+            uint64_t buckets;
+            uint32_t key_bytes;
+            uint32_t value_bytes;
+            uint64_t slot_size;
+            uint64_t bucket_size;
+            uint64_t fingerprint;
+            std::atomic<uint64_t> used;
+            std::atomic<uint32_t> ready;
+        };
+
+        struct Stripe {
+            pthread_mutex_t mutex;
+        };
+
+        struct Slot {
+            uint64_t hash;
+            uint32_t value_len;
+            uint16_t key_len;
+            uint8_t state;
+            uint8_t ref;
+            // followed by key_bytes of key and value_bytes of value
+        };
+
+        struct Bucket {
+            uint64_t hand;
+            // followed by WAYS slots
+        };
+
+        static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared counters must be lock free");
+
+        std::string _name;
+        uint64_t _fingerprint;
+        char *_segment;
+        uint64_t _segment_size;
+        Header *_header;
+        Stripe *_stripes;
+        char *_buckets;
+        std::atomic<uint64_t> _oversized; // inserts skipped because they do not fit a slot
+
+        static uint64_t round_up(uint64_t n) { return (n + 7) & ~7ULL; }
+
+        Bucket *bucket(uint64_t b) { return reinterpret_cast<Bucket *>(_buckets + b * _header->bucket_size); }
+
+        Slot *slot(Bucket *bkt, uint32_t way) {
+            return reinterpret_cast<Slot *>(reinterpret_cast<char *>(bkt) + sizeof(Bucket) + way * _header->slot_size);
+        }
+
+        char *key_of(Slot *s) { return reinterpret_cast<char *>(s) + sizeof(Slot); }
+
+        char *value_of(Slot *s) { return key_of(s) + _header->key_bytes; }
+
+        Stripe &stripe(uint64_t b) { return _stripes[b % _header->stripes]; }
+
+        uint64_t bucket_of(uint64_t hash) { return hash % _header->buckets; }
+
+        void map_segment(int fd, uint64_t size);
+
+        void create(int fd, uint64_t slots, uint32_t stripes, uint32_t key_bytes, uint32_t value_bytes);
+
+        void attach(int fd);
+
+        void lock(uint64_t b);
+
+        void unlock(uint64_t b) { pthread_mutex_unlock(&stripe(b).mutex); }
+
+        void recover(uint64_t b);
+
+        Slot *probe(Bucket *bkt, uint64_t hash, std::string_view key);
+
+        uint32_t victim_way(Bucket *bkt);
+
+        bool store(const K &key, const V &value);
+
+        void evict() override {}
+
+    public:
+        SharedMemoryCache(const std::string &name, uint64_t slots, uint64_t fingerprint = 0, uint32_t stripes = 256,
+                          uint32_t key_bytes = 256, uint32_t value_bytes = 1024);
+
+        ~SharedMemoryCache() override;
+
+        SharedMemoryCache(const SharedMemoryCache &) = delete;
+
+        SharedMemoryCache &operator=(const SharedMemoryCache &) = delete;
+
+        // removes the segment name, attached processes keep their mapping until they exit
+        static bool unlink(const std::string &name) { return shm_unlink(name.c_str()) == 0; }
+
+        /*
+         * State Descriptors
+         */
+
+        void set_max_size(uint64_t) override {
+            log_warn("Shared memory cache size is fixed when the segment is created, ignoring new size.");
+        }
+
+        void set_max_bytes(uint64_t) override {
+            log_warn("Shared memory cache size is fixed when the segment is created, ignoring byte budget.");
+        }
+
+        uint32_t capacity() override { return _header->buckets * WAYS; }
+
+        uint32_t size() override { return _header->used.load(std::memory_order_relaxed); }
+
+        uint64_t bytes() override { return _segment_size; }
+
+        uint64_t oversized() { return _oversized; }
+
+        const std::string &name() { return _name; }
+
+        /*
+         * Cache Operations
+         */
+
+        void insert(const K &key, const V &value) override { store(key, value); }
+
+        // the segment cannot grow, so inserts always replace within the key's bucket
+        void insert_no_evict(const K &key, const V &value) override { store(key, value); }
+
+        void trim() override {}
+
+        CacheHandle<V> find(const K &key) override;
+
+        V &at(const K &key) override;
+
+        // values live in the segment, so every hit is copied out into a value of its own
+        std::shared_ptr<V> probe(const K &key) override;
+
+        bool contains(const K &key) override;
+
+        CacheHandle<V> lookup(const K &key) override;
+
+        V &operator[](K &key) override { return at(key); }
+
+        void clear() override;
+
+        void fetch_into(const K &key, V *buff) override;
+    };
+
+    template<typename K, typename V>
+    SharedMemoryCache<K, V>::SharedMemoryCache(const std::string &name, uint64_t slots, uint64_t fingerprint,
+                                               uint32_t stripes, uint32_t key_bytes, uint32_t value_bytes)
+            : BasicEvictionCache<K, V>(slots), _name{name.empty() || name[0] != '/' ? "/" + name : name},
+              _fingerprint{fingerprint}, _segment{nullptr}, _segment_size{0}, _header{nullptr}, _oversized{0} {
+        // first process to open the name creates and initializes the segment, the rest attach
+        int fd = shm_open(_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0660);
+        if (fd >= 0) {
+            try {
+                create(fd, slots, stripes, key_bytes, value_bytes);
+            } catch (...) {
+                close(fd);
+                shm_unlink(_name.c_str());
+                throw;
+            }
+        } else if (errno == EEXIST) {
+            fd = shm_open(_name.c_str(), O_RDWR, 0660);
+            if (fd < 0)
+                throw std::runtime_error("Cannot open shared memory cache " + _name + ": " + std::strerror(errno));
+            try {
+                attach(fd);
+            } catch (...) {
+                close(fd);
+                throw;
+            }
+        } else {
+            throw std::runtime_error("Cannot create shared memory cache " + _name + ": " + std::strerror(errno));
+        }
+        close(fd);
+    }
+
+    template<typename K, typename V>
+    SharedMemoryCache<K, V>::~SharedMemoryCache() {
+        if (_segment != nullptr)
+            munmap(_segment, _segment_size);
+    }
+
+    template<typename K, typename V>
+    void SharedMemoryCache<K, V>::map_segment(int fd, uint64_t size) {
+        void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+            throw std::runtime_error("Cannot map shared memory cache " + _name + ": " + std::strerror(errno));
+        _segment = static_cast<char *>(map);
+        _segment_size = size;
+        _header = reinterpret_cast<Header *>(_segment);
+    }
+
+    template<typename K, typename V>
+    void SharedMemoryCache<K, V>::create(int fd, uint64_t slots, uint32_t stripes, uint32_t key_bytes,
+                                         uint32_t value_bytes) {
+        uint64_t buckets = std::max<uint64_t>(1, (slots + WAYS - 1) / WAYS);
+        uint64_t slot_size = round_up(sizeof(Slot) + key_bytes + value_bytes);
+        uint64_t bucket_size = sizeof(Bucket) + WAYS * slot_size;
+        stripes = std::max<uint32_t>(1, std::min<uint64_t>(stripes, buckets));
+        uint64_t stripes_offset = round_up(sizeof(Header));
+        uint64_t buckets_offset = round_up(stripes_offset + stripes * sizeof(Stripe));
+        uint64_t size = buckets_offset + buckets * bucket_size;
+
+        if (ftruncate(fd, size) != 0)
+            throw std::runtime_error("Cannot size shared memory cache " + _name + ": " + std::strerror(errno));
+        // ftruncate zero fills, so every slot starts EMPTY
+        map_segment(fd, size);
+
+        _stripes = reinterpret_cast<Stripe *>(_segment + stripes_offset);
+        _buckets = _segment + buckets_offset;
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        for (uint32_t i = 0; i < stripes; i++) {
+            pthread_mutex_init(&_stripes[i].mutex, &attr);
+        }
+        pthread_mutexattr_destroy(&attr);
+
+        std::memcpy(_header->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+        _header->version = SHM_VERSION;
+        _header->stripes = stripes;
+        _header->buckets = buckets;
+        _header->key_bytes = key_bytes;
+        _header->value_bytes = value_bytes;
+        _header->slot_size = slot_size;
+        _header->bucket_size = bucket_size;
+        _header->fingerprint = _fingerprint;
+        _header->used.store(0);
+        // publish only once the mutexes and geometry are in place
+        _header->ready.store(1, std::memory_order_release);
+    }
+
+    template<typename K, typename V>
+    void SharedMemoryCache<K, V>::attach(int fd) {
+        // the creator may still be sizing or initializing the segment
+        struct stat st{};
+        for (int waited = 0; waited < 5000; waited += 10) {
+            if (fstat(fd, &st) != 0)
+                throw std::runtime_error("Cannot stat shared memory cache " + _name + ": " + std::strerror(errno));
+            if (static_cast<uint64_t>(st.st_size) >= sizeof(Header)) {
+                if (_header == nullptr)
+                    map_segment(fd, st.st_size);
+                if (_header->ready.load(std::memory_order_acquire) == 1)
+                    break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (_header == nullptr || _header->ready.load(std::memory_order_acquire) != 1)
+            throw std::runtime_error("Shared memory cache " + _name + " was never initialized, remove /dev/shm" + _name);
+        if (std::memcmp(_header->magic, SHM_MAGIC, sizeof(SHM_MAGIC)) != 0 || _header->version != SHM_VERSION)
+            throw std::runtime_error("Shared memory segment " + _name + " is not a SeAlM cache of this version");
+        if (_header->fingerprint != _fingerprint)
+            throw std::runtime_error("Shared memory cache " + _name + " was created for a different reference or aligner");
+
+        // adopt the creator's geometry
+        uint64_t stripes_offset = round_up(sizeof(Header));
+        uint64_t buckets_offset = round_up(stripes_offset + _header->stripes * sizeof(Stripe));
+        _stripes = reinterpret_cast<Stripe *>(_segment + stripes_offset);
+        _buckets = _segment + buckets_offset;
+        this->_max_cache_size = _header->buckets * WAYS;
+    }
+
+    template<typename K, typename V>
+    void SharedMemoryCache<K, V>::lock(uint64_t b) {
+        int rc = pthread_mutex_lock(&stripe(b).mutex);
+        if (rc == EOWNERDEAD) {
+            // previous owner died inside the critical section
+            recover(b);
+            pthread_mutex_consistent(&stripe(b).mutex);
+        } else if (rc != 0) {
+            throw std::runtime_error("Cannot lock shared memory cache " + _name + ": " + std::strerror(rc));
+        }
+    }
+
+    template<typename K, typename V>
+    void SharedMemoryCache<K, V>::recover(uint64_t b) {
+        // drop slots of this stripe that a dead process left half written
+        for (uint64_t i = b % _header->stripes; i < _header->buckets; i += _header->stripes) {
+            Bucket *bkt = bucket(i);
+            for (uint32_t w = 0; w < WAYS; w++) {
+                Slot *s = slot(bkt, w);
+                if (s->state == WRITING) {
+                    s->state = EMPTY;
+                    _header->used.fetch_sub(1, std::memory_order_relaxed);
+                }
+            }
+        }
+        log_warn("Recovered shared memory cache stripe after a process died holding its lock.");
+    }
+
+    template<typename K, typename V>
+    typename SharedMemoryCache<K, V>::Slot *
+    SharedMemoryCache<K, V>::probe(Bucket *bkt, uint64_t hash, std::string_view key) {
+        // caller holds the bucket's stripe
+        for (uint32_t w = 0; w < WAYS; w++) {
+            Slot *s = slot(bkt, w);
+            if (s->state == USED && s->hash == hash && s->key_len == key.size() &&
+                std::memcmp(key_of(s), key.data(), key.size()) == 0)
+                return s;
+        }
+        return nullptr;
+    }
+
+    template<typename K, typename V>
+    uint32_t SharedMemoryCache<K, V>::victim_way(Bucket *bkt) {
+        // caller holds the bucket's stripe, prefer an empty way, otherwise run CLOCK over the bucket
+        for (uint32_t w = 0; w < WAYS; w++) {
+            if (slot(bkt, w)->state == EMPTY)
+                return w;
+        }
+        while (true) {
+            Slot *s = slot(bkt, bkt->hand % WAYS);
+            uint32_t w = bkt->hand++ % WAYS;
+            if (s->ref == 0)
+                return w;
+            s->ref = 0;
+        }
+    }
+
+    template<typename K, typename V>
+    bool SharedMemoryCache<K, V>::store(const K &key, const V &value) {
+        std::string_view k = snapshot_view(key);
+        std::string_view v = snapshot_view(value);
+        if (k.size() > _header->key_bytes || k.size() > UINT16_MAX || v.size() > _header->value_bytes) {
+            _oversized++;
+            return false;
+        }
+        uint64_t hash = stable_hash(k);
+        uint64_t b = bucket_of(hash);
+        Bucket *bkt = bucket(b);
+
+        lock(b);
+        if (probe(bkt, hash, k) != nullptr) {
+            // another process already cached it
+            unlock(b);
+            return false;
+        }
+        Slot *s = slot(bkt, victim_way(bkt));
+        if (s->state == USED) {
+            if (this->_eviction_callback)
+                this->_eviction_callback(K(std::string(key_of(s), s->key_len)),
+                                         V(std::string(value_of(s), s->value_len)));
+        } else {
+            _header->used.fetch_add(1, std::memory_order_relaxed);
+        }
+        s->state = WRITING;
+        s->hash = hash;
+        s->key_len = k.size();
+        s->value_len = v.size();
+        s->ref = 0;
+        std::memcpy(key_of(s), k.data(), k.size());
+        std::memcpy(value_of(s), v.data(), v.size());
+        s->state = USED;
+        unlock(b);
+        this->_keys++;
+        return true;
+    }
+
+    template<typename K, typename V>
+    std::shared_ptr<V> SharedMemoryCache<K, V>::probe(const K &key) {
+        std::string_view k = snapshot_view(key);
+        uint64_t hash = stable_hash(k);
+        uint64_t b = bucket_of(hash);
+
+        lock(b);
+        Slot *s = probe(bucket(b), hash, k);
+        if (s == nullptr) {
+            unlock(b);
+            this->_misses++;
+            return nullptr;
+        }
+        s->ref = 1;
+        auto value = std::make_shared<V>(std::string(value_of(s), s->value_len));
+        unlock(b);
+        this->_hits++;
+        return value;
+    }
+
+    template<typename K, typename V>
+    bool SharedMemoryCache<K, V>::contains(const K &key) {
+        std::string_view k = snapshot_view(key);
+        uint64_t hash = stable_hash(k);
+        uint64_t b = bucket_of(hash);
+
+        lock(b);
+        bool found = probe(bucket(b), hash, k) != nullptr;
+        unlock(b);
+        return found;
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> SharedMemoryCache<K, V>::lookup(const K &key) {
+        return CacheHandle<V>(probe(key));
+    }
+
+    template<typename K, typename V>
+    CacheHandle<V> SharedMemoryCache<K, V>::find(const K &key) {
+        return CacheHandle<V>(probe(key));
+    }
+
+    template<typename K, typename V>
+    V &SharedMemoryCache<K, V>::at(const K &key) {
+        // values are copied out of the segment, the reference is valid until this thread's next at()
+        static thread_local std::shared_ptr<V> held;
+        auto cached = lookup(key);
+        if (!cached)
+            throw std::out_of_range("Key not in shared memory cache " + _name);
+        held = cached.shared();
+        return *held;
+    }
+
+    template<typename K, typename V>
+    void SharedMemoryCache<K, V>::fetch_into(const K &key, V *buff) {
+        auto cached = lookup(key);
+        if (cached && buff != nullptr)
+            *buff = cached->get();
+    }
+
+    template<typename K, typename V>
+    void SharedMemoryCache<K, V>::clear() {
+        // clears the segment for every attached process
+        for (uint64_t b = 0; b < _header->buckets; b++) {
+            lock(b);
+            Bucket *bkt = bucket(b);
+            for (uint32_t w = 0; w < WAYS; w++) {
+                Slot *s = slot(bkt, w);
+                if (s->state != EMPTY) {
+                    s->state = EMPTY;
+                    _header->used.fetch_sub(1, std::memory_order_relaxed);
+                }
+            }
+            unlock(b);
+        }
+    }
+}
+
+#endif //SEALM_SHM_CACHE_HPP
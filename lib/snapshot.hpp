@@ -0,0 +1,237 @@
+#ifndef SEALM_SNAPSHOT_HPP
+#define SEALM_SNAPSHOT_HPP
+
+#include <string>
+#include <string_view>
+#include <fstream>
+#include <cstring>
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <initializer_list>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "string.h"
+#include "logging.hpp"
+
+namespace SeAlM {
+
+/*
+ *
+ *  CACHE SNAPSHOTS
+ *
+ *  Binary image of a cache's entries, laid out so a reader can mmap the file and use it in place:
+ *
+ *      SnapshotHeader | SnapshotEntry[count] | key and value bytes
+ *
+ *  Entries run from least to most recently used, so inserting them in order restores recency.
+ *  Offsets are relative to the start of the data section. The fingerprint ties a snapshot to
+ *  the reference and aligner command it was produced with.
+ *
+ */
+
+    static constexpr char SNAPSHOT_MAGIC[8] = {'S', 'E', 'A', 'L', 'M', 'S', 'N', 'P'};
+    static constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+    struct SnapshotHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t fingerprint;
+        uint64_t count;
+        uint64_t data_bytes;
+    };
+
+    struct SnapshotEntry {
+        uint64_t key_offset;
+        uint64_t value_offset;
+        uint32_t key_len;
+        uint32_t value_len;
+    };
+
+    // key and value types that can be written to a snapshot and rebuilt from its bytes
+    template<typename T>
+    constexpr bool snapshot_storable = std::is_same_v<T, std::string> || std::is_same_v<T, PreHashedString>;
+
+    // bytes written for a key or value, types stored in snapshots provide an overload
+    inline std::string_view snapshot_view(const std::string &s) { return s; }
+
+    inline std::string_view snapshot_view(const PreHashedString &s) { return s.str(); }
+
+    // FNV-1a, stable across builds and processes unlike std::hash
+    inline uint64_t stable_hash(std::string_view bytes, uint64_t hash = 0xcbf29ce484222325ULL) {
+        for (unsigned char c : bytes) {
+            hash ^= c;
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    inline uint64_t snapshot_fingerprint(std::initializer_list<std::string> parts) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (const auto &part : parts) {
+            // separator so ("ab", "c") and ("a", "bc") differ
+            hash = stable_hash("\xff", stable_hash(part, hash));
+        }
+        return hash;
+    }
+
+/*
+ * Snapshot Writer
+ */
+
+    // entries are added twice, first to lay out the table then to write the data, in the same order
+    class SnapshotWriter {
+    private:
+        std::string _path;
+        std::string _tmp_path;
+        std::ofstream _out;
+        uint64_t _count;
+        uint64_t _added;
+        uint64_t _data_offset;
+
+    public:
+        SnapshotWriter(const std::string &path, uint64_t fingerprint, uint64_t count) : _path{path},
+                                                                                      _tmp_path{path + ".tmp"},
+                                                                                      _count{count}, _added{0},
+                                                                                      _data_offset{0} {
+            _out.open(_tmp_path, std::ios::binary | std::ios::trunc);
+            SnapshotHeader header{};
+            std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+            header.version = SNAPSHOT_VERSION;
+            header.fingerprint = fingerprint;
+            header.count = count;
+            // data_bytes is patched in by commit()
+            _out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        }
+
+        bool good() const { return _out.good(); }
+
+        void add_entry(std::string_view key, std::string_view value) {
+            SnapshotEntry entry{_data_offset, _data_offset + key.size(), static_cast<uint32_t>(key.size()),
+                                static_cast<uint32_t>(value.size())};
+            _out.write(reinterpret_cast<const char *>(&entry), sizeof(entry));
+            _data_offset += key.size() + value.size();
+            _added++;
+        }
+
+        void add_data(std::string_view key, std::string_view value) {
+            _out.write(key.data(), key.size());
+            _out.write(value.data(), value.size());
+        }
+
+        // replaces any previous snapshot only once the new one is complete
+        bool commit() {
+            if (_added != _count) {
+                log_error("Snapshot entry count changed while writing, discarding " + _tmp_path);
+                _out.close();
+                std::remove(_tmp_path.c_str());
+                return false;
+            }
+            _out.seekp(offsetof(SnapshotHeader, data_bytes));
+            _out.write(reinterpret_cast<const char *>(&_data_offset), sizeof(_data_offset));
+            _out.close();
+            if (!_out || std::rename(_tmp_path.c_str(), _path.c_str()) != 0) {
+                log_error("Failed to write cache snapshot " + _path);
+                std::remove(_tmp_path.c_str());
+                return false;
+            }
+            return true;
+        }
+    };
+
+/*
+ * Snapshot Reader
+ */
+
+    class SnapshotReader {
+    private:
+        const char *_map;
+        uint64_t _map_size;
+        const SnapshotHeader *_header;
+        const SnapshotEntry *_entries;
+        const char *_data;
+
+        void unmap() {
+            if (_map != nullptr)
+                munmap(const_cast<char *>(_map), _map_size);
+            _map = nullptr;
+            _header = nullptr;
+        }
+
+    public:
+        SnapshotReader() : _map{nullptr}, _map_size{0}, _header{nullptr}, _entries{nullptr}, _data{nullptr} {}
+
+        SnapshotReader(const SnapshotReader &) = delete;
+
+        SnapshotReader &operator=(const SnapshotReader &) = delete;
+
+        ~SnapshotReader() { unmap(); }
+
+        // maps the snapshot and validates it, false leaves the reader empty
+        bool open(const std::string &path, uint64_t fingerprint) {
+            unmap();
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat st{};
+            if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(SnapshotHeader)) {
+                close(fd);
+                log_warn("Ignoring truncated cache snapshot " + path);
+                return false;
+            }
+            _map_size = st.st_size;
+            void *map = mmap(nullptr, _map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (map == MAP_FAILED) {
+                log_warn("Could not map cache snapshot " + path);
+                return false;
+            }
+            _map = static_cast<const char *>(map);
+            _header = reinterpret_cast<const SnapshotHeader *>(_map);
+
+            if (std::memcmp(_header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+                _header->version != SNAPSHOT_VERSION) {
+                log_warn("Ignoring cache snapshot with unknown format " + path);
+                unmap();
+                return false;
+            }
+            if (_header->fingerprint != fingerprint) {
+                log_warn("Ignoring cache snapshot built for a different reference or aligner " + path);
+                unmap();
+                return false;
+            }
+            uint64_t table = sizeof(SnapshotHeader);
+            if (_header->count > (_map_size - table) / sizeof(SnapshotEntry) ||
+                _header->data_bytes != _map_size - table - _header->count * sizeof(SnapshotEntry)) {
+                log_warn("Ignoring truncated cache snapshot " + path);
+                unmap();
+                return false;
+            }
+            _entries = reinterpret_cast<const SnapshotEntry *>(_map + table);
+            _data = _map + table + _header->count * sizeof(SnapshotEntry);
+            return true;
+        }
+
+        uint64_t size() const { return _header != nullptr ? _header->count : 0; }
+
+        // false if the entry points outside the data section
+        bool entry(uint64_t i, std::string_view &key, std::string_view &value) const {
+            const SnapshotEntry &e = _entries[i];
+            uint64_t limit = _header->data_bytes;
+            if (e.key_offset > limit || e.key_len > limit - e.key_offset ||
+                e.value_offset > limit || e.value_len > limit - e.value_offset)
+                return false;
+            key = std::string_view(_data + e.key_offset, e.key_len);
+            value = std::string_view(_data + e.value_offset, e.value_len);
+            return true;
+        }
+    };
+}
+
+#endif //SEALM_SNAPSHOT_HPP
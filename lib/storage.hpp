@@ -76,6 +76,7 @@ namespace SeAlM {
         uint64_t _size;
         std::vector<uint16_t> _chain_lengths;
         uint64_t _current_chain;
+        uint64_t _last_chain; // chain the last bucket handed out came from
         bool _flushed;
         ChainSwitch _chain_switch;
 
@@ -106,6 +107,7 @@ namespace SeAlM {
             _num_full_buckets = 0;
             _size = 0;
             _current_chain = 0;
+            _last_chain = 0;
             _alive = true;
             _flushed = false;
             _chain_switch = ChainSwitch::LONGEST;
@@ -167,6 +169,8 @@ namespace SeAlM {
 
         bool empty() { return _num_full_buckets == 0; }
 
+        uint64_t last_chain() { return _last_chain; }
+
         /*
          * Getters/Setters
          */
@@ -219,6 +223,7 @@ namespace SeAlM {
                 _chain_lengths[i] = other._chain_lengths[i];
             }
             _current_chain = other._current_chain;
+            _last_chain = other._last_chain;
             _chain_switch = other._chain_switch;
 
             // Atomic variables
@@ -365,6 +370,7 @@ namespace SeAlM {
             std::lock_guard<std::mutex> lock(this->_bucket_mutex);
             // retrieve next bucket and remove from chain
             std::unique_ptr<std::vector<T>> out = std::move(_buckets[this->_current_chain].front());
+            this->_last_chain = this->_current_chain;
             _buckets[this->_current_chain].pop_front();
             // consume chains until empty, then move to next chain, chosen as longest chain
             this->_chain_lengths[this->_current_chain]--;
@@ -542,6 +548,7 @@ namespace SeAlM {
             std::lock_guard<std::mutex> lock(this->_bucket_mutex);
             // retrieve next bucket and remove from chain
             std::unique_ptr<std::vector<T>> out = std::move(_sorted_chain[this->_current_chain]);
+            this->_last_chain = this->_current_chain;
             _sorted_chain[this->_current_chain] = std::make_unique<std::vector<T> >();
             // consume chains until empty, then move to next chain, chosen as longest chain
             this->_chain_lengths[this->_current_chain]--;
@@ -23,13 +23,21 @@ namespace SeAlM {
 
         PreHashedString(const char *s) { set_string(s); }
 
+        PreHashedString(const PreHashedString &other) = default;
+
+        // moves hand the buffer over, an alignment line is not copied on its way through a queue
+        PreHashedString(PreHashedString &&other) noexcept = default;
+
         PreHashedString& operator=(const PreHashedString &other) {
             _hash = other._hash;
             _str = other._str;
             _pre_comp_hash = other._pre_comp_hash;
             _hashed = other._hashed;
+            return *this;
         }
 
+        PreHashedString& operator=(PreHashedString &&other) noexcept = default;
+
         /*
          * Hash Functions
          */
@@ -63,10 +71,20 @@ namespace SeAlM {
 
         size_t size() const { return _str.size(); }
 
+        const std::string &str() const { return _str; }
+
+        // the string itself, for building a value in place and reusing its capacity, unhashes it
+        std::string &buffer() {
+            _hashed = false;
+            return _str;
+        }
+
         std::string substr(unsigned long pos, unsigned long n) { return _str.substr(pos, n); }
 
         size_t find(const char _s) { return _str.find(_s); }
 
+        size_t find(const char *_s) const { return _str.find(_s); }
+
         char operator[](size_t i) const {
             return _str[i];
         }
@@ -83,12 +101,12 @@ namespace SeAlM {
          * Misc Functions
          */
 
-        bool operator == (PreHashedString other) const {
+        bool operator == (const PreHashedString &other) const {
             // TODO: check for hash collisions
             return _pre_comp_hash == other._pre_comp_hash;
         }
 
-        bool operator < (PreHashedString other) const {
+        bool operator < (const PreHashedString &other) const {
             return _str < other._str;
         }
 
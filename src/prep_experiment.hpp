@@ -5,9 +5,19 @@
 #ifndef SEALM_PREP_EXPERIMENT_HPP
 #define SEALM_PREP_EXPERIMENT_HPP
 
+#include <sys/stat.h>
+
 #include "../lib/config.hpp"
 #include "../lib/pipeline.hpp"
+#include "../lib/shm_cache.hpp"
+#include "../lib/disk_cache.hpp"
+#include "../lib/compressed_cache.hpp"
+#include "../lib/near_cache.hpp"
+#include "../lib/maintained_cache.hpp"
 #include "../lib/string.h"
+#include "../lib/alignment.hpp"
+#include "../lib/sequence.hpp"
+#include "../lib/reference.hpp"
 
 /*
  * Orderings
@@ -228,19 +238,122 @@ public:
  * PROCESSORS
  */
 
+// cost of realigning the read of a cached SAM line, given its share of the batch align time
+inline double sam_alignment_cost(const SeAlM::PreHashedString &value, double align_share) {
+    // a secondary alignment score means the aligner had to resolve more than one locus
+    return value.find("\tXS:i:") != std::string::npos ? 2 * align_share : align_share;
+}
+
 class FASTQProcessor : public SeAlM::DataProcessor<SeAlM::Read, SeAlM::PreHashedString, SeAlM::PreHashedString> {
+protected:
+    bool _canonical = false;
+    std::shared_ptr<SeAlM::AlignmentRescorer> _rescorer;
+    uint32_t _containment_length = 0; // 0 if alignments of containing reads are not cut
+    SeAlM::ScoringScheme _scoring = SeAlM::ScoringScheme::bowtie2(false);
+
+    // line for a read that is a stretch of the cached read match, cut from match's alignment
+    bool contained(SeAlM::Read &data, const std::string &match, SeAlM::AlignmentRecord &record, std::string &line) {
+        const std::string &seq = data[1].str();
+        const std::string &qual = data[3].str();
+        if (_containment_length == 0 || seq.size() < _containment_length)
+            return false;
+        // records describe the read as keyed, raw lines the read the aligner was given
+        if (!record.sam_seq.empty()) {
+            bool reverse = record.reverse();
+            bool keyed = reverse ? SeAlM::detail::equals_reverse_complement(record.sam_seq, match)
+                                 : record.sam_seq == match;
+            bool other = reverse ? record.sam_seq == match
+                                 : SeAlM::detail::equals_reverse_complement(record.sam_seq, match);
+            if (!keyed && !other)
+                return false;
+            if (!keyed)
+                record.flip_strand();
+        }
+        // keys are canonical, so the read is cut from match in its keyed orientation
+        bool flip = _canonical && !SeAlM::is_canonical(seq);
+        std::string keyed_seq = flip ? SeAlM::reverse_complement(seq) : seq;
+        std::string keyed_qual = flip ? std::string(qual.rbegin(), qual.rend()) : qual;
+        size_t offset = match.find(keyed_seq);
+        if (offset == std::string::npos)
+            return false;
+        static thread_local std::string tags;
+        SeAlM::AlignmentRecord slice;
+        if (!SeAlM::slice_alignment(record, match.size(), offset, keyed_seq, keyed_qual, _scoring, slice, tags))
+            return false;
+        if (flip)
+            slice.flip_strand();
+        slice.render(line, SeAlM::read_name(data[0].str()), seq, qual);
+        return true;
+    }
+
+public:
+    // key a read and its reverse complement alike, they align to the same locus on opposite strands
+    void set_canonical_keys(bool canonical) { _canonical = canonical; }
+
+    // verifies alignments of near matching reads, which are not used without one
+    void set_rescorer(std::shared_ptr<SeAlM::AlignmentRescorer> rescorer) { _rescorer = std::move(rescorer); }
+
+    // reuse alignments of cached reads containing reads at least min_length long
+    void set_containment(uint32_t min_length, const SeAlM::ScoringScheme &scoring) {
+        _containment_length = min_length;
+        _scoring = scoring;
+    }
+
+protected:
     /*
      * Key Extraction Functions
      */
     SeAlM::PreHashedString _extract_key_fn(SeAlM::Read &data) final {
-        return data[1];
+        if (!_canonical || SeAlM::is_canonical(data[1].str()))
+            return data[1];
+        return SeAlM::PreHashedString(SeAlM::reverse_complement(data[1].str()));
     }
 
     /*
      * Postprocessing functions
      */
-    SeAlM::PreHashedString _postprocess_fn(SeAlM::Read &data, SeAlM::PreHashedString &value) override {
-        return value;
+    SeAlM::PreHashedString _postprocess_fn(SeAlM::Read &data, const SeAlM::PreHashedString &value) override {
+        SeAlM::PreHashedString out;
+        _postprocess_into_fn(data, value, out);
+        return out;
+    }
+
+    void _postprocess_into_fn(SeAlM::Read &data, const SeAlM::PreHashedString &value,
+                              SeAlM::PreHashedString &out) override {
+        // a line aligned for the reverse complement of this read is turned around
+        std::string &line = out.buffer();
+        line.clear();
+        if (!_canonical || !SeAlM::reorient_line(value.str(), data[1].str(), data[3].str(), line))
+            out = value;
+    }
+
+    /*
+     * Cost Functions
+     */
+    double _cost_fn(SeAlM::Read &, SeAlM::PreHashedString &value, double align_share) override {
+        return sam_alignment_cost(value, align_share);
+    }
+
+    /*
+     * Near Match Functions
+     */
+    bool _adapt_fn(SeAlM::Read &data, const SeAlM::PreHashedString &match, SeAlM::PreHashedString &value,
+                   SeAlM::PreHashedString &out) override {
+        // cached records and raw lines alike
+        SeAlM::AlignmentRecord record;
+        if (!record.decode(value.str()) && !record.parse(value.str()))
+            return false;
+        static thread_local std::string line;
+        line.clear();
+        // keys of the same length differ by mismatches, longer ones contain the read
+        bool adapted = match.str().size() == data[1].str().size()
+                       ? _rescorer && _rescorer->rescore(record, SeAlM::read_name(data[0].str()), data[1].str(),
+                                                         data[3].str(), line)
+                       : contained(data, match.str(), record, line);
+        if (!adapted)
+            return false;
+        out.set_string(line, false);
+        return true;
     }
 };
 
@@ -249,33 +362,33 @@ class CompressedFASTQProcessor : public SeAlM::DataProcessor<SeAlM::Read, SeAlM:
      * Key Extraction Functions
      */
     SeAlM::PreHashedString _extract_key_fn(SeAlM::Read &data) final {
-        int len = data[1].size();
-        char *bin = new char[(len / 2) + data.size() % 2];
-        int j = 0;
-        int i = 0;
-        for (; i < len - 1; i += 2) {
-            bin[j] = 0b00000000;
-            bin[j] |= data[1][i] & 0b00000111;
-            bin[j] <<= 3;
-            bin[j] &= 0b00111000;
-            bin[j++] |= data[1][i + 1] & 0b00000111;
-        }
-        // odd-length strings
-        if (i++ == data.size() - 1) {
-            bin[j] = 0b00000000;
-            bin[j] |= data[1][i] & 0b00000111;
-        }
-
-        SeAlM::PreHashedString out(bin);
-        return out;
+        const std::string &seq = data[1].str();
+        if (seq.size() > SeAlM::PackedSequence<>::MAX_LENGTH)
+            return data[1]; // too long to pack, keyed by the plain sequence
+
+        // leading NUL keeps packed keys apart from plain sequence keys, packed into a reused buffer so
+        // the key's own string is the only allocation
+        static thread_local std::string bytes;
+        bytes.assign(1, '\0');
+        SeAlM::PackedSequence<>(seq).append_bytes(bytes);
+        SeAlM::PreHashedString key;
+        key.set_string(bytes);
+        return key;
     }
 
     /*
      * Postprocessing functions
      */
-    SeAlM::PreHashedString _postprocess_fn(SeAlM::Read &data, SeAlM::PreHashedString &value) override {
+    SeAlM::PreHashedString _postprocess_fn(SeAlM::Read &, const SeAlM::PreHashedString &value) override {
         return value;
     }
+
+    /*
+     * Cost Functions
+     */
+    double _cost_fn(SeAlM::Read &, SeAlM::PreHashedString &value, double align_share) override {
+        return sam_alignment_cost(value, align_share);
+    }
 };
 
 
@@ -283,24 +396,56 @@ class RetaggingProcessor : public FASTQProcessor {
     /*
      * Postprocessing functions
      */
-    SeAlM::PreHashedString _postprocess_fn(SeAlM::Read &data, SeAlM::PreHashedString &value) final {
-        std::stringstream ss;
+    void _postprocess_into_fn(SeAlM::Read &data, const SeAlM::PreHashedString &value,
+                              SeAlM::PreHashedString &out) final {
+        FASTQProcessor::_postprocess_into_fn(data, value, out);
+        // the read's tag in place of the aligned line's name, built in a buffer traded with out's
+        static thread_local std::string line;
+        const std::string &name = data[0].str();
+        const std::string &oriented = out.str();
+        line.clear();
+        line.append(name, 1, name.find(' ') - 1);
+        line.push_back('\t');
+        line.append(oriented, oriented.find('\t'), std::string::npos);
+        out.buffer().swap(line);
+    }
+};
+
+class AlignmentRecordProcessor : public FASTQProcessor {
+    /*
+     * Cached Value Functions
+     */
+    SeAlM::PreHashedString _cache_value_fn(SeAlM::Read &data, SeAlM::PreHashedString &value) final {
+        SeAlM::AlignmentRecord record;
+        if (!record.parse(value.str(), SeAlM::read_name(data[0].str()), data[1].str(), data[3].str()))
+            return value; // keep lines that cannot be rebuilt from the read as they are
+        // cached records describe the canonical orientation of the read
+        if (_canonical && !SeAlM::is_canonical(data[1].str()))
+            record.flip_strand();
+        std::string bytes;
+        record.encode(bytes);
         SeAlM::PreHashedString out;
-        SeAlM::PreHashedString tag_line(data[0]);
-        SeAlM::PreHashedString  tag = tag_line.substr(1, tag_line.find(' ') - 1);
-        unsigned long sp1 = value.find('\t');
-        // TODO: replace qual score with one from this read
-        //unsigned long sp2 = alignment.find('\t', 9);
-        std::string untagged = value.substr(sp1, value.size());
-
-        ss << tag;
-        ss << "\t";
-        ss << untagged;
-
-        std::string tmp = ss.str();
-        out.set_string(tmp, false);
+        out.set_string(bytes, false);
         return out;
     }
+
+    /*
+     * Postprocessing functions
+     */
+    void _postprocess_into_fn(SeAlM::Read &data, const SeAlM::PreHashedString &value,
+                              SeAlM::PreHashedString &out) final {
+        // fresh aligner output and raw cached lines are written as plain lines
+        SeAlM::AlignmentRecord record;
+        if (!record.decode(value.str())) {
+            FASTQProcessor::_postprocess_into_fn(data, value, out);
+            return;
+        }
+        if (_canonical && !SeAlM::is_canonical(data[1].str()))
+            record.flip_strand();
+        std::string &line = out.buffer();
+        line.clear();
+        record.render(line, SeAlM::read_name(data[0].str()), data[1].str(), data[3].str());
+    }
 };
 
 /*
@@ -339,6 +484,26 @@ class FASTAParser : public SeAlM::DataParser<SeAlM::Read> {
     }
 };
 
+// Identifies the reference and aligner setup a cache snapshot is valid for, false if no file of the
+// reference can be found, cached alignments could then be for any version of it
+bool setup_fingerprint(SeAlM::ConfigParser &cfp, uint64_t &fingerprint) {
+    std::string reference = cfp.get_val("reference");
+    std::string reference_stamp;
+    // bowtie2 is given an index prefix (small or large index), other aligners the reference file
+    for (const char *suffix : {"", ".1.bt2", ".rev.1.bt2", ".1.bt2l", ".rev.1.bt2l"}) {
+        struct stat st{};
+        if (stat((reference + suffix).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            reference_stamp += std::string(suffix) + "=" + std::to_string(st.st_size) + ":" +
+                               std::to_string(st.st_mtime) + ";";
+    }
+    if (reference_stamp.empty())
+        return false;
+    fingerprint = SeAlM::snapshot_fingerprint({reference, reference_stamp, cfp.get_val("aligner"),
+                                               cfp.get_val("aligner_path"), cfp.get_val("command"),
+                                               cfp.get_val("interleaved")});
+    return true;
+}
+
 // Configure the data pipeline appropriately according to the config file
 // T-dataType, K-cacheKey, V-cacheValue
 void prep_experiment(SeAlM::ConfigParser &cfp,
@@ -359,6 +524,40 @@ void prep_experiment(SeAlM::ConfigParser &cfp,
             c = std::make_shared<SeAlM::LRUCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >();
         } else if (cache == "mru") {
             c = std::make_shared<SeAlM::MRUCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >();
+        } else if (cache == "clock") {
+            c = std::make_shared<SeAlM::ClockCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >();
+        } else if (cache == "s3fifo") {
+            c = std::make_shared<SeAlM::S3FIFOCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >();
+        } else if (cache == "lfu") {
+            bool aging = cfp.contains("cache_aging") && cfp.get_bool_val("cache_aging");
+            c = std::make_shared<SeAlM::LFUCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >(1048576 * 4, aging);
+        } else if (cache == "gdsf") {
+            c = std::make_shared<SeAlM::GDSFCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >();
+        } else if (cache == "arc") {
+            c = std::make_shared<SeAlM::ARCCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >();
+        } else if (cache == "shm") {
+            std::string name = cfp.contains("cache_shm_name") ? cfp.get_val("cache_shm_name") : "/sealm_cache";
+            uint64_t slots = cfp.contains("cache_shm_slots") ? cfp.get_long_val("cache_shm_slots") : 1048576;
+            try {
+                uint64_t fingerprint;
+                if (!setup_fingerprint(cfp, fingerprint))
+                    throw std::runtime_error("No index or reference file found for " + cfp.get_val("reference"));
+                c = std::make_shared<SeAlM::SharedMemoryCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >(
+                        name, slots, fingerprint);
+            } catch (std::runtime_error &e) {
+                SeAlM::log_warn(std::string(e.what()) + ", falling back to a process local lru cache.");
+                c = std::make_shared<SeAlM::LRUCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >();
+            }
+        } else if (cache == "slab_lru") {
+            c = std::make_shared<SeAlM::SlabLRUCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >();
+        } else if (cache == "sharded_lru" || cache == "sharded_mru") {
+            uint32_t shards = cfp.contains("cache_shards") ? cfp.get_long_val("cache_shards") : 16;
+            if (cache == "sharded_lru") {
+                c = std::make_shared<SeAlM::ShardedCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >(shards);
+            } else {
+                c = std::make_shared<SeAlM::ShardedCache<SeAlM::PreHashedString, SeAlM::PreHashedString,
+                        SeAlM::MRUCache<SeAlM::PreHashedString, SeAlM::PreHashedString> > >(shards);
+            }
         }
 
         if (cfp.contains("cache_decorator")) {
@@ -366,16 +565,76 @@ void prep_experiment(SeAlM::ConfigParser &cfp,
             std::shared_ptr<SeAlM::CacheDecorator<SeAlM::PreHashedString, SeAlM::PreHashedString> > w;
 
             if (dec == "bloom_filter") {
-                w = std::make_shared<SeAlM::BFECache<SeAlM::PreHashedString, SeAlM::PreHashedString> >();
+                auto b = std::make_shared<SeAlM::BFECache<SeAlM::PreHashedString, SeAlM::PreHashedString> >();
+                if (cfp.contains("bloom_keys"))
+                    b->set_expected_keys(cfp.get_long_val("bloom_keys"));
+                w = b;
+                w->set_cache(c);
+            } else if (dec == "tinylfu") {
+                w = std::make_shared<SeAlM::TinyLFUCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >();
+                w->set_cache(c);
+            } else if (dec == "compressed") {
+                w = std::make_shared<SeAlM::CompressedCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >();
+                w->set_cache(c);
+            } else if (dec == "disk_tier") {
+                std::string dir = cfp.contains("cache_disk_dir") ? cfp.get_val("cache_disk_dir") : "sealm_disk_cache";
+                auto d = std::make_shared<SeAlM::DiskTierCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >(dir);
+                if (cfp.contains("cache_disk_bytes"))
+                    d->set_max_disk_bytes(cfp.get_long_val("cache_disk_bytes"));
+                w = d;
                 w->set_cache(c);
             }
 
             c = w;
         }
+
+        // similarity layers go outermost, so they index keys as the pipeline inserts them
+        if (cfp.contains("containment_hits") && cfp.get_long_val("containment_hits") > 0) {
+            std::shared_ptr<SeAlM::CacheDecorator<SeAlM::PreHashedString, SeAlM::PreHashedString> > w;
+            w = std::make_shared<SeAlM::ContainmentCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >();
+            w->set_cache(c);
+            c = w;
+        }
+        if (cfp.contains("near_hits") && cfp.get_long_val("near_hits") > 0) {
+            std::shared_ptr<SeAlM::CacheDecorator<SeAlM::PreHashedString, SeAlM::PreHashedString> > w;
+            w = std::make_shared<SeAlM::NearMatchCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >(
+                    std::min<uint64_t>(cfp.get_long_val("near_hits"), 2));
+            w->set_cache(c);
+            c = w;
+        }
+
+        // after decorating, so decorators that split capacity also split the budget
+        if (cfp.contains("cache_bytes")) {
+            c->set_max_bytes(cfp.get_long_val("cache_bytes"));
+        }
+
+        // outermost, so every layer below is filled and trimmed off the write stage
+        if (cfp.contains("cache_maintenance") && cfp.get_bool_val("cache_maintenance")) {
+            double low = cfp.contains("cache_low_watermark") ? cfp.get_double_val("cache_low_watermark") : 0.95;
+            std::shared_ptr<SeAlM::CacheDecorator<SeAlM::PreHashedString, SeAlM::PreHashedString> > w;
+            w = std::make_shared<SeAlM::MaintainedCache<SeAlM::PreHashedString, SeAlM::PreHashedString> >(low);
+            w->set_cache(c);
+            c = w;
+        }
     }
     pipe->set_cache_subsystem(c);
     pipe->register_observer(c);
 
+    // warm start from the previous run's cache, saved again when the pipeline closes
+    if (cfp.contains("cache_snapshot")) {
+        std::string snapshot = cfp.get_val("cache_snapshot");
+        uint64_t fingerprint;
+        if (!setup_fingerprint(cfp, fingerprint)) {
+            SeAlM::log_warn("No index or reference file found for " + cfp.get_val("reference") +
+                            ", the cache snapshot is neither loaded nor saved.");
+        } else {
+            uint64_t loaded = c->load_snapshot(snapshot, fingerprint);
+            if (loaded > 0)
+                SeAlM::log_info("Loaded " + std::to_string(loaded) + " cache entries from " + snapshot);
+            pipe->set_cache_snapshot(snapshot, fingerprint);
+        }
+    }
+
     /*
      * Storage Parameters
      */
@@ -482,12 +741,34 @@ void prep_experiment(SeAlM::ConfigParser &cfp,
     }
 
     std::shared_ptr<SeAlM::DataProcessor<SeAlM::Read, SeAlM::PreHashedString, SeAlM::PreHashedString> > r;
-    r = std::make_shared<FASTQProcessor>();
-    if (cfp.get_bool_val("retag")) {
-        r = std::make_shared<RetaggingProcessor>();
+    std::shared_ptr<FASTQProcessor> f;
+    f = std::make_shared<FASTQProcessor>();
+    if (cfp.get_bool_val("store_records")) {
+        // records are rendered with each read's own name, so this also retags
+        f = std::make_shared<AlignmentRecordProcessor>();
+    } else if (cfp.get_bool_val("retag")) {
+        f = std::make_shared<RetaggingProcessor>();
+    }
+    f->set_canonical_keys(cfp.get_bool_val("canonical_keys"));
+    bool local = cfp.get_val("command").find("--local") != std::string::npos;
+    if (cfp.contains("containment_hits") && cfp.get_long_val("containment_hits") > 0)
+        f->set_containment(cfp.get_long_val("containment_hits"), SeAlM::ScoringScheme::bowtie2(local));
+    if (cfp.contains("near_hits") && cfp.get_long_val("near_hits") > 0) {
+        if (!cfp.contains("reference_fasta")) {
+            SeAlM::log_warn("near_hits needs reference_fasta to verify alignments, near matches are not used.");
+        } else {
+            try {
+                auto reference = std::make_shared<const SeAlM::ReferenceGenome>(cfp.get_val("reference_fasta"));
+                f->set_rescorer(std::make_shared<SeAlM::AlignmentRescorer>(
+                        reference, SeAlM::ScoringScheme::bowtie2(local)));
+            } catch (std::runtime_error &e) {
+                SeAlM::log_warn(std::string(e.what()) + ", near matches are not used.");
+            }
+        }
     }
-        // TODO: allow compression and retagging
-    else if (cfp.get_bool_val("store_bin")) {
+    r = f;
+    // TODO: allow compression and retagging
+    if (!cfp.get_bool_val("store_records") && !cfp.get_bool_val("retag") && cfp.get_bool_val("store_bin")) {
         r = std::make_shared<CompressedFASTQProcessor>();
     }
     pipe->set_processor(r);
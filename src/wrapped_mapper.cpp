@@ -199,6 +199,14 @@ void WrappedMapper::run_alignment() {
         mfile << "Batch,Batch_Time,Throughput,Hits,Misses,Reads_Aligned,Compression_Ratio" << std::endl;
     }
 
+    // cache behaviour per batch next to the batch metrics, summaries are appended when done
+    std::ofstream cfile;
+    std::vector<std::string> file_names = _pipe.get_filenames();
+    if (!_metric_file.empty()) {
+        cfile.open(_metric_file + ".cache.csv");
+        cfile << "Batch,Hits,Misses,Inserts,Evictions,Batch_Hit_Rate,Hit_Rate,Lock_Wait_ms" << std::endl;
+    }
+
     _pipe.open();
 
     // align first bucket synchronously since aligner may have to load reference
@@ -225,6 +233,7 @@ void WrappedMapper::run_alignment() {
 
             next_bucket = read_future.get();
 
+            _pipe.set_batch_align_time(elapsed_time);
             auto write_future = _pipe.write_async(alignments);
 
             long batch_end = std::chrono::duration_cast<SeAlM::Mills>(
@@ -242,6 +251,14 @@ void WrappedMapper::run_alignment() {
                       << _pipe.cache_hits() << "," << _pipe.cache_misses() << ","
                       << _reads_aligned << "," << _pipe.current_compression_ratio() << std::endl;
                 mfile.flush();
+                auto window = _pipe.cache_stats().window();
+                cfile << _align_calls << "," << window.hits << "," << window.misses << "," << window.inserts << ","
+                      << window.evictions << "," << window.hit_rate() << ","
+                      << _pipe.cache_stats().totals().hit_rate() << ","
+                      << (_pipe.cache_lock_wait_ns() / 1e6) << std::endl;
+                // rewritten every batch, so the curve can be followed while the run goes on
+                std::ofstream curve(_metric_file + ".mrc.csv", std::ios::trunc);
+                _pipe.cache_stats().serialize_curve(curve, _pipe.cache_entry_bytes());
             } else {
                 _throughput_vec.emplace_back(_bucket_size / elapsed_time);
                 _hits_vec.emplace_back(_pipe.cache_hits());
@@ -256,6 +273,8 @@ void WrappedMapper::run_alignment() {
             std::cout << "Total reads " << _reads_seen << "\n";
             std::cout << "  Reads aligned " << _reads_aligned << "\n";
             std::cout << "  Reads aligned this batch: " << this_bucket << "\n";
+            if (_pipe.near_hits() > 0)
+                std::cout << "  Reads from near hits: " << _pipe.near_hits() << "\n";
             std::cout << _pipe;
             std::cout << "Avg Throughput: " << (_reads_seen / _align_time) << " r/s\n";
             std::cout << "  Instant Throughput: " << (_bucket_size / elapsed_time) << " r/s\n";
@@ -271,6 +290,8 @@ void WrappedMapper::run_alignment() {
         long batch_start = std::chrono::duration_cast<SeAlM::Mills>(
                 std::chrono::system_clock::now().time_since_epoch()).count();
 
+        // the last bucket was aligned before its read came back empty
+        _pipe.set_batch_align_time(elapsed_time);
         auto write_future = _pipe.write_async(alignments);
         write_future.wait();
 
@@ -287,6 +308,11 @@ void WrappedMapper::run_alignment() {
     long end = std::chrono::duration_cast<SeAlM::Mills>(std::chrono::system_clock::now().time_since_epoch()).count();
     _total_time = (end - start) / 1000.00;
 
+    if (cfile) {
+        _pipe.cache_stats().serialize(cfile, file_names);
+        cfile.close();
+    }
+
     if (!_metric_file.empty()) {
         mfile.open(_metric_file, std::ios::app);
         mfile << "# config:" << _config_file << " total_reads:" << _reads_seen << " runtime:" << _total_time
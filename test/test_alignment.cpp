@@ -0,0 +1,192 @@
+#include <catch2/catch.hpp>
+
+#include "../lib/alignment.hpp"
+
+TEST_CASE("alignment records rebuild SAM lines from the read", "[AlignmentRecord]") {
+    std::string name = "read_1";
+    std::string seq = "ACGTTGCAAC";
+    std::string qual = "ABCDEFGHIJ";
+    std::string tags = "AS:i:-3\tXN:i:0\tMD:Z:10";
+
+    AlignmentRecord record;
+
+    SECTION("forward alignments round trip") {
+        std::string line = name + "\t0\tchr1\t1042\t42\t4M1I5M\t*\t0\t0\t" + seq + "\t" + qual + "\t" + tags;
+        REQUIRE(record.parse(line, read_name("@" + name + " 1:N:0"), seq, qual));
+        std::string bytes;
+        record.encode(bytes);
+        REQUIRE(AlignmentRecord::is_record(bytes));
+        REQUIRE(bytes.size() < line.size() - name.size() - seq.size());
+
+        AlignmentRecord decoded;
+        REQUIRE(decoded.decode(bytes));
+        std::string out;
+        decoded.render(out, name, seq, qual);
+        REQUIRE(out == line);
+
+        out.clear();
+        decoded.render(out, "read_2", seq, "JJJJJJJJJJ");
+        REQUIRE(out == "read_2\t0\tchr1\t1042\t42\t4M1I5M\t*\t0\t0\t" + seq + "\tJJJJJJJJJJ\t" + tags);
+    }
+
+    SECTION("reverse strand alignments store the read's orientation") {
+        std::string line = name + "\t16\tchr2\t7\t1\t10M\t=\t100\t-93\tGTTGCAACGT\tJIHGFEDCBA";
+        REQUIRE(record.parse(line, name, seq, qual));
+        REQUIRE(record.tags.empty());
+        std::string bytes;
+        record.encode(bytes);
+        AlignmentRecord decoded;
+        REQUIRE(decoded.decode(bytes));
+        std::string out;
+        decoded.render(out, name, seq, qual);
+        REQUIRE(out == line);
+    }
+
+    SECTION("unaligned reads round trip") {
+        std::string line = name + "\t4\t*\t0\t0\t*\t*\t0\t0\t" + seq + "\t" + qual + "\tYT:Z:UU";
+        REQUIRE(record.parse(line, name, seq, qual));
+        std::string bytes, out;
+        record.encode(bytes);
+        AlignmentRecord decoded;
+        REQUIRE(decoded.decode(bytes));
+        decoded.render(out, name, seq, qual);
+        REQUIRE(out == line);
+    }
+
+    SECTION("lines that cannot be rebuilt are rejected") {
+        REQUIRE(!record.parse(name + "\t0\tchr1\t1\t42\t2H10M\t*\t0\t0\t" + seq + "\t" + qual, name, seq, qual));
+        REQUIRE(!record.parse("other\t0\tchr1\t1\t42\t10M\t*\t0\t0\t" + seq + "\t" + qual, name, seq, qual));
+        REQUIRE(!record.parse(name + "\t0\tchr1\t1\t42\t10M\t*\t0\t0\t*\t*", name, seq, qual));
+        REQUIRE(!record.parse(name + "\t0\tchr1\t1\t42\t10M", name, seq, qual));
+        REQUIRE(!record.parse(name + "\t0\tchr1\t1\t42\t99999999999M\t*\t0\t0\t" + seq + "\t" + qual, name, seq, qual));
+        REQUIRE(!record.parse(name + "\t0\tchr1\t1\t42\tM10\t*\t0\t0\t" + seq + "\t" + qual, name, seq, qual));
+        REQUIRE(!record.decode(name));
+        REQUIRE(!record.decode(std::string(1, RECORD_TAG) + "\x10"));
+    }
+
+    SECTION("records flip to the reverse complement of the read") {
+        std::string rc_seq = reverse_complement(seq);
+        std::string rc_qual(qual.rbegin(), qual.rend());
+        std::string line = name + "\t0\tchr1\t1042\t42\t10M\t*\t0\t0\t" + seq + "\t" + qual + "\tOQ:Z:JJJJJJJJJJ\t" + tags;
+        REQUIRE(record.parse(line, name, seq, qual));
+        record.flip_strand();
+        std::string bytes, out;
+        record.encode(bytes);
+        AlignmentRecord decoded;
+        REQUIRE(decoded.decode(bytes));
+        decoded.render(out, "read_2", rc_seq, rc_qual);
+        REQUIRE(out == "read_2\t16\tchr1\t1042\t42\t10M\t*\t0\t0\t" + seq + "\t" + qual + "\t" + tags);
+    }
+}
+
+TEST_CASE("reads and their reverse complements share canonical keys", "[CanonicalKeys]") {
+    std::string seq = "ACGTTGCAAC";
+    std::string rc_seq = reverse_complement(seq);
+    std::string qual = "ABCDEFGHIJ";
+    std::string rc_qual = "KLMNOPQRST";
+
+    REQUIRE(rc_seq == "GTTGCAACGT");
+    REQUIRE(is_canonical(seq) != is_canonical(rc_seq));
+    REQUIRE(is_canonical("ACGT"));
+
+    SECTION("mapped lines keep SEQ in reference orientation") {
+        std::string line = "read_1\t0\tchr1\t1042\t42\t10M\t*\t0\t0\t" + seq + "\t" + qual + "\tAS:i:0\tMD:Z:10";
+        std::string out;
+        REQUIRE(!reorient_line(line, seq, qual, out));
+        REQUIRE(reorient_line(line, rc_seq, rc_qual, out));
+        REQUIRE(out == "read_1\t16\tchr1\t1042\t42\t10M\t*\t0\t0\t" + seq + "\tTSRQPONMLK\tAS:i:0\tMD:Z:10");
+
+        std::string back;
+        REQUIRE(reorient_line(out, seq, qual, back));
+        REQUIRE(back == line);
+    }
+
+    SECTION("unmapped lines keep their flag") {
+        std::string line = "read_1\t4\t*\t0\t0\t*\t*\t0\t0\t" + seq + "\t" + qual + "\tYT:Z:UU";
+        std::string out;
+        REQUIRE(reorient_line(line, rc_seq, rc_qual, out));
+        REQUIRE(out == "read_1\t4\t*\t0\t0\t*\t*\t0\t0\t" + rc_seq + "\t" + rc_qual + "\tYT:Z:UU");
+    }
+
+    SECTION("lines for other reads are left alone") {
+        std::string line = "read_1\t0\tchr1\t1\t42\t10M\t*\t0\t0\tAAAAAAAAAA\t" + qual;
+        std::string out;
+        REQUIRE(!reorient_line(line, seq, qual, out));
+        REQUIRE(!reorient_line("not a sam line", seq, qual, out));
+        REQUIRE(out.empty());
+    }
+}
+
+TEST_CASE("alignments are cut for reads contained in the aligned read", "[ContainedAlignment]") {
+    // 40bp read with mismatches against the reference at read positions 5 and 30
+    std::string seq = "ACGTTGCAACGGATCCTAGCATCGATCGGATCTTAGCCAT";
+    std::string qual(40, 'I');
+    std::string tags = "AS:i:-12\tXN:i:0\tXM:i:2\tXO:i:0\tXG:i:0\tNM:i:2\tMD:Z:5C24A9\tYT:Z:UU";
+    ScoringScheme scoring = ScoringScheme::bowtie2(false);
+    AlignmentRecord record, slice;
+    std::string sliced_tags, out;
+
+    SECTION("forward alignments are offset and their tags cut") {
+        std::string line = "read\t0\tchr1\t100\t42\t40M\t*\t0\t0\t" + seq + "\t" + qual + "\t" + tags;
+        REQUIRE(record.parse(line));
+        REQUIRE(slice_alignment(record, seq.size(), 10, seq.substr(10, 25), qual.substr(10, 25), scoring, slice,
+                                sliced_tags));
+        slice.render(out, "trimmed", seq.substr(10, 25), qual.substr(10, 25));
+        REQUIRE(out == "trimmed\t0\tchr1\t110\t42\t25M\t*\t0\t0\t" + seq.substr(10, 25) + "\t" + qual.substr(10, 25) +
+                       "\tAS:i:-6\tXN:i:0\tXM:i:1\tXO:i:0\tXG:i:0\tNM:i:1\tMD:Z:20A4\tYT:Z:UU");
+
+        // a prefix missing both mismatches
+        REQUIRE(slice_alignment(record, seq.size(), 0, seq.substr(0, 5), qual.substr(0, 5), scoring, slice,
+                                sliced_tags));
+        REQUIRE(detail::find_tag(slice.tags, "MD:Z:") == std::string_view("5"));
+        REQUIRE(detail::find_tag(slice.tags, "AS:i:") == std::string_view("0"));
+    }
+
+    SECTION("reverse strand slices are counted from the end of SEQ") {
+        std::string line = "read\t16\tchr1\t100\t42\t40M\t*\t0\t0\t" + reverse_complement(seq) + "\t" + qual + "\t" + tags;
+        REQUIRE(record.parse(line));
+        // read positions 0-9 are SEQ positions 30-39, holding the mismatch at 30
+        REQUIRE(slice_alignment(record, seq.size(), 0, seq.substr(0, 10), qual.substr(0, 10), scoring, slice,
+                                sliced_tags));
+        REQUIRE(slice.pos == 130);
+        REQUIRE(slice.reverse());
+        REQUIRE(detail::find_tag(slice.tags, "MD:Z:") == std::string_view("0A9"));
+        REQUIRE(detail::find_tag(slice.tags, "NM:i:") == std::string_view("1"));
+    }
+
+    SECTION("=/X CIGARs are cut") {
+        std::string line = "read\t0\tchr1\t100\t42\t5=1X24=1X9=\t*\t0\t0\t" + seq + "\t" + qual + "\t" + tags;
+        REQUIRE(record.parse(line));
+        REQUIRE(slice_alignment(record, seq.size(), 3, seq.substr(3, 30), qual.substr(3, 30), scoring, slice,
+                                sliced_tags));
+        out.clear();
+        slice.render(out, "trimmed", seq.substr(3, 30), qual.substr(3, 30));
+        REQUIRE(out.find("\t103\t42\t2=1X24=1X2=\t") != std::string::npos);
+    }
+
+    SECTION("alignments that cannot be cut are rejected") {
+        std::string gapped = "read\t0\tchr1\t100\t42\t20M1D20M\t*\t0\t0\t" + seq + "\t" + qual + "\tMD:Z:20^A20";
+        REQUIRE(record.parse(gapped));
+        REQUIRE_FALSE(slice_alignment(record, seq.size(), 0, seq.substr(0, 30), qual, scoring, slice, sliced_tags));
+
+        std::string secondary = "read\t0\tchr1\t100\t42\t40M\t*\t0\t0\t" + seq + "\t" + qual + "\t" + tags + "\tXS:i:-12";
+        REQUIRE(record.parse(secondary));
+        REQUIRE_FALSE(slice_alignment(record, seq.size(), 0, seq.substr(0, 30), qual, scoring, slice, sliced_tags));
+
+        std::string paired = "read\t99\tchr1\t100\t42\t40M\t=\t300\t240\t" + seq + "\t" + qual + "\t" + tags;
+        REQUIRE(record.parse(paired));
+        REQUIRE_FALSE(slice_alignment(record, seq.size(), 0, seq.substr(0, 30), qual, scoring, slice, sliced_tags));
+
+        std::string untagged = "read\t0\tchr1\t100\t42\t40M\t*\t0\t0\t" + seq + "\t" + qual;
+        REQUIRE(record.parse(untagged));
+        REQUIRE_FALSE(slice_alignment(record, seq.size(), 0, seq.substr(0, 30), qual, scoring, slice, sliced_tags));
+    }
+
+    SECTION("malformed MD tags are rejected") {
+        // a run length that overflows, the alignment cannot be cut without knowing it
+        std::string overflow = "read\t0\tchr1\t100\t42\t40M\t*\t0\t0\t" + seq + "\t" + qual +
+                               "\tMD:Z:99999999999999999999C24A9";
+        REQUIRE(record.parse(overflow));
+        REQUIRE_FALSE(slice_alignment(record, seq.size(), 0, seq.substr(0, 30), qual, scoring, slice, sliced_tags));
+    }
+}
@@ -4,8 +4,15 @@
 
 #define CATCH_CONFIG_ENABLE_BENCHMARKING
 #include <catch2/catch.hpp>
+#include <sstream>
 
 #include "../lib/cache.hpp"
+#include "../lib/shm_cache.hpp"
+#include "../lib/disk_cache.hpp"
+#include "../lib/compressed_cache.hpp"
+#include "../lib/near_cache.hpp"
+#include "../lib/maintained_cache.hpp"
+#include "../lib/cache_stats.hpp"
 
 TEST_CASE("dummy cache initializes correctly" "[DummyCache]") {
     DummyCache<std::string, std::string> cache;
@@ -19,7 +26,7 @@ TEST_CASE("dummy cache initializes correctly" "[DummyCache]") {
     SECTION("dummy cache stores no values") {
         cache.insert(key, value);
         REQUIRE(cache.size() == 0);
-        REQUIRE(cache.find(key) == cache.end());
+        REQUIRE(!cache.find(key));
         REQUIRE(cache[key] != value);
         REQUIRE(cache.hits() == 0);
     }
@@ -40,7 +47,7 @@ TEST_CASE("lru cache initializes and evicts correctly" "[LRUCache]") {
     SECTION("lru cache stores single value correctly") {
         cache.insert(key, value);
         REQUIRE(cache.size() == 1);
-        REQUIRE(cache.find(key) != cache.end());
+        REQUIRE(cache.find(key));
         REQUIRE(cache[key] == value);
         REQUIRE(cache.hits() == 1);
     }
@@ -56,6 +63,16 @@ TEST_CASE("lru cache initializes and evicts correctly" "[LRUCache]") {
         REQUIRE(cache.hits() == 2);
     }
 
+    SECTION("lru cache find results outlive later finds") {
+        std::string other_key = "test_key2";
+        cache.insert(key, value);
+        cache.insert(other_key, value + "2");
+        auto first = cache.find(key);
+        auto second = cache.find(other_key);
+        REQUIRE(first->get() == value);
+        REQUIRE(second->get() == value + "2");
+    }
+
     SECTION("lru cache evicts proper key-value pair") {
         std::string first_key = key;
         cache.insert(key, value);
@@ -65,7 +82,7 @@ TEST_CASE("lru cache initializes and evicts correctly" "[LRUCache]") {
             cache.insert(key, value);
         }
         REQUIRE(cache.size() == cache.capacity());
-        REQUIRE(cache.find(first_key) == cache.end());
+        REQUIRE(!cache.find(first_key));
     }
 }
 
@@ -87,8 +104,16 @@ TEST_CASE("mru cache evicts correctly" "[MRUCache]") {
         }
         std::string last_key = "test_key" + std::to_string(cache.capacity());
         REQUIRE(cache.size() == cache.capacity());
-        REQUIRE(cache.find(first_key) != cache.end());
-        REQUIRE(cache.find(last_key) == cache.end());
+        REQUIRE(cache.find(first_key));
+        REQUIRE(!cache.find(last_key));
+    }
+
+    SECTION("mru cache trims to an empty cache") {
+        cache.insert(key, value);
+        cache.set_max_size(0);
+        cache.trim();
+        REQUIRE(cache.size() == 0);
+        REQUIRE(cache.bytes() == 0);
     }
 }
 
@@ -97,7 +122,7 @@ TEST_CASE("bloom filter cache behaves as expected", "[BFECache]"){
     std::string key = "ACGTN";
     std::string not_key = "TGCNA";
 
-    BFECache<std::string, std::string> cache(65536, 2, key.size());
+    BFECache<std::string, std::string> cache(cache_size);
     std::shared_ptr<CacheIndex<std::string, std::string> > c;
     c = std::make_shared<LRUCache<std::string, std::string> >();
     cache.set_cache(c);
@@ -110,32 +135,91 @@ TEST_CASE("bloom filter cache behaves as expected", "[BFECache]"){
         REQUIRE(!cache.possibly_exists(not_key));
     }
 
+    SECTION("false positive rate matches the sizing") {
+        REQUIRE(cache.filter_bytes() % 64 == 0);
+        for (int i = 0; i < cache_size; i++) {
+            cache.add_key(key + std::to_string(i));
+        }
+        int false_negatives = 0, false_positives = 0;
+        for (int i = 0; i < 100 * cache_size; i++) {
+            false_negatives += !cache.possibly_exists(key + std::to_string(i % cache_size));
+            false_positives += cache.possibly_exists(not_key + std::to_string(i));
+        }
+        REQUIRE(false_negatives == 0);
+        REQUIRE(false_positives < 100 * cache_size * 0.02);
+    }
+
+    SECTION("old keys age out and the false positive rate stays bounded") {
+        for (int i = 0; i < cache_size; i++) {
+            cache.add_key(key + std::to_string(i));
+        }
+        // far more distinct keys than the filter was sized for
+        for (int i = 0; i < 100 * cache_size; i++) {
+            cache.add_key(not_key + std::to_string(i));
+        }
+        REQUIRE(cache.rotations() >= 100);
+        REQUIRE(cache.possibly_exists(not_key + std::to_string(100 * cache_size - 1)));
+        int remembered = 0, false_positives = 0;
+        for (int i = 0; i < 100 * cache_size; i++) {
+            remembered += cache.possibly_exists(key + std::to_string(i % cache_size));
+            false_positives += cache.possibly_exists(std::to_string(i) + key);
+        }
+        REQUIRE(remembered < 100 * cache_size * 0.02);
+        REQUIRE(false_positives < 100 * cache_size * 0.02);
+    }
+
+    SECTION("evicting the cache's capacity rotates the filter") {
+        cache.set_max_size(10);
+        uint64_t rotations = cache.rotations();
+        for (int i = 0; i < 30; i++) {
+            cache.insert(key + std::to_string(i), key);
+            cache.insert(key + std::to_string(i), key);
+        }
+        REQUIRE(cache.size() <= 10);
+        REQUIRE(cache.rotations() == rotations + 2);
+        // keys seen since the last rotation are still remembered
+        REQUIRE(cache.possibly_exists(key + std::to_string(29)));
+    }
+
     cache.clear();
     cache.set_max_size(1);
     std::string value = "test";
     SECTION("bloom decorates cache correctly") {
         REQUIRE(cache.capacity() == 1);
         cache.insert(key, value);
-        REQUIRE(cache.find(key) == cache.end());
+        REQUIRE(!cache.find(key));
         REQUIRE(cache.misses() == 1);
         cache.insert(key, value);
-        REQUIRE(cache.find(key) != cache.end());
+        REQUIRE(cache.find(key));
         REQUIRE(cache.at(key) == value);
         REQUIRE(cache.size() == 1);
         REQUIRE(cache.hits() == 1);
 
         cache.insert(not_key, value);
-        REQUIRE(cache.find(key) != cache.end());
+        REQUIRE(cache.find(key));
         REQUIRE(cache.at(key) == value);
         REQUIRE(cache.size() == 1);
         REQUIRE(cache.hits() == 2);
 
         cache.insert(not_key, value);
-        REQUIRE(cache.find(key) == cache.end());
+        REQUIRE(!cache.find(key));
         REQUIRE(cache.misses() == 2);
         REQUIRE(cache.size() == 1);
     }
 
+    SECTION("batches are filtered like single calls") {
+        std::vector<std::string> keys = {key, not_key, key};
+        std::vector<std::string> values = {value, value, value};
+        cache.insert_many(keys, values, {1, 1, 1});
+        // key was seen by the filter before its second insert, not_key only once
+        REQUIRE(cache.size() == 1);
+        std::vector<std::shared_ptr<const std::string> > handles;
+        cache.find_many({key, not_key, "ACGTA"}, handles);
+        REQUIRE(*handles[0] == value);
+        REQUIRE(!handles[1]);
+        REQUIRE(!handles[2]);
+    }
+
     cache.clear();
     cache.set_max_size(cache_size);
     std::string value1 = "test1";
@@ -180,7 +264,7 @@ TEST_CASE("benchmark cache inserting with lru eviction" "[LRUCache]"){
 
     BENCHMARK("Baseline Search (Dummy Cache)") {
            for (int i = 0; i < cache_size; i++) {
-               if (baseline.find(key + std::to_string(i)) != baseline.end()){
+               if (baseline.find(key + std::to_string(i))){
                    value = cache.at(key + std::to_string(i));
                }
            }
@@ -188,7 +272,7 @@ TEST_CASE("benchmark cache inserting with lru eviction" "[LRUCache]"){
 
     BENCHMARK("Search") {
         for (int i = 0; i < cache_size; i++) {
-            if(cache.find(key + std::to_string(i)) != cache.end()){
+            if(cache.find(key + std::to_string(i))){
                 value = cache.at(key + std::to_string(i));
             }
         }
@@ -210,7 +294,7 @@ TEST_CASE("benchmark cache inserting with lru eviction" "[LRUCache]"){
 
     BENCHMARK("Baseline Search long key, long value (Dummy Cache)") {
            for (int i = 0; i < cache_size; i++) {
-               if (baseline.find(key + std::to_string(i)) != baseline.end()){
+               if (baseline.find(key + std::to_string(i))){
                    value = cache.at(key + std::to_string(i));
                }
            }
@@ -218,7 +302,7 @@ TEST_CASE("benchmark cache inserting with lru eviction" "[LRUCache]"){
 
     BENCHMARK("Search long key, long value"){
         for (int i = 0; i < cache_size; i++) {
-            if(cache.find(key + std::to_string(i)) != cache.end()){
+            if(cache.find(key + std::to_string(i))){
                 value = cache.at(key + std::to_string(i));
             }
         }
@@ -242,12 +326,12 @@ TEST_CASE("benchmark cache inserting with cstrings" "[LRUCache]"){
     };
 
     BENCHMARK("search string"){
-          if (cache.find(key) != cache.end())
+          if (cache.find(key))
               cache.at(key);
       };
 
     BENCHMARK("search cstring"){
-      if (ccache.find(key.c_str()) != ccache.end())
+      if (ccache.find(key.c_str()))
           ccache.at(key.c_str());
   };
 }
@@ -287,7 +371,7 @@ TEST_CASE("benchmark cache compressed inserting with lru eviction" "[LRUCache]")
 
     cache.insert(key, value);
     BENCHMARK("Baseline Search") {
-         if (cache.find(key) != cache.end()){
+         if (cache.find(key)){
              value = cache.at(key);
          }
      };
@@ -298,11 +382,1437 @@ TEST_CASE("benchmark cache compressed inserting with lru eviction" "[LRUCache]")
    };
 
     cache.insert(extract_key_fn(key), value);
-    REQUIRE(cache.find(extract_key_fn(key)) != cache.end());
+    REQUIRE(cache.find(extract_key_fn(key)));
 
     BENCHMARK("Search Compressed") {
-        if (cache.find(extract_key_fn(key)) != cache.end()){
+        if (cache.find(extract_key_fn(key))){
                 value = cache.at(extract_key_fn(key));
         }
     };
-}
\ No newline at end of file
+}
+TEST_CASE("sharded cache distributes and evicts correctly", "[ShardedCache]") {
+    int cache_size = 1000;
+    ShardedCache<std::string, std::string> cache(4, cache_size);
+
+    std::string key = "test_key";
+    std::string value = "test_value";
+
+    REQUIRE(cache.num_shards() == 4);
+    REQUIRE(cache.capacity() == cache_size);
+    REQUIRE(cache.hits() == 0);
+
+    SECTION("sharded cache stores and finds values across shards") {
+        for (int i = 0; i < 100; i++) {
+            cache.insert_no_evict(key + std::to_string(i), value + std::to_string(i));
+        }
+        REQUIRE(cache.size() == 100);
+        for (int i = 0; i < 100; i++) {
+            REQUIRE(cache.find(key + std::to_string(i)));
+            REQUIRE(cache.at(key + std::to_string(i)) == value + std::to_string(i));
+        }
+        REQUIRE(!cache.find("not_a_key"));
+        REQUIRE(cache.hits() == 100);
+        REQUIRE(cache.misses() == 1);
+    }
+
+    SECTION("sharded cache trims every shard to its share of capacity") {
+        for (int i = 0; i < 2 * cache_size; i++) {
+            cache.insert_no_evict(key + std::to_string(i), value + std::to_string(i));
+        }
+        REQUIRE(cache.size() == 2 * cache_size);
+        cache.trim();
+        REQUIRE(cache.size() <= cache.capacity());
+    }
+
+    SECTION("sharded cache batches keep their order across shards") {
+        std::vector<std::string> keys, values;
+        for (int i = 0; i < 100; i++) {
+            keys.push_back(key + std::to_string(i));
+            values.push_back(value + std::to_string(i));
+        }
+        std::vector<double> costs(keys.size(), 1);
+        cache.insert_many(keys, values, costs);
+        REQUIRE(cache.size() == 100);
+        keys.push_back("not_a_key");
+        std::vector<std::shared_ptr<const std::string> > handles;
+        cache.find_many(keys, handles);
+        REQUIRE(handles.size() == keys.size());
+        for (int i = 0; i < 100; i++) {
+            REQUIRE(*handles[i] == value + std::to_string(i));
+        }
+        REQUIRE(!handles.back());
+        REQUIRE(cache.hits() == 100);
+        REQUIRE(cache.misses() == 1);
+    }
+}
+
+TEST_CASE("cache lookup probes and touches in a single call", "[LRUCache]") {
+    int cache_size = 3;
+    LRUCache<std::string, std::string> cache;
+    cache.set_max_size(cache_size);
+    DummyCache<std::string, std::string> baseline;
+
+    SECTION("lookup counts hits and misses") {
+        cache.insert("a", "1");
+        auto hit = cache.lookup("a");
+        REQUIRE(hit);
+        REQUIRE(hit->get() == "1");
+        REQUIRE(!cache.lookup("b"));
+        REQUIRE(cache.hits() == 1);
+        REQUIRE(cache.misses() == 1);
+        REQUIRE(!baseline.lookup("a"));
+    }
+
+    SECTION("lookup refreshes recency") {
+        cache.insert("a", "1");
+        cache.insert("b", "2");
+        cache.lookup("a");
+        cache.insert("c", "3");
+        // b is now least recently used
+        REQUIRE(cache.lookup("a"));
+        REQUIRE(!cache.lookup("b"));
+    }
+
+    SECTION("acquired handles share the cached value and outlive its eviction") {
+        cache.insert("a", "1");
+        auto handle = cache.acquire("a");
+        REQUIRE(handle);
+        REQUIRE(handle.get() == &cache.lookup("a")->get());
+        REQUIRE(!cache.acquire("b"));
+        REQUIRE(cache.hits() == 2);
+        REQUIRE(cache.misses() == 1);
+        for (std::string key : {"b", "c", "d", "e"})
+            cache.insert(key, key);
+        REQUIRE(!cache.lookup("a"));
+        REQUIRE(*handle == "1");
+        REQUIRE(!baseline.acquire("a"));
+    }
+
+    SECTION("lookup handles outlive the entry's eviction") {
+        cache.insert("a", "1");
+        auto hit = cache.lookup("a");
+        for (std::string key : {"b", "c", "d", "e"})
+            cache.insert(key, key);
+        REQUIRE(!cache.contains("a"));
+        REQUIRE(hit);
+        REQUIRE(hit->get() == "1");
+        REQUIRE(cache.size() == 2);
+    }
+
+    SECTION("batches probe and insert like single calls") {
+        std::vector<std::string> keys = {"a", "b", "a"};
+        std::vector<std::string> values = {"1", "2", "3"};
+        cache.insert_many(keys, values, {1, 1, 1});
+        REQUIRE(cache.size() == 2);
+        std::vector<std::shared_ptr<const std::string> > handles;
+        cache.find_many({"b", "c", "a"}, handles);
+        REQUIRE(*handles[0] == "2");
+        REQUIRE(!handles[1]);
+        REQUIRE(*handles[2] == "1");
+        REQUIRE(cache.hits() == 2);
+        REQUIRE(cache.misses() == 1);
+        // the batch touched b before a, so b is evicted first
+        cache.insert("c", "3");
+        REQUIRE(!cache.lookup("b"));
+        REQUIRE(cache.lookup("a"));
+    }
+
+    SECTION("fetch_into copies into the caller's buffer") {
+        cache.insert("a", "1");
+        std::string buff;
+        cache.fetch_into("a", &buff);
+        REQUIRE(buff == "1");
+        cache.fetch_into("b", &buff);
+        REQUIRE(buff == "1");
+        REQUIRE(cache.hits() == 1);
+        REQUIRE(cache.misses() == 1);
+    }
+}
+
+TEST_CASE("slab lru cache evicts and relinks correctly", "[SlabLRUCache]") {
+    int cache_size = 1000;
+    SlabLRUCache<std::string, std::string> cache(cache_size);
+
+    std::string key = "test_key";
+    std::string value = "test_value";
+
+    REQUIRE(cache.capacity() == cache_size);
+    REQUIRE(cache.size() == 0);
+
+    SECTION("slab lru cache stores single value correctly") {
+        cache.insert(key, value);
+        REQUIRE(cache.size() == 1);
+        REQUIRE(cache.find(key));
+        REQUIRE(cache.find(key)->get().compare(value) == 0);
+        REQUIRE(cache.at(key) == value);
+        REQUIRE(cache.hits() == 2);
+    }
+
+    SECTION("slab lru cache evicts least recently used key") {
+        std::string first_key = key;
+        cache.insert(first_key, value);
+        for (int i = 0; i < cache_size; i++) {
+            cache.insert(key + std::to_string(i + 2), value + std::to_string(i + 2));
+        }
+        REQUIRE(cache.size() == cache.capacity());
+        REQUIRE(!cache.find(first_key));
+        REQUIRE(cache.find(key + "2"));
+    }
+
+    SECTION("slab lru cache keeps touched keys and trims overflow") {
+        for (int i = 0; i < cache_size; i++) {
+            cache.insert_no_evict(key + std::to_string(i), value + std::to_string(i));
+        }
+        REQUIRE(cache.lookup(key + "0"));
+        for (int i = cache_size; i < 3 * cache_size; i++) {
+            cache.insert_no_evict(key + std::to_string(i), value + std::to_string(i));
+        }
+        cache.trim();
+        REQUIRE(cache.size() == cache.capacity());
+        // evicted in recency order, entry 0 was touched before the second batch was added
+        REQUIRE(!cache.lookup(key + "1"));
+        REQUIRE(!cache.lookup(key + "0"));
+        for (int i = 2 * cache_size; i < 3 * cache_size; i++) {
+            REQUIRE(cache.lookup(key + std::to_string(i))->get() == value + std::to_string(i));
+        }
+    }
+
+    SECTION("slab lru cache reuses freed entries") {
+        cache.set_max_size(10);
+        for (int i = 0; i < 200; i++) {
+            cache.insert(key + std::to_string(i), value + std::to_string(i));
+        }
+        REQUIRE(cache.size() == 10);
+        for (int i = 190; i < 200; i++) {
+            REQUIRE(cache.at(key + std::to_string(i)) == value + std::to_string(i));
+        }
+    }
+
+    SECTION("slab lru cache resolves batches larger than the prefetch distance") {
+        std::vector<std::string> keys, values;
+        for (int i = 0; i < cache_size; i++) {
+            keys.push_back(key + std::to_string(i));
+            values.push_back(value + std::to_string(i));
+        }
+        std::vector<double> costs(keys.size(), 1);
+        cache.insert_many(keys, values, costs);
+        REQUIRE(cache.size() == cache_size);
+        for (int i = 0; i < cache_size; i += 2) {
+            keys[i] = "missing" + std::to_string(i);
+        }
+        std::vector<std::shared_ptr<const std::string> > handles;
+        cache.find_many(keys, handles);
+        for (int i = 0; i < cache_size; i++) {
+            if (i % 2 == 0)
+                REQUIRE(!handles[i]);
+            else
+                REQUIRE(*handles[i] == value + std::to_string(i));
+        }
+        REQUIRE(cache.hits() == cache_size / 2);
+        REQUIRE(cache.misses() == cache_size / 2);
+    }
+
+    SECTION("slab lru cache hands out values that outlive their entry") {
+        cache.set_max_size(10);
+        cache.insert(key, value);
+        auto handle = cache.acquire(key);
+        REQUIRE(handle.get() == &cache.at(key));
+        for (int i = 0; i < 20; i++) {
+            cache.insert(key + std::to_string(i), value + std::to_string(i));
+        }
+        REQUIRE(!cache.lookup(key));
+        REQUIRE(*handle == value);
+        // the held entry is not reused, the others are once it is dropped
+        for (int i = 20; i < 40; i++) {
+            cache.insert(key + std::to_string(i), value + std::to_string(i));
+        }
+        REQUIRE(*handle == value);
+        handle.reset();
+        for (int i = 40; i < 60; i++) {
+            cache.insert(key + std::to_string(i), value + std::to_string(i));
+        }
+        REQUIRE(cache.at(key + "59") == value + "59");
+    }
+
+    SECTION("slab lru cache references stay valid as the slab grows") {
+        cache.insert(key, value);
+        std::string &cached = cache.at(key);
+        for (int i = 0; i < 4 * cache_size; i++) {
+            cache.insert_no_evict(key + std::to_string(i), value + std::to_string(i));
+        }
+        REQUIRE(&cache.at(key) == &cached);
+        REQUIRE(cached == value);
+    }
+
+    SECTION("slab lru cache handles outlive the cache") {
+        std::shared_ptr<const std::string> handle;
+        {
+            SlabLRUCache<std::string, std::string> scoped(10);
+            scoped.insert(key, value);
+            handle = scoped.acquire(key);
+        }
+        REQUIRE(*handle == value);
+    }
+}
+
+TEST_CASE("clock cache gives referenced keys a second chance", "[ClockCache]") {
+    int cache_size = 100;
+    ClockCache<std::string, std::string> cache(cache_size);
+
+    std::string key = "test_key";
+    std::string value = "test_value";
+
+    SECTION("clock cache stores and finds values") {
+        cache.insert(key, value);
+        REQUIRE(cache.size() == 1);
+        REQUIRE(cache.find(key));
+        REQUIRE(cache.lookup(key)->get() == value);
+        REQUIRE(!cache.find("not_a_key"));
+        REQUIRE(cache.hits() == 2);
+        REQUIRE(cache.misses() == 1);
+    }
+
+    SECTION("clock cache evicts unreferenced keys first") {
+        for (int i = 0; i < cache_size; i++) {
+            cache.insert(key + std::to_string(i), value + std::to_string(i));
+        }
+        // reference the first half
+        for (int i = 0; i < cache_size / 2; i++) {
+            REQUIRE(cache.lookup(key + std::to_string(i)));
+        }
+        for (int i = cache_size; i < cache_size + cache_size / 2; i++) {
+            cache.insert(key + std::to_string(i), value + std::to_string(i));
+        }
+        REQUIRE(cache.size() == cache_size);
+        for (int i = 0; i < cache_size / 2; i++) {
+            REQUIRE(cache.lookup(key + std::to_string(i)));
+        }
+        REQUIRE(!cache.lookup(key + std::to_string(cache_size / 2)));
+    }
+
+    SECTION("clock cache trims overflow") {
+        for (int i = 0; i < 3 * cache_size; i++) {
+            cache.insert_no_evict(key + std::to_string(i), value + std::to_string(i));
+        }
+        cache.trim();
+        REQUIRE(cache.size() == cache_size);
+    }
+
+    SECTION("clock cache size is read while another thread inserts") {
+        std::atomic<bool> done{false};
+        std::thread writer([&]() {
+            for (int i = 0; i < 20 * cache_size; i++)
+                cache.insert(key + std::to_string(i), value);
+            done = true;
+        });
+        bool bounded = true;
+        while (!done)
+            bounded = bounded && cache.size() <= cache_size;
+        writer.join();
+        REQUIRE(bounded);
+        REQUIRE(cache.size() == cache_size);
+        cache.clear();
+        REQUIRE(cache.size() == 0);
+    }
+
+    SECTION("clock cache peeks the entry the hand evicts next") {
+        for (int i = 0; i < cache_size; i++) {
+            cache.insert(key + std::to_string(i), value);
+        }
+        std::string victim;
+        REQUIRE(cache.peek_victim(key, victim));
+        REQUIRE(victim == key + "0");
+        REQUIRE(cache.lookup(key + "0"));
+        REQUIRE(cache.peek_victim(key, victim));
+        REQUIRE(victim == key + "1");
+        // peeking left the reference bit, so the hand still passes over the first key
+        cache.insert(key, value);
+        REQUIRE(cache.lookup(key + "0"));
+        REQUIRE(!cache.lookup(key + "1"));
+    }
+
+    SECTION("clock cache peeks past free slots ahead of the hand") {
+        for (int i = 0; i < cache_size; i++) {
+            cache.insert(key + std::to_string(i), value);
+        }
+        // evicts slots 10-19, leaving the hand just past them
+        for (int i = 0; i < 10; i++) {
+            REQUIRE(cache.lookup(key + std::to_string(i)));
+        }
+        cache.set_max_size(cache_size - 10);
+        cache.trim();
+        // the hand laps round to evict slot 9 and stops just ahead of the free slots
+        for (int i = 0; i < cache_size; i++) {
+            if (i != 9)
+                cache.lookup(key + std::to_string(i));
+        }
+        cache.set_max_size(cache_size - 11);
+        cache.trim();
+        REQUIRE(!cache.contains(key + "9"));
+        std::string victim;
+        REQUIRE(cache.peek_victim(key, victim));
+        REQUIRE(victim == key + "20");
+    }
+}
+
+TEST_CASE("s3fifo cache filters one-time keys", "[S3FIFOCache]") {
+    int cache_size = 100;
+    S3FIFOCache<std::string, std::string> cache(cache_size);
+
+    std::string key = "test_key";
+    std::string value = "test_value";
+
+    SECTION("frequently used keys survive a scan of one-time keys") {
+        for (int i = 0; i < 10; i++) {
+            cache.insert(key + std::to_string(i), value);
+            cache.lookup(key + std::to_string(i));
+            cache.lookup(key + std::to_string(i));
+        }
+        for (int i = 0; i < 10 * cache_size; i++) {
+            cache.insert("scan" + std::to_string(i), value);
+        }
+        REQUIRE(cache.size() == cache_size);
+        for (int i = 0; i < 10; i++) {
+            REQUIRE(cache.lookup(key + std::to_string(i)));
+        }
+    }
+
+    SECTION("keys evicted from the small queue are remembered") {
+        cache.insert(key, value);
+        for (int i = 0; i < cache_size; i++) {
+            cache.insert("scan" + std::to_string(i), value);
+        }
+        REQUIRE(!cache.lookup(key));
+        REQUIRE(cache.in_ghost(key));
+        cache.insert(key, value);
+        REQUIRE(!cache.in_ghost(key));
+        REQUIRE(cache.lookup(key));
+    }
+
+    SECTION("s3fifo cache peeks the head of the queue it evicts from") {
+        std::string victim;
+        REQUIRE(!cache.peek_victim(key, victim));
+        for (int i = 0; i < cache_size; i++) {
+            cache.insert(key + std::to_string(i), value);
+        }
+        // everything entered on probation, the oldest goes first
+        REQUIRE(cache.peek_victim(key, victim));
+        REQUIRE(victim == key + "0");
+        cache.insert("scan", value);
+        REQUIRE(!cache.lookup(victim));
+        REQUIRE(cache.in_ghost(victim));
+    }
+}
+
+TEST_CASE("tinylfu cache rejects candidates colder than the main victim", "[TinyLFUCache]") {
+    int cache_size = 100;
+    std::shared_ptr<CacheIndex<std::string, std::string> > main_cache;
+    main_cache = std::make_shared<LRUCache<std::string, std::string> >(cache_size);
+    TinyLFUCache<std::string, std::string> cache;
+    cache.set_cache(main_cache);
+
+    std::string key = "test_key";
+    std::string value = "test_value";
+
+    SECTION("window is carved out of the decorated capacity") {
+        REQUIRE(cache.capacity() == cache_size);
+        REQUIRE(main_cache->capacity() < cache_size);
+    }
+
+    SECTION("sketch estimates follow lookups") {
+        for (int i = 0; i < 5; i++) {
+            cache.lookup(key);
+        }
+        REQUIRE(cache.estimate(key) >= 5);
+        REQUIRE(cache.estimate("never_seen") <= 1);
+    }
+
+    SECTION("frequently used keys survive a scan of one-time keys") {
+        for (int i = 0; i < 10; i++) {
+            for (int j = 0; j < 5; j++) {
+                cache.lookup(key + std::to_string(i));
+            }
+            cache.insert(key + std::to_string(i), value);
+        }
+        for (int i = 0; i < 10 * cache_size; i++) {
+            cache.lookup("scan" + std::to_string(i));
+            cache.insert("scan" + std::to_string(i), value);
+        }
+        REQUIRE(cache.size() <= cache_size);
+        for (int i = 0; i < 10; i++) {
+            REQUIRE(cache.lookup(key + std::to_string(i)));
+        }
+    }
+
+    SECTION("rejected candidates are reported to the eviction callback") {
+        uint64_t evicted = 0;
+        cache.set_eviction_callback([&evicted](const std::string &, const std::string &) { evicted++; });
+        for (int i = 0; i < 2 * cache_size; i++) {
+            cache.insert("scan" + std::to_string(i), value);
+        }
+        REQUIRE(evicted == cache_size);
+    }
+}
+
+TEST_CASE("arc cache balances recency and frequency", "[ARCCache]") {
+    int cache_size = 100;
+    ARCCache<std::string, std::string> cache(cache_size);
+
+    std::string key = "test_key";
+    std::string value = "test_value";
+
+    SECTION("insert evicts down to capacity") {
+        for (int i = 0; i < 2 * cache_size; i++) {
+            cache.insert(key + std::to_string(i), value);
+        }
+        REQUIRE(cache.size() == cache_size);
+        REQUIRE(!cache.lookup(key + "0"));
+        REQUIRE(cache.lookup(key + std::to_string(2 * cache_size - 1)));
+    }
+
+    SECTION("frequently used keys survive a scan of one-time keys") {
+        for (int i = 0; i < 10; i++) {
+            cache.insert(key + std::to_string(i), value);
+            cache.lookup(key + std::to_string(i));
+        }
+        REQUIRE(cache.frequent_size() == 10);
+        for (int i = 0; i < 10 * cache_size; i++) {
+            cache.insert("scan" + std::to_string(i), value);
+        }
+        REQUIRE(cache.size() == cache_size);
+        for (int i = 0; i < 10; i++) {
+            REQUIRE(cache.lookup(key + std::to_string(i)));
+        }
+    }
+
+    SECTION("ghost hits adapt the recency target") {
+        for (int i = 0; i < cache_size / 2; i++) {
+            cache.insert(key + std::to_string(i), value);
+            cache.lookup(key + std::to_string(i));
+        }
+        cache.insert(key, value);
+        for (int i = 0; i < cache_size / 2 + 10; i++) {
+            cache.insert("scan" + std::to_string(i), value);
+        }
+        REQUIRE(!cache.lookup(key));
+        REQUIRE(cache.in_ghost(key));
+        REQUIRE(cache.target() == 0);
+
+        cache.insert(key, value);
+        REQUIRE(cache.target() > 0);
+        REQUIRE(!cache.in_ghost(key));
+        REQUIRE(cache.lookup(key));
+        REQUIRE(cache.size() == cache_size);
+    }
+
+    SECTION("trim evicts entries added without eviction") {
+        for (int i = 0; i < 2 * cache_size; i++) {
+            cache.insert_no_evict(key + std::to_string(i), value);
+        }
+        REQUIRE(cache.size() == 2 * cache_size);
+        cache.trim();
+        REQUIRE(cache.size() == cache_size);
+    }
+
+    SECTION("operator[] places a default value for a missing key") {
+        cache[key] = value;
+        REQUIRE(cache.size() == 1);
+        REQUIRE(cache.recent_size() == 1);
+        REQUIRE(cache.at(key) == value);
+        REQUIRE(cache[key] == value);
+    }
+}
+
+TEST_CASE("gdsf cache evicts the least cost per byte first", "[GDSFCache]") {
+    int cache_size = 10;
+    GDSFCache<std::string, std::string> cache(cache_size);
+
+    std::string key = "test_key";
+    std::string value = "test_value";
+
+    SECTION("expensive entries survive cheap ones") {
+        for (int i = 0; i < 5; i++) {
+            cache.insert_no_evict(key + std::to_string(i), value, 100);
+        }
+        for (int i = 0; i < 4 * cache_size; i++) {
+            cache.insert("cheap" + std::to_string(i), value, 1);
+        }
+        REQUIRE(cache.size() == cache_size);
+        for (int i = 0; i < 5; i++) {
+            REQUIRE(cache.lookup(key + std::to_string(i)));
+        }
+    }
+
+    SECTION("larger values are evicted before smaller ones of equal cost") {
+        std::string large(1000, 'A');
+        for (int i = 0; i < cache_size; i++) {
+            cache.insert_no_evict(key + std::to_string(i), i % 2 ? large : value, 1);
+        }
+        cache.set_max_size(cache_size / 2);
+        cache.trim();
+        REQUIRE(cache.size() == cache_size / 2);
+        for (int i = 0; i < cache_size; i += 2) {
+            REQUIRE(cache.lookup(key + std::to_string(i)));
+        }
+    }
+
+    SECTION("evictions inflate the priority of later entries") {
+        REQUIRE(cache.inflation() == 0);
+        for (int i = 0; i < 2 * cache_size; i++) {
+            cache.insert(key + std::to_string(i), value, 1);
+        }
+        REQUIRE(cache.inflation() > 0);
+        std::string victim;
+        REQUIRE(cache.peek_victim(key, victim));
+    }
+
+    SECTION("cost reaches the policy through decorators and shards") {
+        std::shared_ptr<CacheIndex<std::string, std::string> > sharded;
+        sharded = std::make_shared<ShardedCache<std::string, std::string, GDSFCache<std::string, std::string> > >(
+                2, cache_size);
+        for (int i = 0; i < cache_size / 2; i++) {
+            sharded->insert_no_evict(key + std::to_string(i), value, 100);
+        }
+        for (int i = 0; i < 4 * cache_size; i++) {
+            sharded->insert_no_evict("cheap" + std::to_string(i), value, 1);
+            sharded->trim();
+        }
+        for (int i = 0; i < cache_size / 2; i++) {
+            REQUIRE(sharded->lookup(key + std::to_string(i)));
+        }
+    }
+
+    SECTION("cost survives tinylfu admission") {
+        auto gdsf = std::make_shared<GDSFCache<std::string, std::string> >(cache_size);
+        gdsf->set_default_cost(1);
+        std::shared_ptr<CacheIndex<std::string, std::string> > main_cache = gdsf;
+        TinyLFUCache<std::string, std::string> tinylfu;
+        tinylfu.set_cache(main_cache);
+        std::vector<std::string> keys{key, "cheap", "filler"};
+        std::vector<std::string> values(keys.size(), value);
+        tinylfu.insert_many(keys, values, {100, 1, 1});
+        tinylfu.trim();
+        REQUIRE(gdsf->contains(key));
+        REQUIRE(gdsf->contains("cheap"));
+        // admitted first, but the expensive key outranks the cheap one
+        std::string victim;
+        REQUIRE(gdsf->peek_victim(key, victim));
+        REQUIRE(victim == "cheap");
+    }
+
+    SECTION("operator[] ranks a default value for a missing key") {
+        cache[key] = value;
+        REQUIRE(cache.size() == 1);
+        REQUIRE(cache.at(key) == value);
+        std::string victim;
+        REQUIRE(cache.peek_victim(key, victim));
+        REQUIRE(victim == key);
+    }
+}
+
+TEST_CASE("lfu cache evicts the least frequently used key", "[LFUCache]") {
+    int cache_size = 100;
+    LFUCache<std::string, std::string> cache(cache_size);
+
+    std::string key = "test_key";
+    std::string value = "test_value";
+
+    SECTION("hits move keys to higher frequency buckets") {
+        cache.insert(key, value);
+        REQUIRE(cache.frequency(key) == 1);
+        cache.lookup(key);
+        cache.lookup(key);
+        REQUIRE(cache.frequency(key) == 3);
+        REQUIRE(cache.frequency("missing") == 0);
+    }
+
+    SECTION("ties are broken by insertion order") {
+        for (int i = 0; i < cache_size; i++) {
+            cache.insert(key + std::to_string(i), value);
+        }
+        std::string victim;
+        REQUIRE(cache.peek_victim(key, victim));
+        REQUIRE(victim == key + "0");
+        cache.insert(key, value);
+        REQUIRE(!cache.lookup(key + "0"));
+        REQUIRE(cache.size() == cache_size);
+    }
+
+    SECTION("frequently used keys survive a scan of one-time keys") {
+        for (int i = 0; i < 10; i++) {
+            cache.insert(key + std::to_string(i), value);
+            cache.lookup(key + std::to_string(i));
+        }
+        for (int i = 0; i < 10 * cache_size; i++) {
+            cache.insert_no_evict("scan" + std::to_string(i), value);
+            cache.trim();
+        }
+        REQUIRE(cache.size() == cache_size);
+        for (int i = 0; i < 10; i++) {
+            REQUIRE(cache.lookup(key + std::to_string(i)));
+        }
+    }
+
+    SECTION("aging lets stale frequent keys be evicted") {
+        cache.set_aging(true);
+        cache.insert(key, value);
+        for (int i = 0; i < 20; i++) {
+            cache.lookup(key);
+        }
+        // the eviction floor rises by one each time a full cache of one-time keys turns over
+        for (int i = 0; i < 30 * cache_size; i++) {
+            cache.insert("scan" + std::to_string(i), value);
+        }
+        REQUIRE(!cache.lookup(key));
+        REQUIRE(cache.size() == cache_size);
+    }
+
+    SECTION("operator[] places a default value for a missing key") {
+        cache[key] = value;
+        REQUIRE(cache.size() == 1);
+        REQUIRE(cache.frequency(key) == 1);
+        REQUIRE(cache.at(key) == value);
+    }
+}
+
+TEST_CASE("byte budget bounds cache memory", "[ByteBudget]") {
+    int cache_size = 1000;
+    uint64_t budget = 16 * 1024;
+
+    std::string key = "test_key";
+    std::string value(200, 'A');
+
+    SECTION("lru tracks bytes on insert and evict") {
+        LRUCache<std::string, std::string> cache(cache_size);
+        REQUIRE(cache.bytes() == 0);
+        cache.insert(key, value);
+        uint64_t entry = cache.bytes();
+        REQUIRE(entry > key.size() + value.size());
+        cache.insert(key + "1", value);
+        uint64_t both = cache.bytes();
+        REQUIRE(both > entry);
+        cache.set_max_size(2);
+        cache.trim();
+        REQUIRE(cache.size() == 1);
+        REQUIRE(cache.bytes() < both);
+        cache.clear();
+        REQUIRE(cache.bytes() == 0);
+    }
+
+    SECTION("trim evicts down to the byte budget") {
+        std::vector<std::shared_ptr<CacheIndex<std::string, std::string> > > caches;
+        caches.emplace_back(std::make_shared<LRUCache<std::string, std::string> >(cache_size));
+        caches.emplace_back(std::make_shared<SlabLRUCache<std::string, std::string> >(cache_size));
+        caches.emplace_back(std::make_shared<S3FIFOCache<std::string, std::string> >(cache_size));
+        caches.emplace_back(std::make_shared<ARCCache<std::string, std::string> >(cache_size));
+        caches.emplace_back(std::make_shared<LFUCache<std::string, std::string> >(cache_size));
+        caches.emplace_back(std::make_shared<ShardedCache<std::string, std::string> >(4, cache_size));
+        for (auto &cache : caches) {
+            cache->set_max_bytes(budget);
+            for (int i = 0; i < cache_size / 2; i++) {
+                cache->insert_no_evict(key + std::to_string(i), value);
+            }
+            REQUIRE(cache->bytes() > budget);
+            cache->trim();
+            REQUIRE(cache->bytes() <= budget);
+            REQUIRE(cache->size() > 0);
+            REQUIRE(cache->size() < cache_size / 2);
+        }
+    }
+
+    SECTION("insert evicts to make room within the budget") {
+        GDSFCache<std::string, std::string> cache(cache_size);
+        cache.set_max_bytes(budget);
+        for (int i = 0; i < cache_size; i++) {
+            cache.insert(key + std::to_string(i), value);
+            REQUIRE(cache.bytes() <= budget);
+        }
+        REQUIRE(cache.size() < cache_size);
+    }
+}
+
+TEST_CASE("cache snapshots restore entries for the same setup only", "[CacheSnapshot]") {
+    int cache_size = 100;
+    std::string path = "test_cache_snapshot.bin";
+    uint64_t fingerprint = snapshot_fingerprint({"ref.fa", "bowtie2 --mm -x ref"});
+
+    std::string key = "test_key";
+    std::string value = "test_value";
+
+    LRUCache<std::string, std::string> cache(cache_size);
+    for (int i = 0; i < cache_size / 2; i++) {
+        cache.insert(key + std::to_string(i), value + std::to_string(i));
+    }
+    cache.lookup(key + "0");
+    REQUIRE(cache.save_snapshot(path, fingerprint));
+
+    SECTION("values and recency are restored") {
+        LRUCache<std::string, std::string> warm(cache_size);
+        REQUIRE(warm.load_snapshot(path, fingerprint) == cache_size / 2);
+        REQUIRE(warm.size() == cache_size / 2);
+        REQUIRE(warm.hits() == 0);
+        REQUIRE(warm.lookup(key + "7")->get() == value + "7");
+        std::string victim;
+        REQUIRE(warm.peek_victim(key, victim));
+        REQUIRE(victim == key + "1");
+    }
+
+    SECTION("smaller caches keep the most recent entries") {
+        LRUCache<std::string, std::string> warm(10);
+        warm.load_snapshot(path, fingerprint);
+        REQUIRE(warm.size() < 10);
+        REQUIRE(warm.lookup(key + "0"));
+        REQUIRE(!warm.lookup(key + "1"));
+    }
+
+    SECTION("snapshots from another setup are ignored") {
+        LRUCache<std::string, std::string> warm(cache_size);
+        REQUIRE(warm.load_snapshot(path, snapshot_fingerprint({"other.fa", "bowtie2 --mm -x ref"})) == 0);
+        REQUIRE(warm.load_snapshot("missing_snapshot.bin", fingerprint) == 0);
+        REQUIRE(warm.size() == 0);
+    }
+
+    SECTION("truncated snapshots are ignored") {
+        std::ifstream in(path, std::ios::binary);
+        std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        in.close();
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(bytes.data(), bytes.size() / 2);
+        out.close();
+        LRUCache<std::string, std::string> warm(cache_size);
+        REQUIRE(warm.load_snapshot(path, fingerprint) == 0);
+    }
+
+    SECTION("sharded caches load through any shard count") {
+        ShardedCache<std::string, std::string> sharded(4, cache_size);
+        for (int i = 0; i < cache_size / 2; i++) {
+            sharded.insert(key + std::to_string(i), value);
+        }
+        REQUIRE(sharded.save_snapshot(path, fingerprint));
+        ShardedCache<std::string, std::string> warm(2, cache_size);
+        REQUIRE(warm.load_snapshot(path, fingerprint) == cache_size / 2);
+        for (int i = 0; i < cache_size / 2; i++) {
+            REQUIRE(warm.lookup(key + std::to_string(i)));
+        }
+        for (int i = 0; i < 4; i++) {
+            std::remove((path + "." + std::to_string(i)).c_str());
+        }
+    }
+
+    std::remove(path.c_str());
+}
+
+TEST_CASE("shared memory caches are visible to every attached cache", "[SharedMemoryCache]") {
+    std::string name = "/sealm_test_cache_" + std::to_string(getpid());
+    SharedMemoryCache<std::string, std::string>::unlink(name);
+
+    std::string key = "test_key";
+    std::string value = "test_value";
+
+    SharedMemoryCache<std::string, std::string> cache(name, 64, 7, 4, 32, 32);
+    REQUIRE(cache.capacity() == 64);
+    REQUIRE(cache.size() == 0);
+
+    SECTION("inserts from one cache hit in another") {
+        SharedMemoryCache<std::string, std::string> other(name, 1, 7);
+        REQUIRE(other.capacity() == 64);
+        cache.insert(key, value);
+        REQUIRE(other.size() == 1);
+        REQUIRE(other.lookup(key)->get() == value);
+        REQUIRE(other.find(key)->get().compare(value) == 0);
+        REQUIRE(other.hits() == 2);
+        REQUIRE(cache.hits() == 0);
+        REQUIRE_THROWS_AS(other.at(key + "missing"), std::out_of_range);
+        other.clear();
+        REQUIRE(!cache.lookup(key));
+    }
+
+    SECTION("caches of another setup do not attach") {
+        using Cache = SharedMemoryCache<std::string, std::string>;
+        cache.insert(key, value);
+        REQUIRE_THROWS_AS(Cache(name, 1, 8), std::runtime_error);
+        REQUIRE_THROWS_AS(Cache(name, 1), std::runtime_error);
+        REQUIRE(cache.lookup(key)->get() == value);
+    }
+
+    SECTION("full buckets evict within the bucket") {
+        uint64_t evicted = 0;
+        cache.set_eviction_callback([&evicted](const std::string &k, const std::string &v) { evicted++; });
+        for (int i = 0; i < 1000; i++) {
+            cache.insert(key + std::to_string(i), value + std::to_string(i));
+        }
+        REQUIRE(cache.size() <= cache.capacity());
+        REQUIRE(evicted == 1000 - cache.size());
+        REQUIRE(cache.lookup(key + "999")->get() == value + "999");
+    }
+
+    SECTION("entries larger than a slot are not cached") {
+        cache.insert(key, std::string(64, 'A'));
+        REQUIRE(cache.oversized() == 1);
+        REQUIRE(!cache.lookup(key));
+        REQUIRE(cache.size() == 0);
+    }
+
+    SharedMemoryCache<std::string, std::string>::unlink(name);
+}
+
+TEST_CASE("disk tier keeps entries evicted from memory", "[DiskTierCache]") {
+    int cache_size = 10;
+    std::string dir = "test_disk_tier";
+
+    std::string key = "test_key";
+    std::string value = "test_value";
+
+    std::shared_ptr<CacheIndex<std::string, std::string> > memory;
+    memory = std::make_shared<LRUCache<std::string, std::string> >(cache_size);
+    DiskTierCache<std::string, std::string> cache(dir, 0, 4096);
+    cache.set_cache(memory);
+
+    for (int i = 0; i < cache_size * 10; i++) {
+        cache.insert(key + std::to_string(i), value + std::to_string(i));
+    }
+    REQUIRE(memory->size() < cache_size);
+    REQUIRE(memory->size() + cache.disk_size() == cache_size * 10);
+
+    SECTION("disk hits are promoted back to memory") {
+        REQUIRE(!memory->lookup(key + "0"));
+        REQUIRE(cache.lookup(key + "0")->get() == value + "0");
+        REQUIRE(memory->lookup(key + "0"));
+        REQUIRE(cache.disk_hits() == 1);
+        REQUIRE(cache.find(key + "1")->get().compare(value + "1") == 0);
+        REQUIRE(cache.at(key + "2") == value + "2");
+        REQUIRE(cache.hits() == 3);
+        REQUIRE(!cache.lookup(key + "missing"));
+        REQUIRE(cache.misses() == 1);
+        REQUIRE(memory->size() + cache.disk_size() == cache_size * 10);
+    }
+
+    SECTION("a promoted value stays readable once memory drops it") {
+        std::string &promoted = cache.at(key + "0");
+        memory->clear();
+        REQUIRE(promoted == value + "0");
+    }
+
+    SECTION("every entry survives a full scan through a small memory tier") {
+        for (int i = 0; i < cache_size * 10; i++) {
+            REQUIRE(cache.lookup(key + std::to_string(i))->get() == value + std::to_string(i));
+        }
+        cache.trim();
+        REQUIRE(cache.disk_hits() >= cache_size * 9);
+    }
+
+    SECTION("a disk budget drops the oldest segments") {
+        uint64_t dropped = 0;
+        cache.set_eviction_callback([&dropped](const std::string &k, const std::string &v) { dropped++; });
+        cache.set_max_disk_bytes(4096);
+        for (int i = 0; i < cache_size * 100; i++) {
+            cache.insert(key + std::to_string(i) + "_new", value);
+        }
+        REQUIRE(cache.disk_bytes() <= 4096 * 2);
+        REQUIRE(dropped > 0);
+        REQUIRE(!cache.lookup(key + "0"));
+        REQUIRE(memory->size() + cache.disk_size() + dropped == cache_size * 110);
+    }
+
+    SECTION("clear empties both tiers") {
+        cache.clear();
+        REQUIRE(cache.disk_size() == 0);
+        REQUIRE(cache.disk_bytes() == 0);
+        REQUIRE(!cache.lookup(key + "0"));
+    }
+}
+
+TEST_CASE("compressed cache stores cold values compactly", "[CompressedCache]") {
+    int cache_size = 1000;
+    std::string key = "test_key";
+    std::string value = "read_name\t0\tchr1\t10468\t1\t80M\t*\t0\t0\t"
+                        "CCCTAACCCTAACCCTAACCCTAACCCTAACCCTAACCCTAACCCTAACCCTAACCCTAACCCTAACCCTAACCCTAACC\t"
+                        "IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII\t"
+                        "AS:i:-5\tXS:i:-5\tXN:i:0\tXM:i:1\tXO:i:0\tXG:i:0\tNM:i:1\tMD:Z:";
+
+    std::shared_ptr<CacheIndex<std::string, std::string> > cold;
+    cold = std::make_shared<LRUCache<std::string, std::string> >(cache_size);
+    CompressedCache<std::string, std::string> cache;
+    cache.set_cache(cold);
+    REQUIRE(cache.capacity() == cache_size);
+
+    for (int i = 0; i < cache_size / 2; i++) {
+        cache.insert_no_evict(key + std::to_string(i), value + std::to_string(i));
+    }
+    cache.trim();
+
+    SECTION("cold values read back unchanged") {
+        REQUIRE(cold->size() > 0);
+        REQUIRE(cache.dictionary_ready());
+        for (int i = 0; i < cache_size / 2; i++) {
+            REQUIRE(cache.lookup(key + std::to_string(i))->get() == value + std::to_string(i));
+        }
+        REQUIRE(cache.find(key + "0")->get().compare(value + "0") == 0);
+        REQUIRE(!cache.find(key + "missing"));
+        REQUIRE_THROWS_AS(cache.at(key + "missing"), std::out_of_range);
+        REQUIRE(cache.hits() == cache_size / 2 + 1);
+    }
+
+    SECTION("similar SAM lines compress well") {
+        REQUIRE(cache.compression_ratio() < 0.5);
+        REQUIRE(cold->lookup(key + "0")->get().size() < value.size() / 2);
+    }
+
+    SECTION("evicted values are reported uncompressed") {
+        std::string evicted;
+        cache.set_eviction_callback([&evicted](const std::string &k, const std::string &v) { evicted = v; });
+        cache.set_max_size(100);
+        cache.trim();
+        REQUIRE(evicted.rfind(value, 0) == 0);
+    }
+}
+
+TEST_CASE("near match cache finds keys within a few mismatches", "[NearMatchCache]") {
+    int cache_size = 100;
+    std::string read = "ACGTTGCAACGGATCCTAGCATCGATCGGATC";
+    std::string value = "test_value";
+
+    std::shared_ptr<CacheIndex<std::string, std::string> > lru;
+    lru = std::make_shared<LRUCache<std::string, std::string> >(cache_size);
+    NearMatchCache<std::string, std::string> cache(2);
+    cache.set_cache(lru);
+    cache.insert_no_evict(read, value);
+    cache.trim();
+    std::string match;
+
+    SECTION("exact lookups pass through") {
+        REQUIRE(cache.lookup(read)->get() == value);
+        REQUIRE(cache.hits() == 1);
+        REQUIRE_FALSE(cache.lookup_near(read, match));
+    }
+
+    SECTION("keys within max mismatches are found") {
+        std::string one = read, two = read, three = read;
+        one[3] = 'A';
+        two[3] = 'A';
+        two[30] = 'C';
+        three[3] = 'A';
+        three[15] = 'A';
+        three[30] = 'C';
+        REQUIRE_FALSE(cache.lookup(one));
+        REQUIRE(cache.lookup_near(one, match)->get() == value);
+        REQUIRE(match == read);
+        REQUIRE(cache.lookup_near(two, match)->get() == value);
+        REQUIRE_FALSE(cache.lookup_near(three, match));
+        REQUIRE_FALSE(cache.lookup_near(read.substr(1), match));
+        REQUIRE(cache.near_hits() == 2);
+        // near probes are not exact hits
+        REQUIRE(cache.hits() == 0);
+        REQUIRE(cache.misses() == 1);
+    }
+
+    SECTION("evicted keys leave the index") {
+        std::string evicted;
+        cache.set_eviction_callback([&evicted](const std::string &k, const std::string &v) { evicted = k; });
+        std::string other = read;
+        other[0] = 'T';
+        uint64_t indexed = cache.bytes() - lru->bytes();
+        cache.set_max_size(1);
+        cache.insert(other, value);
+        REQUIRE(evicted == read);
+        REQUIRE(cache.bytes() - lru->bytes() == indexed);
+        std::string near = read;
+        near[30] = 'A';
+        near[31] = 'A';
+        REQUIRE_FALSE(cache.lookup_near(near, match));
+        near[0] = 'T';
+        REQUIRE(cache.lookup_near(near, match)->get() == value);
+    }
+
+    SECTION("cleared caches find nothing") {
+        cache.clear();
+        std::string one = read;
+        one[3] = 'A';
+        REQUIRE_FALSE(cache.lookup_near(one, match));
+        REQUIRE(cache.bytes() == lru->bytes());
+    }
+
+    SECTION("keys turned away by an admission filter are not indexed") {
+        std::shared_ptr<CacheIndex<std::string, std::string> > bfe;
+        bfe = std::make_shared<BFECache<std::string, std::string> >(cache_size);
+        std::static_pointer_cast<BFECache<std::string, std::string> >(bfe)->set_cache(lru);
+        NearMatchCache<std::string, std::string> filtered(2);
+        filtered.set_cache(bfe);
+        std::string other = read;
+        other[0] = 'T';
+        uint64_t base = filtered.bytes();
+        // first sightings only pass the filter, the cache is not touched
+        for (int i = 0; i < cache_size; i++) {
+            std::string seen = other;
+            seen[8 + i % 16] = "ACGT"[i % 4];
+            filtered.insert_no_evict(seen + std::to_string(i), value);
+        }
+        filtered.insert_no_evict(other, value);
+        REQUIRE(filtered.bytes() == base);
+        std::string near = other;
+        near[3] = 'A';
+        REQUIRE_FALSE(filtered.lookup_near(near, match));
+        // the second sighting is cached and indexed
+        filtered.insert_no_evict(other, value);
+        REQUIRE(filtered.contains(other));
+        REQUIRE(filtered.lookup_near(near, match)->get() == value);
+        REQUIRE(match == other);
+    }
+}
+
+TEST_CASE("containment cache finds keys containing a key", "[ContainmentCache]") {
+    int cache_size = 100;
+    std::string read = "ACGTTGCAACGGATCCTAGCATCGATCGGATCTTAGCCATGCAATCGG";
+    std::string value = "test_value";
+
+    std::shared_ptr<CacheIndex<std::string, std::string> > lru;
+    lru = std::make_shared<LRUCache<std::string, std::string> >(cache_size);
+    ContainmentCache<std::string, std::string> cache;
+    cache.set_cache(lru);
+    cache.insert_no_evict(read, value);
+    cache.trim();
+    std::string match;
+
+    SECTION("prefixes, suffixes and inner stretches are found") {
+        for (uint64_t offset = 0; offset + cache.min_length() <= read.size(); offset++) {
+            REQUIRE(cache.lookup_near(read.substr(offset, cache.min_length()), match)->get() == value);
+            REQUIRE(match == read);
+        }
+        REQUIRE(cache.lookup_near(read.substr(0, 40), match));
+        REQUIRE(cache.lookup_near(read.substr(read.size() - 40), match));
+        REQUIRE(cache.near_hits() == read.size() - cache.min_length() + 3);
+        REQUIRE(cache.hits() == 0);
+    }
+
+    SECTION("keys it cannot contain are not found") {
+        std::string changed = read.substr(5, 30);
+        changed[20] = 'A';
+        REQUIRE_FALSE(cache.lookup_near(changed, match));
+        REQUIRE_FALSE(cache.lookup_near(read, match));
+        REQUIRE_FALSE(cache.lookup_near(read.substr(0, cache.min_length() - 1), match));
+        REQUIRE_FALSE(cache.lookup_near(read + "A", match));
+    }
+
+    SECTION("the shortest containing key is preferred") {
+        std::string shorter = read.substr(0, 40);
+        cache.insert(shorter, "shorter");
+        REQUIRE(cache.lookup_near(read.substr(4, 30), match)->get() == "shorter");
+        REQUIRE(match == shorter);
+    }
+
+    SECTION("lookups it cannot answer go to the layer below") {
+        std::shared_ptr<CacheIndex<std::string, std::string> > near;
+        near = std::make_shared<NearMatchCache<std::string, std::string> >(1);
+        std::static_pointer_cast<NearMatchCache<std::string, std::string> >(near)->set_cache(lru);
+        ContainmentCache<std::string, std::string> stacked;
+        stacked.set_cache(near);
+        stacked.insert(read + "T", value);
+        std::string one = read + "A";
+        REQUIRE(stacked.lookup_near(one, match)->get() == value);
+        REQUIRE(match == read + "T");
+    }
+
+    SECTION("evicted keys leave the index") {
+        uint64_t indexed = cache.bytes() - lru->bytes();
+        REQUIRE(indexed > read.size());
+        cache.set_max_size(1);
+        cache.insert("TTTTTTTTTTTTTTTTTTTTTTTTTTTTTT", value);
+        REQUIRE_FALSE(cache.lookup_near(read.substr(0, 30), match));
+        cache.clear();
+        REQUIRE(cache.bytes() == lru->bytes());
+    }
+}
+
+TEST_CASE("maintained cache inserts and evicts in the background", "[MaintainedCache]") {
+    int cache_size = 100;
+
+    std::string key = "test_key";
+    std::string value = "test_value";
+
+    std::shared_ptr<CacheIndex<std::string, std::string> > lru;
+    lru = std::make_shared<LRUCache<std::string, std::string> >(cache_size);
+    MaintainedCache<std::string, std::string> cache(0.5, 1.0);
+    cache.set_cache(lru);
+
+    SECTION("inserts are visible once flushed") {
+        cache.insert(key, value);
+        cache.insert_no_evict(key + "1", value + "1", 2.0);
+        cache.flush();
+        REQUIRE(cache.pending() == 0);
+        REQUIRE(cache.lookup(key)->get() == value);
+        REQUIRE(*cache.acquire(key + "1") == value + "1");
+        REQUIRE(lru->size() == 2);
+    }
+
+    SECTION("operator[] sees queued inserts and places missing keys") {
+        cache.insert(key, value);
+        REQUIRE(cache[key] == value);
+        std::string missing = key + "missing";
+        cache[missing] = value + "1";
+        REQUIRE(lru->lookup(missing)->get() == value + "1");
+    }
+
+    SECTION("batches are applied in full") {
+        std::vector<std::string> keys, values;
+        std::vector<double> costs;
+        for (int i = 0; i < 50; i++) {
+            keys.emplace_back(key + std::to_string(i));
+            values.emplace_back(value + std::to_string(i));
+            costs.emplace_back(1.0);
+        }
+        cache.insert_many(keys, values, costs);
+        cache.flush();
+        std::vector<std::shared_ptr<const std::string> > handles;
+        cache.find_many(keys, handles);
+        for (int i = 0; i < 50; i++) {
+            REQUIRE(handles[i]);
+            REQUIRE(*handles[i] == value + std::to_string(i));
+        }
+    }
+
+    SECTION("an overfull cache is evicted down to the low watermark") {
+        for (int i = 0; i < cache_size * 10; i++) {
+            cache.insert_no_evict(key + std::to_string(i), value + std::to_string(i));
+        }
+        cache.trim();
+        cache.flush();
+        REQUIRE(cache.size() <= cache_size);
+        REQUIRE(cache.evicted() + cache.size() == cache_size * 10);
+        REQUIRE(cache.lookup(key + std::to_string(cache_size * 10 - 1)));
+        REQUIRE_FALSE(cache.lookup(key + "0"));
+
+        // each step evicts at most the entries it is given
+        for (int i = 0; i < cache_size; i++)
+            lru->insert_no_evict(key + "x" + std::to_string(i), value);
+        REQUIRE(lru->trim_to(cache_size / 2, 10) == 10);
+        REQUIRE(lru->trim_to(cache_size / 2, cache_size * 10) > 0);
+        REQUIRE(lru->size() == cache_size / 2);
+    }
+
+    SECTION("clear drops queued entries") {
+        for (int i = 0; i < cache_size; i++) {
+            cache.insert(key + std::to_string(i), value);
+        }
+        cache.clear();
+        cache.flush();
+        REQUIRE(cache.size() == 0);
+        REQUIRE(cache.pending() == 0);
+    }
+
+    SECTION("the worker is joined with entries still queued") {
+        auto scoped = std::make_unique<MaintainedCache<std::string, std::string> >();
+        std::shared_ptr<CacheIndex<std::string, std::string> > other;
+        other = std::make_shared<LRUCache<std::string, std::string> >(cache_size);
+        scoped->set_cache(other);
+        for (int i = 0; i < cache_size * 10; i++) {
+            scoped->insert(key + std::to_string(i), value);
+        }
+        scoped.reset();
+        REQUIRE(other->size() <= cache_size * 10);
+    }
+}
+
+TEST_CASE("cache statistics describe how the cache is used", "[CacheStats]") {
+    std::string key = "test_key";
+    std::string value = "test_value";
+
+    SECTION("hit rates are fractions") {
+        LRUCache<std::string, std::string> cache(10);
+        cache.insert(key, value);
+        REQUIRE(cache.lookup(key));
+        REQUIRE_FALSE(cache.lookup(key + "1"));
+        REQUIRE(cache.hit_rate() == Approx(0.5));
+    }
+
+    SECTION("lock wait is only counted when the lock is contended") {
+        CacheMutex mutex;
+        {
+            std::lock_guard<CacheMutex> lock(mutex);
+        }
+        REQUIRE(mutex.wait_ns() == 0);
+
+        std::atomic<bool> started{false};
+        mutex.lock();
+        std::thread waiter([&]() {
+            started = true;
+            std::lock_guard<CacheMutex> lock(mutex);
+        });
+        while (!started);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        mutex.unlock();
+        waiter.join();
+        REQUIRE(mutex.contended() == 1);
+        REQUIRE(mutex.wait_ns() > 0);
+
+        SharedCacheMutex rw_mutex;
+        {
+            std::shared_lock<SharedCacheMutex> lock(rw_mutex);
+        }
+        REQUIRE(rw_mutex.wait_ns() == 0);
+
+        started = false;
+        rw_mutex.lock();
+        std::thread reader([&]() {
+            started = true;
+            std::shared_lock<SharedCacheMutex> lock(rw_mutex);
+        });
+        while (!started);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        rw_mutex.unlock();
+        reader.join();
+        REQUIRE(rw_mutex.contended() == 1);
+        REQUIRE(rw_mutex.wait_ns() > 0);
+
+        std::shared_ptr<CacheIndex<std::string, std::string> > lru;
+        lru = std::make_shared<LRUCache<std::string, std::string> >(10);
+        BFECache<std::string, std::string> bfe;
+        bfe.set_cache(lru);
+        bfe.insert(key, value);
+        REQUIRE(bfe.lock_wait_ns() == 0);
+    }
+
+    SECTION("probes, inserts and evictions are counted per window") {
+        CacheStats<std::string> stats;
+        std::vector<std::string> keys;
+        std::vector<bool> found;
+        std::vector<uint64_t> files;
+        for (int i = 0; i < 1000; i++) {
+            keys.emplace_back(key + std::to_string(i));
+            found.push_back(i % 4 == 0);
+            files.push_back(i % 2);
+        }
+
+        stats.record_probes(keys, found, files, 3);
+        auto window = stats.window();
+        REQUIRE(window.hits == 250);
+        REQUIRE(window.misses == 750);
+        REQUIRE(window.hit_rate() == Approx(0.25));
+
+        stats.record_inserts(keys);
+        stats.record_probes(keys, found, files, 3);
+        for (const auto &k : keys)
+            stats.record_eviction(k);
+        window = stats.window();
+        REQUIRE(window.hits == 250);
+        REQUIRE(window.inserts == 1000);
+        REQUIRE(window.evictions == 1000);
+        REQUIRE(stats.totals().hits == 500);
+
+        auto per_file = stats.per_file();
+        REQUIRE(per_file.size() == 2);
+        REQUIRE(per_file[0].hits == 500);
+        REQUIRE(per_file[1].hits == 0);
+        REQUIRE(per_file[1].misses == 1000);
+        auto per_chain = stats.per_chain();
+        REQUIRE(per_chain.size() == 4);
+        REQUIRE(per_chain[3].hits + per_chain[3].misses == 2000);
+    }
+
+    SECTION("histograms follow sampled keys on the probe clock") {
+        CacheStats<std::string> stats;
+        std::vector<std::string> keys;
+        for (int i = 0; i < 1000; i++)
+            keys.emplace_back(key + std::to_string(i));
+        std::vector<bool> found(keys.size(), false);
+        std::vector<uint64_t> files(keys.size(), 0);
+
+        stats.record_probes(keys, found, files, 0);
+        stats.record_inserts(keys);
+        stats.record_probes(keys, found, files, 0);
+        for (const auto &k : keys)
+            stats.record_eviction(k);
+
+        // every key is probed again 1000 probes later and evicted 1000 probes after it was inserted
+        auto reuse = stats.reuse_distance();
+        auto age = stats.eviction_age();
+        uint64_t sampled = 0;
+        for (uint64_t b = 0; b < reuse.size(); b++) {
+            if (b != 10) {
+                REQUIRE(reuse[b] == 0);
+                REQUIRE(age[b] == 0);
+            }
+            sampled += reuse[b];
+        }
+        REQUIRE(sampled > 0);
+        REQUIRE(sampled < keys.size() / 8);
+        REQUIRE(age[10] == sampled);
+
+        std::stringstream csv;
+        stats.serialize(csv, {"reads.fq"});
+        REQUIRE(csv.str().find("512," + std::to_string(sampled)) != std::string::npos);
+        REQUIRE(csv.str().find("reads.fq,0,2000,0") != std::string::npos);
+    }
+}
+
+TEST_CASE("miss ratio curve estimates lru hit rates at every capacity", "[MissRatioCurve]") {
+    // distinct, well spread hashes
+    auto hash_of = [](uint64_t i) {
+        uint64_t h = (i + 1) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        return h ^ (h >> 32);
+    };
+
+    SECTION("distances are bucketed by their leading bits") {
+        for (uint64_t d : {0ULL, 1ULL, 7ULL, 8ULL, 15ULL, 16ULL, 1000ULL, 123456789ULL}) {
+            uint64_t b = MissRatioCurve::bucket(d);
+            REQUIRE(MissRatioCurve::bucket_floor(b) <= d);
+            REQUIRE(MissRatioCurve::bucket_floor(b + 1) > d);
+        }
+        REQUIRE(MissRatioCurve::bucket(~0ULL) < MissRatioCurve::BUCKETS);
+    }
+
+    SECTION("without sampling the curve is exact") {
+        MissRatioCurve mrc(1.0, 1 << 12);
+        // 1000 keys in a loop, every reuse is at stack distance 1000
+        for (int pass = 0; pass < 5; pass++) {
+            for (uint64_t i = 0; i < 1000; i++)
+                mrc.access(hash_of(i));
+        }
+        REQUIRE(mrc.accesses() == 5000);
+        REQUIRE(mrc.hit_rate(900) == 0);
+        REQUIRE(mrc.hit_rate(1023) == Approx(0.8));
+        REQUIRE(mrc.hit_rate(1 << 20) == Approx(0.8));
+        auto curve = mrc.curve();
+        REQUIRE(curve.size() == 1);
+        REQUIRE(curve[0].capacity == 1023);
+
+        // a key reused right away is at distance 1
+        mrc.access(hash_of(999));
+        REQUIRE(mrc.hit_rate(1) > 0);
+    }
+
+    SECTION("a bounded sample tracks the curve of many keys") {
+        MissRatioCurve mrc(1.0, 256);
+        for (int pass = 0; pass < 5; pass++) {
+            for (uint64_t i = 0; i < 50000; i++)
+                mrc.access(hash_of(i));
+        }
+        REQUIRE(mrc.tracked() <= 256);
+        REQUIRE(mrc.sample_rate() < 0.01);
+        REQUIRE(mrc.hit_rate(30000) < 0.05);
+        REQUIRE(mrc.hit_rate(80000) == Approx(0.8).margin(0.05));
+    }
+
+    SECTION("cache statistics write the curve with capacities in bytes") {
+        CacheStats<std::string> stats;
+        std::vector<std::string> keys;
+        for (int i = 0; i < 100; i++)
+            keys.emplace_back("key" + std::to_string(i));
+        std::vector<bool> found(keys.size(), false);
+        std::vector<uint64_t> files(keys.size(), 0);
+        for (int pass = 0; pass < 200; pass++)
+            stats.record_probes(keys, found, files, 0);
+        REQUIRE_FALSE(stats.miss_ratio_curve().empty());
+
+        std::stringstream csv;
+        stats.serialize_curve(csv, 10);
+        std::string line;
+        std::getline(csv, line);
+        std::getline(csv, line);
+        REQUIRE(line == "Capacity,Bytes,Hit_Rate,Miss_Rate");
+        REQUIRE(std::getline(csv, line));
+        uint64_t capacity = std::stoull(line.substr(0, line.find(',')));
+        REQUIRE(line.find("," + std::to_string(capacity * 10) + ",") != std::string::npos);
+    }
+}
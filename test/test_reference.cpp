@@ -0,0 +1,106 @@
+#include <catch2/catch.hpp>
+
+#include <fstream>
+
+#include "../lib/reference.hpp"
+
+TEST_CASE("reference genomes load contigs from FASTA", "[ReferenceGenome]") {
+    std::string path = "test_reference.fa";
+    {
+        std::ofstream fout(path);
+        fout << ">chr1 first contig\nACGTacgt\nNNAC\r\n>chr2\n\nGGCC\n";
+    }
+    ReferenceGenome reference(path);
+    std::remove(path.c_str());
+
+    REQUIRE(reference.contigs() == 2);
+    REQUIRE(reference.bases() == 16);
+    REQUIRE(reference.contig("chr1") == std::string_view("ACGTACGTNNAC"));
+    REQUIRE(reference.contig("chr2") == std::string_view("GGCC"));
+    REQUIRE_FALSE(reference.contig("chr3"));
+    REQUIRE_THROWS_AS(ReferenceGenome("missing.fa"), std::runtime_error);
+}
+
+TEST_CASE("alignments are rescored for near matching reads", "[AlignmentRescorer]") {
+    auto reference = std::make_shared<ReferenceGenome>();
+    std::string contig = "TTTTTACGTTGCAACGGATCCTAGCATCGATCGGATCTTTTT";
+    reference->add_contig("chr1", contig);
+    AlignmentRescorer rescorer(reference, ScoringScheme::bowtie2(false));
+
+    // cached alignment of a read matching chr1 exactly from position 6
+    std::string seq = contig.substr(5, 32);
+    std::string qual(32, 'I');
+    std::string cached = "cached\t0\tchr1\t6\t42\t32M\t*\t0\t0\t" + seq + "\t" + qual +
+                         "\tAS:i:0\tXN:i:0\tXM:i:0\tXO:i:0\tXG:i:0\tNM:i:0\tOQ:Z:" + qual + "\tMD:Z:32\tYT:Z:UU";
+    AlignmentRecord record;
+    REQUIRE(record.parse(cached));
+
+    SECTION("mismatches update the score and edit tags") {
+        std::string read = seq;
+        read[3] = 'A';
+        std::string out;
+        REQUIRE(rescorer.rescore(record, "read_2", read, qual, out));
+        REQUIRE(out == "read_2\t0\tchr1\t6\t42\t32M\t*\t0\t0\t" + read + "\t" + qual +
+                       "\tAS:i:-6\tXN:i:0\tXM:i:1\tXO:i:0\tXG:i:0\tNM:i:1\tMD:Z:3T28\tYT:Z:UU");
+    }
+
+    SECTION("low quality mismatches cost less") {
+        std::string read = seq;
+        read[0] = 'C';
+        std::string low = qual;
+        low[0] = '#';
+        std::string out;
+        REQUIRE(rescorer.rescore(record, "read_2", read, low, out));
+        REQUIRE(out.find("\tAS:i:-2\t") != std::string::npos);
+        REQUIRE(out.find("\tMD:Z:0A31\t") != std::string::npos);
+    }
+
+    SECTION("reverse complements are placed on the other strand") {
+        std::string read = reverse_complement(seq);
+        read[0] = 'T';
+        std::string out;
+        REQUIRE(rescorer.rescore(record, "read_2", read, qual, out));
+        AlignmentRecord rescored;
+        REQUIRE(rescored.parse(out));
+        REQUIRE(rescored.reverse());
+        REQUIRE(rescored.pos == 6);
+        REQUIRE(detail::find_tag(rescored.tags, "NM:i:") == std::string_view("1"));
+        REQUIRE(detail::find_tag(rescored.tags, "MD:Z:") == std::string_view("31C0"));
+    }
+
+    SECTION("=/X CIGARs and gaps are rebuilt") {
+        // one base inserted after the fourth
+        std::string inserted = seq.substr(0, 4) + "G" + seq.substr(4, 27);
+        std::string line = "cached\t0\tchr1\t6\t42\t4=1I27=\t*\t0\t0\t" + inserted + "\t" + qual + "\tAS:i:-8";
+        REQUIRE(record.parse(line));
+        std::string read = inserted;
+        read[10] = 'A';
+        std::string out;
+        REQUIRE(rescorer.rescore(record, "read_2", read, qual, out));
+        REQUIRE(out == "read_2\t0\tchr1\t6\t42\t4=1I5=1X21=\t*\t0\t0\t" + read + "\t" + qual +
+                       "\tAS:i:-14\tNM:i:2\tMD:Z:9C21");
+    }
+
+    SECTION("alignments that no longer hold are rejected") {
+        std::string out;
+        std::string many = seq;
+        for (int i = 0; i < 32; i += 8)
+            many[i] = many[i] == 'A' ? 'C' : 'A';
+        REQUIRE_FALSE(rescorer.rescore(record, "read_2", many, qual, out));
+
+        // a secondary hit as good as the new score may be the better locus for this read
+        std::string read = seq;
+        read[3] = 'A';
+        std::string secondary = cached + "\tXS:i:-6";
+        REQUIRE(record.parse(secondary));
+        REQUIRE_FALSE(rescorer.rescore(record, "read_2", read, qual, out));
+
+        std::string unknown = "cached\t0\tchr9\t6\t42\t32M\t*\t0\t0\t" + seq + "\t" + qual;
+        REQUIRE(record.parse(unknown));
+        REQUIRE_FALSE(rescorer.rescore(record, "read_2", read, qual, out));
+        std::string unmapped = "cached\t4\t*\t0\t0\t*\t*\t0\t0\t" + seq + "\t" + qual;
+        REQUIRE(record.parse(unmapped));
+        REQUIRE_FALSE(rescorer.rescore(record, "read_2", read, qual, out));
+        REQUIRE(out.empty());
+    }
+}
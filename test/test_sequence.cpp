@@ -0,0 +1,68 @@
+#include <catch2/catch.hpp>
+
+#include "../lib/sequence.hpp"
+#include "../lib/cache.hpp"
+
+TEST_CASE("packed sequences compare and hash by their bases", "[PackedSequence]") {
+    std::string seq = "ACGTTGCAACGTTGCAACGTTGCAACGTTGCAACGTTGCA";
+
+    PackedSequence<> packed(seq);
+    REQUIRE(packed.size() == seq.size());
+    REQUIRE(packed.unpack() == seq);
+    REQUIRE(packed[33] == seq[33]);
+    REQUIRE(sizeof(PackedSequence<150>) <= 56);
+
+    SECTION("equal sequences are equal keys") {
+        PackedSequence<> same(seq);
+        PackedSequence<> other(seq.substr(1) + "A");
+        PackedSequence<> shorter(seq.substr(0, seq.size() - 1));
+        REQUIRE(packed == same);
+        REQUIRE(packed.hash() == same.hash());
+        REQUIRE(packed != other);
+        REQUIRE(packed != shorter);
+        REQUIRE(PackedSequence<>("acgt") == PackedSequence<>("ACGT"));
+    }
+
+    SECTION("N bases are escaped") {
+        std::string with_n = seq;
+        with_n[3] = 'N';
+        with_n[35] = 'N';
+        PackedSequence<> escaped(with_n);
+        REQUIRE(escaped.escapes() == 2);
+        REQUIRE(escaped.unpack() == with_n);
+        REQUIRE(escaped[3] == 'N');
+        REQUIRE(escaped != PackedSequence<>(seq));
+        with_n[3] = 'A';
+        REQUIRE(escaped != PackedSequence<>(with_n));
+
+        PackedSequence<> copy(escaped);
+        REQUIRE(copy == escaped);
+        copy = packed;
+        REQUIRE(copy == packed);
+        REQUIRE(escaped.unpack()[35] == 'N');
+    }
+
+    SECTION("byte forms match only for equal sequences") {
+        std::string a, b, c;
+        packed.append_bytes(a);
+        PackedSequence<>(seq).append_bytes(b);
+        PackedSequence<>(seq.substr(0, 39) + "N").append_bytes(c);
+        REQUIRE(a == b);
+        REQUIRE(a != c);
+        REQUIRE(a.size() == 2 + 2 * sizeof(uint64_t));
+    }
+
+    SECTION("sequences longer than the words are rejected") {
+        REQUIRE_THROWS_AS(PackedSequence<32>(seq), std::length_error);
+    }
+
+    SECTION("packed sequences are cache keys") {
+        LRUCache<PackedSequence<>, std::string> cache(100);
+        for (int i = 0; i < 50; i++) {
+            cache.insert(PackedSequence<>(seq.substr(i % 10) + std::string(i / 10, 'T')), std::to_string(i));
+        }
+        REQUIRE(cache.size() == 50);
+        REQUIRE(cache.lookup(PackedSequence<>(seq))->get() == "0");
+        REQUIRE(!cache.lookup(PackedSequence<>("ACGT")));
+    }
+}